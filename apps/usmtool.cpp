@@ -1,20 +1,771 @@
+#include "usm/carve.hpp"
+#include "usm/cpk.hpp"
+#include "usm/edit.hpp"
+#include "usm/follow.hpp"
+#include "usm/media.hpp"
+#include "usm/memory.hpp"
+#include "usm/output.hpp"
+#include "usm/serve.hpp"
+#include "usm/source.hpp"
 #include "usm/usm.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
 static void usage() {
     std::cerr
         << "Usage:\n"
         << "  usmtool demux <input.usm> -o <outdir> [--key <num>]\n"
-        << "             [--no-video] [--no-audio] [--no-alpha]\n";
+        << "             [--no-video] [--no-audio] [--no-alpha]\n"
+        << "             [--hash <crc32c|xxh64>] [--direct] [--recover] [--jobs <n>]\n"
+        << "             [--hca-key <num>] [--incremental]\n"
+        << "             [--follow [--idle-timeout <seconds>]]\n"
+        << "  usmtool demux <input.usm> --track <video|audio|alpha>:<chno>\n"
+        << "             -o <file|fifo|-> [--key <num>] [--hca-key <num>]\n"
+        << "             [--follow [--idle-timeout <seconds>]]\n"
+        << "  usmtool probe <input.usm> [--key <num>] [--recover] [--jobs <n>]\n"
+        << "             [--alloc-stats]\n"
+        << "  usmtool compare <a.usm> <b.usm> [--hash <crc32c|xxh64>]\n"
+        << "  usmtool remux <input.usm> -o <output.mkv|mp4> [--key <num>]\n"
+        << "             [--no-video] [--no-audio] [--no-alpha]\n"
+        << "             [--lang <chno>=<code>]...\n"
+        << "  usmtool segment <input.usm> -o <outdir> [--key <num>]\n"
+        << "             [--duration <seconds>] [--track <chno>]\n"
+        << "  usmtool thumbs <input.usm> -o <outdir> [--key <num>] [--track <chno>]\n"
+        << "             [--format <jpeg|png>] [--width <px>] [--count <n>]\n"
+        << "             [--columns <n>] [--jobs <n>]\n"
+        << "  usmtool decode <input.usm> -o <outdir> [--key <num>] [--hca-key <num>]\n"
+        << "             [--format <wav|flac>] [--jobs <n>]\n"
+        << "  usmtool cpk <archive.cpk> --list\n"
+        << "  usmtool cpk <archive.cpk> -o <outdir> [--key <num>] [--jobs <n>]\n"
+        << "             [--file <dir/name>]...\n"
+        << "  usmtool carve <blob> --list [--jobs <n>]\n"
+        << "  usmtool carve <blob> -o <outdir> [--key <num>] [--jobs <n>]\n"
+        << "  usmtool patch <input.usm> [--track <video|audio|alpha>:<chno>] [--page <n>]\n"
+        << "             <name>=<value>...\n"
+        << "  usmtool concat <a.usm> <b.usm>... -o <output.usm> [--direct]\n"
+        << "  usmtool replace-audio <input.usm> <audio.hca|adx> -o <output.usm>\n"
+        << "             [--channel <chno>] [--key <num>] [--name <filename>]\n"
+        << "  usmtool serve --socket <path> [--jobs <n>] [--max-queue <n>] [--cache <n>]\n";
 }
 
 static bool is_flag(const std::string& a, const char* s) { return a == s; }
 
+static std::optional<usm::ChunkType> parse_track_kind(const std::string& s) {
+    if (s == "video") return usm::ChunkType::VIDEO;
+    if (s == "audio") return usm::ChunkType::AUDIO;
+    if (s == "alpha") return usm::ChunkType::ALPHA;
+    return std::nullopt;
+}
+
+// Opens `path`, listing on stderr whatever recovery mode had to skip.
+static usm::Usm open_usm(const std::filesystem::path& path, std::optional<uint64_t> key,
+    bool recover, unsigned jobs,
+    std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+    usm::OpenOptions options;
+    options.key = key;
+    options.recover = recover;
+    options.jobs = jobs;
+    options.mr = mr;
+    usm::Usm u = usm::Usm::open(path, options);
+    for (const auto& r : u.skipped()) {
+        std::cerr << "Skipped " << r.size << " bytes at offset " << r.offset << ": "
+            << r.reason << "\n";
+    }
+    return u;
+}
+
+static int run_probe(const std::vector<std::string>& args) {
+    std::optional<uint64_t> key;
+    bool recover = false;
+    unsigned jobs = 1;
+    bool alloc_stats = false;
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--recover")) {
+            recover = true;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else if (is_flag(args[i], "--alloc-stats")) {
+            alloc_stats = true;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    // Pages and packet indexes of the open go through `counter`; their
+    // allocation count should not grow with the number of packets.
+    usm::CountingResource counter;
+    usm::Usm u = open_usm(args[1], key, recover, jobs, &counter);
+    if (alloc_stats) {
+        size_t packets = 0;
+        for (const auto* tracks : { &u.videos(), &u.audios(), &u.alphas() }) {
+            for (const auto& t : *tracks) packets += t.stream.size();
+        }
+        std::cerr << "Open: " << counter.allocations() << " allocations, "
+            << counter.bytes_allocated() << " bytes for " << packets << " packets\n";
+    }
+
+    auto print = [&](const char* kind, const std::vector<usm::Track>& tracks) {
+        for (const auto& t : tracks) {
+            usm::MediaInfo m = usm::probe_track(u, t);
+            std::cout << kind << ":" << t.channel_number << " " << m.format << " "
+                << m.codec;
+            if (m.width > 0) std::cout << " " << m.width << "x" << m.height;
+            if (m.sample_rate > 0) {
+                std::cout << " " << m.sample_rate << "Hz " << m.channels << "ch";
+            }
+            std::cout << " duration=" << m.duration << "s frames=" << m.frame_count
+                << "\n";
+        }
+        };
+
+    print("video", u.videos());
+    print("audio", u.audios());
+    print("alpha", u.alphas());
+    return 0;
+}
+
+static int run_remux(const std::vector<std::string>& args) {
+    std::filesystem::path output;
+    std::optional<uint64_t> key;
+    usm::RemuxOptions options;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            output = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--lang") && i + 1 < args.size()) {
+            const std::string& v = args[i + 1];
+            size_t eq = v.find('=');
+            if (eq == std::string::npos) {
+                usage();
+                return 2;
+            }
+            options.audio_languages[std::stoi(v.substr(0, eq))] = v.substr(eq + 1);
+            i++;
+        }
+        else if (is_flag(args[i], "--no-video")) {
+            options.video = false;
+        }
+        else if (is_flag(args[i], "--no-audio")) {
+            options.audio = false;
+        }
+        else if (is_flag(args[i], "--no-alpha")) {
+            options.alpha = false;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (output.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::Usm u = usm::Usm::open(args[1], key);
+    usm::remux(u, output, options);
+    return 0;
+}
+
+static int run_segment(const std::vector<std::string>& args) {
+    std::filesystem::path outdir;
+    std::optional<uint64_t> key;
+    double duration = 4.0;
+    int chno = 0;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            outdir = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--duration") && i + 1 < args.size()) {
+            duration = std::stod(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--track") && i + 1 < args.size()) {
+            chno = std::stoi(args[i + 1]);
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (outdir.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::Usm u = usm::Usm::open(args[1], key);
+    for (const auto& t : u.videos()) {
+        if (t.channel_number != chno) continue;
+        usm::Segmenter seg(u, t, duration);
+        seg.write_all(outdir);
+        return 0;
+    }
+    std::cerr << "Error: no video track " << chno << "\n";
+    return 1;
+}
+
+// Writes poster.<ext> and contact.<ext> for one video track.
+static int run_thumbs(const std::vector<std::string>& args) {
+    std::filesystem::path outdir;
+    std::optional<uint64_t> key;
+    int chno = 0;
+    usm::ThumbnailOptions options;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            outdir = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--track") && i + 1 < args.size()) {
+            chno = std::stoi(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--format") && i + 1 < args.size()) {
+            if (args[i + 1] == "jpeg" || args[i + 1] == "jpg") {
+                options.format = usm::ImageFormat::JPEG;
+            }
+            else if (args[i + 1] == "png") options.format = usm::ImageFormat::PNG;
+            else {
+                usage();
+                return 2;
+            }
+            i++;
+        }
+        else if (is_flag(args[i], "--width") && i + 1 < args.size()) {
+            options.width = std::stoi(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--count") && i + 1 < args.size()) {
+            options.count = std::stoi(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--columns") && i + 1 < args.size()) {
+            options.columns = std::stoi(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            options.jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (outdir.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::Usm u = usm::Usm::open(args[1], key);
+    const usm::Track* t = u.find_track(usm::ChunkType::VIDEO, chno);
+    if (t == nullptr) {
+        std::cerr << "Error: no video track " << chno << "\n";
+        return 1;
+    }
+
+    const char* ext = options.format == usm::ImageFormat::PNG ? ".png" : ".jpg";
+    std::filesystem::create_directories(outdir);
+    auto write_file = [](const std::filesystem::path& p, const usm::Bytes& data) {
+        std::ofstream out(p, std::ios::binary);
+        if (!out) throw std::runtime_error("Failed to open output: " + p.string());
+        out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+        };
+    write_file(outdir / (std::string("poster") + ext), usm::poster_frame(u, *t, 0.1, options));
+    write_file(outdir / (std::string("contact") + ext), usm::contact_sheet(u, *t, options));
+    return 0;
+}
+
+// Decodes every audio track to WAV/FLAC. The HCA key defaults to the USM key.
+static int run_decode(const std::vector<std::string>& args) {
+    std::filesystem::path outdir;
+    std::optional<uint64_t> key;
+    usm::AudioDecodeOptions options;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            outdir = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--hca-key") && i + 1 < args.size()) {
+            options.hca_key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--format") && i + 1 < args.size()) {
+            if (args[i + 1] == "wav") options.format = usm::AudioFormat::WAV;
+            else if (args[i + 1] == "flac") options.format = usm::AudioFormat::FLAC;
+            else {
+                usage();
+                return 2;
+            }
+            i++;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            options.jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (outdir.empty()) {
+        usage();
+        return 2;
+    }
+    if (!options.hca_key.has_value()) options.hca_key = key;
+
+    usm::Usm u = usm::Usm::open(args[1], key);
+    for (const auto& p : usm::decode_audio_tracks(u, outdir, options)) {
+        std::cout << p.string() << "\n";
+    }
+    return 0;
+}
+
+static int run_cpk(const std::vector<std::string>& args) {
+    std::filesystem::path outdir;
+    std::optional<uint64_t> key;
+    unsigned jobs = 0;
+    bool list = false;
+    std::vector<std::string> files;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            outdir = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else if (is_flag(args[i], "--file") && i + 1 < args.size()) {
+            files.push_back(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--list")) {
+            list = true;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (!list && outdir.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::Cpk cpk = usm::Cpk::open(args[1]);
+
+    if (list) {
+        for (const auto& e : cpk.entries()) {
+            std::cout << e.path() << " offset=" << e.offset << " size=" << e.size;
+            if (e.compressed()) std::cout << " extract_size=" << e.extract_size;
+            std::cout << "\n";
+        }
+        return 0;
+    }
+
+    std::vector<const usm::CpkEntry*> entries;
+    if (files.empty()) {
+        entries = cpk.usm_entries();
+    }
+    for (const auto& f : files) {
+        const usm::CpkEntry* e = cpk.find(f);
+        if (e == nullptr) {
+            std::cerr << "Error: no such file " << f << "\n";
+            return 1;
+        }
+        entries.push_back(e);
+    }
+
+    auto errors = cpk.demux_all(entries, outdir, key, jobs);
+    for (const auto& err : errors) {
+        std::cerr << "Error: " << err.path << ": " << err.message << "\n";
+    }
+    return errors.empty() ? 0 : 1;
+}
+
+// Finds USMs embedded in a disk image or other blob and lists or demuxes
+// them in place.
+static int run_carve(const std::vector<std::string>& args) {
+    std::filesystem::path outdir;
+    std::optional<uint64_t> key;
+    usm::CarveOptions options;
+    bool list = false;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            outdir = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            options.jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else if (is_flag(args[i], "--list")) {
+            list = true;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (!list && outdir.empty()) {
+        usage();
+        return 2;
+    }
+
+    auto source = std::make_shared<usm::MmapSource>(args[1]);
+    const auto found = usm::carve_usms(*source, options);
+
+    if (list) {
+        for (const auto& c : found) {
+            std::cout << "offset=" << c.offset << " size=" << c.size << " " << c.name() << "\n";
+        }
+        return 0;
+    }
+
+    auto errors = usm::demux_carved(source, found, outdir, key, options.jobs);
+    for (const auto& err : errors) {
+        std::cerr << "Error: offset " << err.offset << ": " << err.message << "\n";
+    }
+    return errors.empty() ? 0 : 1;
+}
+
+// Converts `text` to an element of `type`; new elements are strings.
+static usm::ElementValue parse_element(usm::ElementType type, const std::string& text) {
+    switch (type) {
+    case usm::ElementType::I8: return int8_t(std::stoi(text));
+    case usm::ElementType::U8: return uint8_t(std::stoul(text));
+    case usm::ElementType::I16: return int16_t(std::stoi(text));
+    case usm::ElementType::U16: return uint16_t(std::stoul(text));
+    case usm::ElementType::I32: return int32_t(std::stol(text));
+    case usm::ElementType::U32: return uint32_t(std::stoul(text));
+    case usm::ElementType::I64: return int64_t(std::stoll(text));
+    case usm::ElementType::U64: return uint64_t(std::stoull(text));
+    case usm::ElementType::F32: return std::stof(text);
+    case usm::ElementType::F64: return std::stod(text);
+    case usm::ElementType::STRING: return std::pmr::string(text);
+    default: throw std::runtime_error("Cannot set a byte array element from the command line");
+    }
+}
+
+// Sets page elements of the CRID chunk, or of one channel's HEADER chunk,
+// rewriting the file only if the chunk outgrows its padding.
+static int run_patch(const std::vector<std::string>& args) {
+    usm::PatchTarget target;
+    size_t page = 0;
+    std::vector<std::pair<std::string, std::string>> values;
+
+    for (size_t i = 2; i < args.size(); i++) {
+        if (is_flag(args[i], "--track") && i + 1 < args.size()) {
+            const std::string& spec = args[i + 1];
+            size_t colon = spec.find(':');
+            auto kind = parse_track_kind(spec.substr(0, colon));
+            if (colon == std::string::npos || !kind.has_value()) {
+                usage();
+                return 2;
+            }
+            target.chunk_type = *kind;
+            target.channel_number = std::stoi(spec.substr(colon + 1));
+            i++;
+        }
+        else if (is_flag(args[i], "--page") && i + 1 < args.size()) {
+            page = size_t(std::stoul(args[i + 1]));
+            i++;
+        }
+        else if (size_t eq = args[i].find('='); eq != std::string::npos && eq > 0) {
+            values.emplace_back(args[i].substr(0, eq), args[i].substr(eq + 1));
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (values.empty()) {
+        usage();
+        return 2;
+    }
+
+    auto result = usm::patch_pages(args[1], target, [&](std::vector<usm::UsmPage>& pages) {
+        if (page >= pages.size()) {
+            throw std::runtime_error("Chunk has only " + std::to_string(pages.size()) + " pages");
+        }
+        for (const auto& [name, text] : values) {
+            const usm::Element* e = pages[page].find(name);
+            const usm::ElementType type = e ? e->type : usm::ElementType::STRING;
+            pages[page].update(name, type, parse_element(type, text));
+        }
+        });
+    std::cout << (result == usm::PatchResult::IN_PLACE ? "Patched in place\n"
+        : "Patched; the chunk outgrew its padding and the file was rewritten\n");
+    return 0;
+}
+
+// Joins USMs with the same track layout without decrypting them.
+static int run_concat(const std::vector<std::string>& args) {
+    std::vector<std::filesystem::path> inputs;
+    std::filesystem::path out;
+    usm::ConcatOptions options;
+
+    for (size_t i = 1; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            out = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--direct")) {
+            options.writer.direct = true;
+        }
+        else if (!args[i].empty() && args[i][0] != '-') {
+            inputs.emplace_back(args[i]);
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (inputs.size() < 2 || out.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::concat_usms(inputs, out, options);
+    return 0;
+}
+
+// Swaps (or adds) one audio channel, copying every other chunk as is.
+static int run_replace_audio(const std::vector<std::string>& args) {
+    std::filesystem::path out;
+    usm::AudioReplaceOptions options;
+
+    if (args.size() < 3) {
+        usage();
+        return 2;
+    }
+    for (size_t i = 3; i < args.size(); i++) {
+        if (is_flag(args[i], "-o") && i + 1 < args.size()) {
+            out = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--channel") && i + 1 < args.size()) {
+            options.channel_number = std::stoi(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
+            options.key = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--name") && i + 1 < args.size()) {
+            options.filename = args[i + 1];
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (out.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::replace_audio(args[1], args[2], out, options);
+    return 0;
+}
+
+static usm::JobServer* g_server = nullptr;
+
+static void stop_server(int) {
+    if (g_server != nullptr) g_server->stop();
+}
+
+// Runs jobs sent over a Unix domain socket until SIGINT/SIGTERM or a
+// "shutdown" request (see usm/serve.hpp for the protocol).
+static int run_serve(const std::vector<std::string>& args) {
+    usm::ServeOptions options;
+
+    for (size_t i = 1; i < args.size(); i++) {
+        if (is_flag(args[i], "--socket") && i + 1 < args.size()) {
+            options.socket = args[i + 1];
+            i++;
+        }
+        else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+            options.jobs = unsigned(std::stoul(args[i + 1]));
+            i++;
+        }
+        else if (is_flag(args[i], "--max-queue") && i + 1 < args.size()) {
+            options.max_queue = std::stoull(args[i + 1]);
+            i++;
+        }
+        else if (is_flag(args[i], "--cache") && i + 1 < args.size()) {
+            options.cache_entries = std::stoull(args[i + 1]);
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (options.socket.empty()) {
+        usage();
+        return 2;
+    }
+
+    usm::JobServer server(options);
+    g_server = &server;
+    std::signal(SIGINT, stop_server);
+    std::signal(SIGTERM, stop_server);
+#ifndef _WIN32
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    server.run();
+    g_server = nullptr;
+    return 0;
+}
+
+static const char* track_kind_name(usm::ChunkType type) {
+    if (type == usm::ChunkType::AUDIO) return "audio";
+    if (type == usm::ChunkType::ALPHA) return "alpha";
+    return "video";
+}
+
+// Compares two USMs by their raw packet hashes, without decrypting.
+static int run_compare(const std::vector<std::string>& args) {
+    if (args.size() < 3) {
+        usage();
+        return 2;
+    }
+
+    usm::OpenOptions options;
+    options.packet_hash = usm::HashAlgorithm::XXH64;
+    for (size_t i = 3; i < args.size(); i++) {
+        if (is_flag(args[i], "--hash") && i + 1 < args.size()) {
+            auto algo = usm::hash_algorithm_from_string(args[i + 1]);
+            if (!algo.has_value() || *algo == usm::HashAlgorithm::NONE) {
+                usage();
+                return 2;
+            }
+            options.packet_hash = *algo;
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    usm::Usm a = usm::Usm::open(args[1], options);
+    usm::Usm b = usm::Usm::open(args[2], options);
+
+    bool same = true;
+    auto compare = [&](const std::vector<usm::Track>& tracks_a,
+        const std::vector<usm::Track>& tracks_b) {
+            for (const auto& ta : tracks_a) {
+                std::cout << track_kind_name(ta.chunk_type) << ":" << ta.channel_number << " ";
+                const usm::Track* tb = b.find_track(ta.chunk_type, ta.channel_number);
+                if (tb == nullptr) {
+                    std::cout << "only in " << args[1] << "\n";
+                    same = false;
+                    continue;
+                }
+
+                const auto& ha = ta.packet_hashes;
+                const auto& hb = tb->packet_hashes;
+                size_t changed = 0;
+                std::optional<size_t> first;
+                for (size_t i = 0; i < std::min(ha.size(), hb.size()); i++) {
+                    if (ha[i] == hb[i]) continue;
+                    changed++;
+                    if (!first.has_value()) first = i;
+                }
+                if (changed == 0 && ha.size() == hb.size()) {
+                    std::cout << "identical (" << ha.size() << " packets)\n";
+                    continue;
+                }
+
+                same = false;
+                std::cout << "differs: " << changed << " changed packets, " << ha.size()
+                    << " vs " << hb.size() << " packets";
+                if (first.has_value()) std::cout << ", first change at packet " << *first;
+                std::cout << "\n";
+            }
+            for (const auto& tb : tracks_b) {
+                if (a.find_track(tb.chunk_type, tb.channel_number) != nullptr) continue;
+                std::cout << track_kind_name(tb.chunk_type) << ":" << tb.channel_number
+                    << " only in " << args[2] << "\n";
+                same = false;
+            }
+        };
+
+    compare(a.videos(), b.videos());
+    compare(a.audios(), b.audios());
+    compare(a.alphas(), b.alphas());
+    return same ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
     try {
         if (argc < 2) {
@@ -23,12 +774,48 @@ int main(int argc, char** argv) {
         }
 
         std::vector<std::string> args(argv + 1, argv + argc);
-        if (args[0] != "demux") {
+        if (args.size() < 2) {
             usage();
             return 2;
         }
 
-        if (args.size() < 2) {
+        if (args[0] == "probe") {
+            return run_probe(args);
+        }
+        if (args[0] == "remux") {
+            return run_remux(args);
+        }
+        if (args[0] == "segment") {
+            return run_segment(args);
+        }
+        if (args[0] == "thumbs") {
+            return run_thumbs(args);
+        }
+        if (args[0] == "decode") {
+            return run_decode(args);
+        }
+        if (args[0] == "cpk") {
+            return run_cpk(args);
+        }
+        if (args[0] == "carve") {
+            return run_carve(args);
+        }
+        if (args[0] == "patch") {
+            return run_patch(args);
+        }
+        if (args[0] == "concat") {
+            return run_concat(args);
+        }
+        if (args[0] == "replace-audio") {
+            return run_replace_audio(args);
+        }
+        if (args[0] == "serve") {
+            return run_serve(args);
+        }
+        if (args[0] == "compare") {
+            return run_compare(args);
+        }
+        if (args[0] != "demux") {
             usage();
             return 2;
         }
@@ -39,16 +826,63 @@ int main(int argc, char** argv) {
         bool save_audio = true;
         bool save_alpha = true;
         std::optional<uint64_t> key;
+        std::string track_spec;
+        usm::HashAlgorithm hash = usm::HashAlgorithm::NONE;
+        bool direct = false;
+        bool recover = false;
+        unsigned jobs = 1;
+        std::optional<uint64_t> hca_key;
+        bool follow = false;
+        usm::FollowOptions follow_options;
+        bool incremental = false;
 
         for (size_t i = 2; i < args.size(); i++) {
             if (is_flag(args[i], "-o") && i + 1 < args.size()) {
                 outdir = args[i + 1];
                 i++;
             }
+            else if (is_flag(args[i], "--track") && i + 1 < args.size()) {
+                track_spec = args[i + 1];
+                i++;
+            }
             else if (is_flag(args[i], "--key") && i + 1 < args.size()) {
                 key = std::stoull(args[i + 1]);
                 i++;
             }
+            else if (is_flag(args[i], "--hash") && i + 1 < args.size()) {
+                auto algo = usm::hash_algorithm_from_string(args[i + 1]);
+                if (!algo.has_value()) {
+                    usage();
+                    return 2;
+                }
+                hash = *algo;
+                i++;
+            }
+            else if (is_flag(args[i], "--direct")) {
+                direct = true;
+            }
+            else if (is_flag(args[i], "--hca-key") && i + 1 < args.size()) {
+                hca_key = std::stoull(args[i + 1]);
+                i++;
+            }
+            else if (is_flag(args[i], "--recover")) {
+                recover = true;
+            }
+            else if (is_flag(args[i], "--jobs") && i + 1 < args.size()) {
+                jobs = unsigned(std::stoul(args[i + 1]));
+                i++;
+            }
+            else if (is_flag(args[i], "--follow")) {
+                follow = true;
+            }
+            else if (is_flag(args[i], "--incremental")) {
+                incremental = true;
+            }
+            else if (is_flag(args[i], "--idle-timeout") && i + 1 < args.size()) {
+                follow_options.idle_timeout = std::chrono::milliseconds(
+                    int64_t(std::stod(args[i + 1]) * 1000));
+                i++;
+            }
             else if (is_flag(args[i], "--no-video")) {
                 save_video = false;
             }
@@ -64,13 +898,89 @@ int main(int argc, char** argv) {
             }
         }
 
-        if (outdir.empty()) {
+        if (outdir.empty() || (outdir == "-" && track_spec.empty())) {
             usage();
             return 2;
         }
 
-        usm::Usm u = usm::Usm::open(input, key);
-        u.demux(outdir, save_video, save_audio, save_alpha);
+        usm::DemuxOptions options;
+        options.video = save_video;
+        options.audio = save_audio;
+        options.alpha = save_alpha;
+        options.hash = hash;
+        options.writer.direct = direct;
+        options.hca_key = hca_key;
+        options.incremental = incremental;
+
+        std::optional<usm::ChunkType> track_kind;
+        int track_chno = 0;
+        if (!track_spec.empty()) {
+            size_t colon = track_spec.find(':');
+            track_kind = parse_track_kind(track_spec.substr(0, colon));
+            if (colon == std::string::npos || !track_kind.has_value()) {
+                usage();
+                return 2;
+            }
+            track_chno = std::stoi(track_spec.substr(colon + 1));
+        }
+
+        if (follow) {
+            // The file may still be growing, so it is never opened as a whole.
+            follow_options.key = key;
+            if (!track_kind.has_value()) {
+                for (const auto& out : usm::follow_demux(input, outdir, follow_options, options)) {
+                    if (!out.hash.empty()) std::cout << out.hash << "  " << out.path.string() << "\n";
+                }
+            }
+            else if (outdir == "-") {
+#ifdef _WIN32
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                std::fflush(stdout);
+                usm::follow_demux_track(input, *track_kind, track_chno, fileno(stdout),
+                    follow_options, hca_key);
+            }
+            else {
+                usm::FileHandle out = usm::FileHandle::open_write(outdir);
+                usm::follow_demux_track(input, *track_kind, track_chno, out.fd(),
+                    follow_options, hca_key);
+            }
+            return 0;
+        }
+
+        usm::Usm u = open_usm(input, key, recover, jobs);
+
+        if (track_kind.has_value()) {
+            const usm::Track* t = u.find_track(*track_kind, track_chno);
+            if (t == nullptr) {
+                std::cerr << "Error: no such track " << track_spec << "\n";
+                return 1;
+            }
+
+            if (outdir == "-") {
+#ifdef _WIN32
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                std::fflush(stdout);
+                u.demux_track(*t, fileno(stdout), std::nullopt, hca_key);
+            }
+            else {
+                usm::FileHandle out = usm::FileHandle::open_write(outdir);
+                u.demux_track(*t, out.fd(), std::nullopt, hca_key);
+            }
+            return 0;
+        }
+
+        for (const auto& out : u.demux(outdir, options)) {
+            if (out.skipped) {
+                std::cerr << "Up to date: " << out.path.string() << "\n";
+            }
+            else if (out.resumed_at > 0) {
+                std::cerr << "Resumed " << out.path.string() << " at byte " << out.resumed_at
+                    << "\n";
+            }
+            if (!out.hash.empty()) std::cout << out.hash << "  " << out.path.string() << "\n";
+        }
 
         return 0;
     }
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <cstdint>
+#include <memory_resource>
 #include <stdexcept>
 #include <vector>
 
 namespace usm {
 
     using Bytes = std::vector<uint8_t>;
+    using PmrBytes = std::pmr::vector<uint8_t>;
 
     inline void require_size(const Bytes& b, size_t off, size_t n) {
         if (off + n > b.size()) {
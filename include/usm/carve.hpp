@@ -0,0 +1,52 @@
+#pragma once
+
+#include "source.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace usm {
+
+    // A USM found inside a larger blob (a disk image, a memory dump, an
+    // unknown pack format).
+    struct CarvedUsm {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        std::string filename;  // from its CRID page; may be empty
+
+        // "<hex offset>_<filename>", unique within one blob.
+        std::string name() const;
+    };
+
+    struct CarveOptions {
+        unsigned jobs = 0;  // 0 = hardware concurrency
+        // The blob is split into segments of this size, scanned in parallel.
+        uint64_t segment_size = uint64_t(64) << 20;
+        std::string encoding = "UTF-8";
+    };
+
+    struct CarveDemuxError {
+        uint64_t offset = 0;
+        std::string message;
+    };
+
+    // Finds every embedded USM: a CRID chunk whose payload is a
+    // CRIUSF_DIR_STREAM @UTF table. Each one's extent is found by walking
+    // its chunks until the data stops looking like chunks, the next USM's
+    // CRID, or the size its CRID page declares. USMs nested inside an
+    // earlier one are dropped. Results are in file order.
+    std::vector<CarvedUsm> carve_usms(const ByteSource& source,
+        const CarveOptions& options = {});
+
+    // Demuxes each carved USM in place into out_dir/<name>/ on `jobs`
+    // threads. A failing USM does not stop the others; failures are
+    // returned.
+    std::vector<CarveDemuxError> demux_carved(std::shared_ptr<const ByteSource> source,
+        const std::vector<CarvedUsm>& found, const std::filesystem::path& out_dir,
+        std::optional<uint64_t> key = std::nullopt, unsigned jobs = 0);
+
+}  // namespace usm
@@ -7,12 +7,28 @@
 #include "types.hpp"
 
 #include <functional>
+#include <memory_resource>
 #include <string>
 #include <variant>
 #include <vector>
 
 namespace usm {
 
+    // The fixed 0x20-byte chunk header, decoded without touching the payload.
+    struct ChunkHeader {
+        ChunkType chunk_type;
+        PayloadType payload_type;
+        int payload_offset = 0x20;  // from the chunk start (0x08 + offset field)
+        int payload_size = 0;
+        int padding = 0;
+        int channel_number = 0;
+        uint32_t frame_time = 0;
+        uint32_t frame_rate = 0;
+
+        // `header` must hold at least 0x20 bytes.
+        static ChunkHeader parse(const uint8_t* header);
+    };
+
     class UsmChunk {
     public:
         ChunkType chunk_type;
@@ -33,8 +49,10 @@ namespace usm {
 
         std::string encoding = "UTF-8";
 
+        // Page payloads are parsed into `mr`.
         static UsmChunk from_bytes(const Bytes& chunk,
-            const std::string& encoding = "UTF-8");
+            const std::string& encoding = "UTF-8",
+            std::pmr::memory_resource* mr = std::pmr::get_default_resource());
 
         Bytes pack() const;
 
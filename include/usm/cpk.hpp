@@ -0,0 +1,67 @@
+#pragma once
+
+#include "page.hpp"
+#include "source.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace usm {
+
+    struct CpkEntry {
+        std::string dir;
+        std::string name;
+        uint32_t id = 0;
+        uint64_t offset = 0;        // absolute offset in the archive
+        uint64_t size = 0;          // stored size
+        uint64_t extract_size = 0;  // size once decompressed
+
+        // Stored with CRILAYLA compression; cannot be opened in place.
+        bool compressed() const { return size != extract_size; }
+        std::string path() const;
+    };
+
+    struct CpkDemuxError {
+        std::string path;
+        std::string message;
+    };
+
+    // A CRI CPK archive. The TOC (or, for name-less archives, the ITOC) is
+    // read into a file index; uncompressed entries are then opened in place
+    // as SubrangeSources, so nothing is extracted to disk.
+    class Cpk {
+    public:
+        static Cpk open(const std::filesystem::path& path);
+        static Cpk open(std::shared_ptr<const ByteSource> source);
+
+        const UsmPage& header() const;
+        const std::vector<CpkEntry>& entries() const;
+
+        // Looks up "dir/name" (or "name" for entries without a directory).
+        const CpkEntry* find(std::string_view path) const;
+
+        // The stored bytes of an uncompressed entry.
+        std::shared_ptr<const ByteSource> open_entry(const CpkEntry& entry) const;
+
+        // Uncompressed entries that start with a CRID chunk.
+        std::vector<const CpkEntry*> usm_entries() const;
+
+        // Demuxes each entry into out_dir/<entry dir>/ on `jobs` threads
+        // (0 = hardware concurrency). A failing entry does not stop the
+        // others; failures are returned.
+        std::vector<CpkDemuxError> demux_all(const std::vector<const CpkEntry*>& entries,
+            const std::filesystem::path& out_dir, std::optional<uint64_t> key = std::nullopt,
+            unsigned jobs = 0) const;
+
+    private:
+        std::shared_ptr<const ByteSource> source_;
+        UsmPage header_{ "CpkHeader" };
+        std::vector<CpkEntry> entries_;
+    };
+
+}  // namespace usm
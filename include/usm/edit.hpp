@@ -0,0 +1,82 @@
+#pragma once
+
+#include "output.hpp"
+#include "page.hpp"
+#include "types.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace usm {
+
+    // The page chunk to patch: the CRID chunk (ChunkType::INFO), or the
+    // HEADER chunk of one video, audio or alpha channel.
+    struct PatchTarget {
+        ChunkType chunk_type = ChunkType::INFO;
+        int channel_number = 0;  // ignored for INFO
+    };
+
+    enum class PatchResult {
+        IN_PLACE,   // only the chunk's own bytes were overwritten
+        REWRITTEN,  // the chunk grew and the file was copied around it
+    };
+
+    using PageEditor = std::function<void(std::vector<UsmPage>&)>;
+
+    // Parses the pages of one INFO/HEADER chunk, lets `edit` change them and
+    // repacks only that chunk. When the new payload fits in the chunk's
+    // current size (payload plus padding), it is written back over the old
+    // one with the padding adjusted, and nothing else in the file is touched.
+    // Otherwise the file is streamed to a temporary next to it with the
+    // grown chunk, the CRID filesize and the VIDEO_SEEKINFO byte offsets
+    // shifted to match, and renamed over the original.
+    PatchResult patch_pages(const std::filesystem::path& path, const PatchTarget& target,
+        const PageEditor& edit, const std::string& encoding = "UTF-8");
+
+    struct ConcatOptions {
+        std::string encoding = "UTF-8";
+        WriterOptions writer;
+    };
+
+    // Joins USMs with the same track layout into one, in order. The CRID
+    // and HEADER pages of every input must agree except for per-file totals
+    // and names. STREAM chunks are copied as they are, still encrypted (so
+    // all inputs must share a key), with frame_time moved past the end of
+    // the previous inputs; only the last input's "#CONTENTS END" chunks are
+    // kept. The output carries the first input's pages with the CRID sizes,
+    // frame totals and bit rates merged, and one VIDEO_SEEKINFO table per
+    // channel covering every input. Memory use does not grow with the input
+    // size: packets go through a fixed window, and the page chunks at the
+    // front are written again once the totals are known.
+    void concat_usms(const std::vector<std::filesystem::path>& inputs,
+        const std::filesystem::path& out, const ConcatOptions& options = {});
+
+    struct AudioReplaceOptions {
+        // Channel to replace; a channel the USM does not have is added.
+        int channel_number = 0;
+        // USM key of the file. When set, the new packets get the same audio
+        // encryption as the rest of the file.
+        std::optional<uint64_t> key;
+        // CRID filename of the new track; defaults to the audio file's name.
+        std::string filename;
+        std::string encoding = "UTF-8";
+        WriterOptions writer;
+    };
+
+    // Writes `out` as a copy of `usm_path` whose audio channel
+    // `options.channel_number` is the HCA or ADX file `audio_path`. The
+    // stream is cut into packets of whole blocks, timed from its sample
+    // rate, and interleaved with the other chunks by frame time; the old
+    // channel's packets are dropped. Every other chunk is copied as raw
+    // bytes in one sequential pass. The channel's CRID and AUDIO_HDRINFO
+    // pages are updated (or added from an existing audio channel's), and
+    // the CRID filesize and VIDEO_SEEKINFO offsets follow the new layout.
+    void replace_audio(const std::filesystem::path& usm_path,
+        const std::filesystem::path& audio_path, const std::filesystem::path& out,
+        const AudioReplaceOptions& options = {});
+
+}  // namespace usm
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "bytes.hpp"
+#include "chunk.hpp"
+#include "output.hpp"
+#include "page.hpp"
+#include "types.hpp"
+#include "usm.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace usm {
+
+    // One STREAM payload of a file being followed.
+    struct FollowPacket {
+        ChunkType chunk_type = ChunkType::VIDEO;
+        int channel_number = 0;
+        uint64_t offset = 0;  // payload offset in the file
+        uint32_t size = 0;
+        uint32_t frame_time = 0;
+        uint32_t frame_rate = 0;
+    };
+
+    struct FollowOptions {
+        std::optional<uint64_t> key;
+        std::string encoding = "UTF-8";
+        // Give up when the file has not grown for this long (0 = never).
+        std::chrono::milliseconds idle_timeout{ 0 };
+        // How often to re-check the size where inotify is unavailable.
+        std::chrono::milliseconds poll_interval{ 100 };
+    };
+
+    // Scans a USM that is still being written. Each poll() parses the chunks
+    // that are complete on disk and resumes at the first partial one next
+    // time. Between polls the file is watched with inotify (Linux) or
+    // re-checked every poll_interval. The stream is finished once every
+    // channel declared in the CRID table has sent its "#CONTENTS END"
+    // SECTION_END chunk.
+    class UsmFollower {
+    public:
+        explicit UsmFollower(const std::filesystem::path& path, FollowOptions options = {});
+        ~UsmFollower();
+
+        UsmFollower(const UsmFollower&) = delete;
+        UsmFollower& operator=(const UsmFollower&) = delete;
+
+        // Parses every complete chunk written since the last call and returns
+        // the new STREAM packets in file order. Never blocks.
+        std::vector<FollowPacket> poll();
+
+        // Blocks until the file changes or `timeout` passes; returns false on
+        // timeout. A true return does not guarantee a whole new chunk.
+        bool wait(std::chrono::milliseconds timeout);
+
+        // Polls and waits until finished(), passing each packet to
+        // `on_packet` as soon as it is complete. Returns false if
+        // idle_timeout ran out first.
+        bool run(const std::function<void(const FollowPacket&)>& on_packet);
+
+        bool finished() const;
+        // Bytes consumed so far (the start of the first incomplete chunk).
+        uint64_t offset() const { return offset_; }
+
+        const std::filesystem::path& path() const { return path_; }
+        const std::vector<UsmPage>& crids() const { return crids_; }
+        // The CRID page for a channel, once the CRID chunk has been read.
+        const UsmPage* crid(ChunkType type, int channel_number) const;
+        // The HEADER page of a channel, once it has been read.
+        const UsmPage* header(ChunkType type, int channel_number) const;
+
+        // Reads a packet's payload and removes the USM encryption if a key
+        // was given.
+        void read_packet(const FollowPacket& packet, Bytes& out) const;
+
+    private:
+        void handle_chunk(const ChunkHeader& h, uint64_t offset);
+
+        std::filesystem::path path_;
+        FollowOptions options_;
+        std::optional<Keys> keys_;
+        FileHandle file_;
+        int watch_fd_ = -1;
+
+        uint64_t offset_ = 0;
+        bool magic_checked_ = false;
+
+        using ChannelKey = std::pair<ChunkType, int>;
+        std::vector<UsmPage> crids_;
+        std::set<ChannelKey> declared_;
+        std::set<ChannelKey> seen_;
+        std::set<ChannelKey> ended_;
+        std::map<ChannelKey, UsmPage> headers_;
+        Bytes chunk_bytes_;
+    };
+
+    // Demuxes a growing USM into out_dir/<name>/{videos,audios,alphas}, like
+    // Usm::demux, writing each packet as soon as it is complete. Files are
+    // opened when a track's first packet arrives. Stops at the end of the
+    // stream, or throws if idle_timeout runs out first.
+    std::vector<DemuxedTrack> follow_demux(const std::filesystem::path& path,
+        const std::filesystem::path& out_dir, const FollowOptions& options,
+        const DemuxOptions& demux = {});
+
+    // Streams one track of a growing USM to `out_fd` (e.g. a player's pipe).
+    // `hca_key` is as in DemuxOptions.
+    void follow_demux_track(const std::filesystem::path& path, ChunkType type,
+        int channel_number, int out_fd, const FollowOptions& options,
+        std::optional<uint64_t> hca_key = std::nullopt);
+
+}  // namespace usm
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace usm {
+
+    enum class HashAlgorithm : uint8_t { NONE, CRC32C, XXH64 };
+
+    std::optional<HashAlgorithm> hash_algorithm_from_string(std::string_view name);
+    const char* hash_algorithm_name(HashAlgorithm algorithm);
+    // A digest as fixed-width lowercase hex (8 digits for CRC32C, 16 for XXH64).
+    std::string hash_hex(uint64_t digest, HashAlgorithm algorithm);
+
+    // CRC-32C (Castagnoli). Uses the SSE4.2 / ARMv8 CRC instructions when
+    // the CPU has them. Pass a previous result as `crc` to continue it.
+    uint32_t crc32c(const void* data, size_t n, uint32_t crc = 0);
+
+    uint64_t xxh64(const void* data, size_t n, uint64_t seed = 0);
+
+    // Incremental hash over a stream fed in pieces (e.g. packet by packet).
+    class Hasher {
+    public:
+        explicit Hasher(HashAlgorithm algorithm = HashAlgorithm::NONE);
+
+        void update(const void* data, size_t n);
+        uint64_t digest() const;
+        // digest() as hash_hex() formats it.
+        std::string hex() const;
+
+        HashAlgorithm algorithm() const { return algorithm_; }
+
+    private:
+        HashAlgorithm algorithm_;
+        uint32_t crc_ = 0;
+
+        // XXH64 state.
+        uint64_t acc_[4] = {};
+        uint8_t buf_[32] = {};
+        size_t buffered_ = 0;
+        uint64_t total_ = 0;
+    };
+
+}  // namespace usm
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace usm {
+
+    // Layout of an HCA header, as far as packetizing and decrypting need it.
+    struct HcaInfo {
+        uint32_t header_size = 0;
+        uint32_t block_size = 0;
+        uint32_t block_count = 0;
+        uint32_t sample_rate = 0;
+        int channels = 0;
+        int cipher_type = 0;
+        size_t cipher_offset = 0;  // of the ciph chunk's type field; 0 if absent
+    };
+
+    // Samples per channel in one HCA block.
+    constexpr uint32_t kHcaBlockSamples = 1024;
+
+    // Parses the HCA header at the start of `data`, which must hold all of
+    // it. Returns nothing if `data` does not start with an HCA header.
+    std::optional<HcaInfo> parse_hca_header(const uint8_t* data, size_t n);
+
+    // CRC-16 used by HCA headers and blocks (poly 0x8005, MSB first, init 0).
+    uint16_t hca_crc16(const uint8_t* data, size_t n, uint16_t crc = 0);
+
+    // Turns an HCA stream with HCA-level encryption (cipher type 1, or 56
+    // keyed by a 64-bit keycode) into a plain one, one buffer at a time and
+    // in place: the header's cipher type is set to 0 and its CRC rewritten,
+    // and every block is decrypted through a 256-byte table and gets a fresh
+    // CRC. Streams that are not HCA, or not encrypted, pass through as is.
+    class HcaDecrypter {
+    public:
+        explicit HcaDecrypter(uint64_t keycode);
+
+        // Transforms the next `n` bytes of the stream. Blocks may span
+        // calls; the header must be whole in the first call, as it is in
+        // the first audio packet of a USM.
+        void process(uint8_t* data, size_t n);
+
+        // Cipher type of the stream; meaningful after the first process().
+        int cipher_type() const { return cipher_type_; }
+
+    private:
+        size_t parse_header(uint8_t* data, size_t n);
+
+        uint64_t keycode_ = 0;
+        std::array<uint8_t, 256> table_{};
+        bool header_done_ = false;
+        bool active_ = false;
+        int cipher_type_ = 0;
+        uint32_t block_size_ = 0;
+        uint32_t block_pos_ = 0;
+        uint16_t crc_ = 0;
+    };
+
+}  // namespace usm
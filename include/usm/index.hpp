@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+namespace usm {
+
+    // The (offset, size) of each STREAM payload of a track, plus an optional
+    // (frame_time, frame_rate) column, stored as varints in blocks of
+    // kBlockSize packets. Within a block each offset is kept as the gap after
+    // the previous payload (the next chunk header, its padding and any
+    // interleaved chunks), which is usually one or two bytes, and times as
+    // the change in frame step, usually one byte. A packet is found by
+    // decoding forward from the start of its block, and iteration decodes
+    // one packet per step. Typically 4-6x smaller than the 24 bytes per
+    // packet of two vectors of pairs.
+    class PacketIndex {
+    public:
+        using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+        using value_type = std::pair<uint64_t, uint32_t>;  // (offset, size)
+        using time_type = std::pair<uint32_t, uint32_t>;   // (frame_time, frame_rate)
+
+        static constexpr size_t kBlockSize = 64;
+
+        class const_iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = PacketIndex::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = value_type;
+
+            const_iterator() = default;
+
+            value_type operator*() const { return { offset_, size_ }; }
+            // Only meaningful when the index has_times().
+            time_type time() const { return { frame_time_, frame_rate_ }; }
+            size_t index() const { return i_; }
+
+            const_iterator& operator++() {
+                ++i_;
+                decode();
+                return *this;
+            }
+            const_iterator operator++(int) {
+                const_iterator tmp = *this;
+                ++*this;
+                return tmp;
+            }
+
+            bool operator==(const const_iterator& other) const { return i_ == other.i_; }
+
+        private:
+            friend class PacketIndex;
+
+            const_iterator(const PacketIndex* index, size_t i);
+            void decode();
+
+            const PacketIndex* index_ = nullptr;
+            size_t i_ = 0;
+            size_t data_pos_ = 0;
+            size_t time_pos_ = 0;
+            uint64_t offset_ = 0;
+            uint32_t size_ = 0;
+            uint32_t frame_time_ = 0;
+            uint32_t frame_step_ = 0;
+            uint32_t frame_rate_ = 0;
+        };
+
+        PacketIndex() = default;
+        explicit PacketIndex(allocator_type alloc);
+        PacketIndex(const PacketIndex& other, allocator_type alloc);
+        PacketIndex(PacketIndex&& other, allocator_type alloc);
+        PacketIndex(const PacketIndex&) = default;
+        PacketIndex(PacketIndex&&) noexcept = default;
+        PacketIndex& operator=(const PacketIndex&) = default;
+        PacketIndex& operator=(PacketIndex&&) = default;
+
+        allocator_type get_allocator() const { return data_.get_allocator(); }
+
+        // Packets must be appended in file order. An index either has times
+        // for every packet or for none.
+        void push_back(uint64_t offset, uint32_t size);
+        void push_back(uint64_t offset, uint32_t size, uint32_t frame_time, uint32_t frame_rate);
+        // Appends every packet of `other`, which must come after this
+        // index's in the file.
+        void append(const PacketIndex& other);
+
+        size_t size() const { return count_; }
+        bool empty() const { return count_ == 0; }
+        bool has_times() const { return has_times_; }
+
+        value_type operator[](size_t i) const { return *iterator_at(i); }
+        value_type at(size_t i) const;
+        time_type time(size_t i) const;
+
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const;
+        const_iterator iterator_at(size_t i) const;
+
+        // Sum of all payload sizes.
+        uint64_t total_bytes() const { return total_bytes_; }
+
+        // Heap bytes held, for reporting.
+        size_t memory_usage() const;
+        void shrink_to_fit();
+
+    private:
+        struct Block {
+            uint64_t offset = 0;     // offset of the block's first packet
+            uint32_t data_pos = 0;   // into data_
+            uint32_t time_pos = 0;   // into times_
+        };
+
+        void push_packet(uint64_t offset, uint32_t size);
+
+        std::pmr::vector<Block> blocks_;
+        std::pmr::vector<uint8_t> data_;
+        std::pmr::vector<uint8_t> times_;
+        size_t count_ = 0;
+        bool has_times_ = false;
+        uint64_t total_bytes_ = 0;
+
+        // Encoder state: the previous packet.
+        uint64_t last_end_ = 0;
+        uint32_t last_frame_time_ = 0;
+        uint32_t last_frame_step_ = 0;
+        uint32_t last_frame_rate_ = 0;
+    };
+
+}  // namespace usm
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace usm {
+
+    // A small JSON value for the job protocol of `usmtool serve`. Integers
+    // keep all 64 bits (USM keys do not fit in a double); objects keep their
+    // keys sorted.
+    class Json {
+    public:
+        using Array = std::vector<Json>;
+        using Object = std::map<std::string, Json, std::less<>>;
+
+        Json() = default;
+        Json(std::nullptr_t) {}
+        Json(bool v) : value_(v) {}
+        Json(int v) : value_(int64_t(v)) {}
+        Json(int64_t v) : value_(v) {}
+        Json(uint64_t v) : value_(v) {}
+        Json(double v) : value_(v) {}
+        Json(const char* v) : value_(std::string(v)) {}
+        Json(std::string v) : value_(std::move(v)) {}
+        Json(Array v) : value_(std::move(v)) {}
+        Json(Object v) : value_(std::move(v)) {}
+
+        // Throws std::runtime_error on malformed text or trailing garbage.
+        static Json parse(std::string_view text);
+
+        // Compact, on one line.
+        std::string dump() const;
+
+        bool is_null() const { return std::holds_alternative<std::nullptr_t>(value_); }
+        bool is_object() const { return std::holds_alternative<Object>(value_); }
+
+        std::optional<bool> as_bool() const;
+        // Non-negative integers; a decimal string is accepted too, so keys
+        // can be sent either way.
+        std::optional<uint64_t> as_u64() const;
+        std::optional<double> as_double() const;
+        const std::string* as_string() const;
+        const Array* as_array() const;
+        const Object* as_object() const;
+
+        // Member of an object; null if missing or not an object.
+        const Json* find(std::string_view key) const;
+        Json& operator[](const std::string& key);
+
+    private:
+        std::variant<std::nullptr_t, bool, int64_t, uint64_t, double, std::string, Array, Object>
+            value_;
+    };
+
+}  // namespace usm
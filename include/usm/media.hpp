@@ -0,0 +1,188 @@
+#pragma once
+
+#include "bytes.hpp"
+#include "usm.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct AVIOContext;
+
+namespace usm {
+
+    struct MediaInfo {
+        std::string format;  // libavformat demuxer short name
+        std::string codec;   // libavcodec codec name
+        int width = 0;
+        int height = 0;
+        int sample_rate = 0;
+        int channels = 0;
+        double duration = 0.0;  // seconds
+        int64_t frame_count = 0;
+        int64_t bit_rate = 0;
+    };
+
+    // Exposes the decrypted elementary stream of one track as a read-only,
+    // seekable AVIOContext. Packets are read on demand straight from the Usm
+    // packet index, so nothing is written to disk. `usm` and `track` must
+    // outlive the TrackIO.
+    class TrackIO {
+    public:
+        TrackIO(const Usm& usm, const Track& track,
+            std::optional<uint64_t> key_override = std::nullopt);
+        ~TrackIO();
+
+        TrackIO(const TrackIO&) = delete;
+        TrackIO& operator=(const TrackIO&) = delete;
+
+        AVIOContext* context() const;
+
+        // Total size of the decrypted elementary stream.
+        uint64_t size() const;
+
+        // Index of the packet containing byte `pos` of the elementary stream.
+        size_t packet_at(uint64_t pos) const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> state_;
+        AVIOContext* ctx_ = nullptr;
+    };
+
+    // Probes codec, dimensions, duration and frame count of a track with
+    // libavformat, in-process. Frame count and duration prefer the
+    // VIDEO_HDRINFO values; otherwise packets are counted by reading the
+    // stream through the demuxer.
+    MediaInfo probe_track(const Usm& usm, const Track& track,
+        std::optional<uint64_t> key_override = std::nullopt);
+
+    struct RemuxOptions {
+        bool video = true;
+        bool audio = true;
+        bool alpha = true;
+
+        // libavformat muxer short name ("mp4", "matroska"); empty guesses
+        // from the output extension.
+        std::string format;
+
+        std::optional<uint64_t> key_override;
+
+        // Audio channel number -> ISO 639 language code. Used when the CRID
+        // page of the channel carries no language element.
+        std::map<int, std::string> audio_languages;
+    };
+
+    // Remuxes the selected tracks into one MP4/MKV file in a single pass.
+    // Video and alpha packets are timed from the chunk frame_time/frame_rate
+    // fields; audio streams keep their codec timing anchored at the first
+    // audio chunk time. Each stream is tagged with its CRID filename as title
+    // and its language.
+    void remux(const Usm& usm, const std::filesystem::path& out,
+        const RemuxOptions& options = {});
+
+    enum class AudioFormat { WAV, FLAC };
+
+    struct AudioDecodeOptions {
+        AudioFormat format = AudioFormat::WAV;
+        std::optional<uint64_t> key_override;
+        // Key of the HCA-level cipher (type 56), handed to the libavformat
+        // hca demuxer. Unrelated to the USM key, though often the same value.
+        std::optional<uint64_t> hca_key;
+        // Tracks decoded at once by decode_audio_tracks (0 = hardware
+        // concurrency).
+        unsigned jobs = 0;
+    };
+
+    // Decodes an HCA or ADX audio track with libavcodec and writes it as
+    // 16-bit WAV or FLAC. Packets are decrypted in memory and fed straight
+    // to the decoder; no raw .hca/.adx is written.
+    void decode_audio(const Usm& usm, const Track& track, const std::filesystem::path& out,
+        const AudioDecodeOptions& options = {});
+
+    // Decodes every audio track into out_dir/<CRID file stem>.wav (or .flac),
+    // several tracks at once; a stem already used by an earlier track gets
+    // "_<chno>" appended. Returns the written files in channel order.
+    std::vector<std::filesystem::path> decode_audio_tracks(const Usm& usm,
+        const std::filesystem::path& out_dir, const AudioDecodeOptions& options = {});
+
+    enum class ImageFormat { PNG, JPEG };
+
+    struct ThumbnailOptions {
+        ImageFormat format = ImageFormat::JPEG;
+        // Width of the poster or of one contact-sheet cell; the height keeps
+        // the aspect ratio. 0 keeps the source width.
+        int width = 320;
+        int count = 16;
+        int columns = 4;
+        // Threads decoding contact-sheet frames (0 = hardware concurrency).
+        unsigned jobs = 0;
+        std::optional<uint64_t> key_override;
+    };
+
+    // Packet indexes of a video track's keyframes from its VIDEO_SEEKINFO
+    // pages, sorted; packet 0 is always one.
+    std::vector<size_t> track_keyframes(const Track& track);
+
+    // Image of the keyframe nearest `position` (0..1) of a video track.
+    // Only the packets from the keyframe to its first decoded frame are read
+    // and decrypted, never the rest of the stream.
+    Bytes poster_frame(const Usm& usm, const Track& track, double position = 0.1,
+        const ThumbnailOptions& options = {});
+
+    // `count` keyframes spread over the track, decoded in parallel the same
+    // way and tiled `columns` wide into one image.
+    Bytes contact_sheet(const Usm& usm, const Track& track,
+        const ThumbnailOptions& options = {});
+
+    struct SegmentInfo {
+        size_t first_packet = 0;  // index into Track::stream
+        size_t end_packet = 0;    // one past the last packet
+        int64_t start = 0;        // in Segmenter::timescale() units
+        int64_t duration = 0;
+    };
+
+    // Packages a video track as keyframe-aligned fragmented MP4 for HLS/DASH.
+    // Segment boundaries come from the VIDEO_SEEKINFO keyframe table, and
+    // every segment is produced on demand by decrypting and packaging only
+    // its own packets, so the first segment does not wait for a full remux.
+    // Decode times come from the chunk frame_time fields; presentation times
+    // reorder them around B-frames, so the fragments carry real composition
+    // offsets.
+    // `usm` and `track` must outlive the Segmenter; segment() may be called
+    // from several threads at once.
+    class Segmenter {
+    public:
+        Segmenter(const Usm& usm, const Track& track, double target_duration = 4.0,
+            std::optional<uint64_t> key_override = std::nullopt);
+        ~Segmenter();
+
+        Segmenter(const Segmenter&) = delete;
+        Segmenter& operator=(const Segmenter&) = delete;
+
+        const std::vector<SegmentInfo>& segments() const;
+        int timescale() const;
+
+        // ftyp+moov shared by all segments.
+        Bytes init_segment() const;
+        // moof+mdat of one segment.
+        Bytes segment(size_t index) const;
+
+        static std::string segment_name(size_t index);
+
+        std::string hls_playlist(const std::string& init_name = "init.mp4") const;
+        std::string dash_manifest(const std::string& init_name = "init.mp4") const;
+
+        // Writes init.mp4, every segment, index.m3u8 and manifest.mpd.
+        void write_all(const std::filesystem::path& dir) const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> state_;
+    };
+
+}  // namespace usm
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+
+namespace usm {
+
+    // Forwards to an upstream resource and counts what passes through. Wrap
+    // the upstream of an arena (or install it as the default resource) to
+    // check that parsing does no per-packet allocation.
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        explicit CountingResource(
+            std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+            : upstream_(upstream) {
+        }
+
+        size_t allocations() const { return allocations_.load(); }
+        size_t deallocations() const { return deallocations_.load(); }
+        size_t bytes_allocated() const { return bytes_allocated_.load(); }
+        size_t bytes_in_use() const { return bytes_in_use_.load(); }
+
+        void reset() {
+            allocations_ = 0;
+            deallocations_ = 0;
+            bytes_allocated_ = 0;
+        }
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            void* p = upstream_->allocate(bytes, alignment);
+            allocations_.fetch_add(1, std::memory_order_relaxed);
+            bytes_allocated_.fetch_add(bytes, std::memory_order_relaxed);
+            bytes_in_use_.fetch_add(bytes, std::memory_order_relaxed);
+            return p;
+        }
+
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            upstream_->deallocate(p, bytes, alignment);
+            deallocations_.fetch_add(1, std::memory_order_relaxed);
+            bytes_in_use_.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+
+        std::pmr::memory_resource* upstream_;
+        std::atomic<size_t> allocations_{ 0 };
+        std::atomic<size_t> deallocations_{ 0 };
+        std::atomic<size_t> bytes_allocated_{ 0 };
+        std::atomic<size_t> bytes_in_use_{ 0 };
+    };
+
+}  // namespace usm
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+namespace usm {
+
+    // Owns a raw file descriptor (a POSIX fd, or a CRT fd on Windows).
+    class FileHandle {
+    public:
+        FileHandle() = default;
+        explicit FileHandle(int fd) : fd_(fd) {}
+        ~FileHandle();
+
+        FileHandle(FileHandle&& other) noexcept;
+        FileHandle& operator=(FileHandle&& other) noexcept;
+        FileHandle(const FileHandle&) = delete;
+        FileHandle& operator=(const FileHandle&) = delete;
+
+        static FileHandle open_read(const std::filesystem::path& path);
+        // Creates or truncates a regular file; FIFOs are opened as they are.
+        static FileHandle open_write(const std::filesystem::path& path);
+        // Opens an existing file for writing in place, without truncating it.
+        static FileHandle open_update(const std::filesystem::path& path);
+
+        int fd() const { return fd_; }
+        explicit operator bool() const { return fd_ >= 0; }
+
+    private:
+        int fd_ = -1;
+    };
+
+    // Writes all `n` bytes, retrying short writes.
+    void write_all(int fd, const void* data, size_t n);
+
+    // Writes each (data, size) part in order, as few writev calls as
+    // possible where available; retries short writes like write_all.
+    void write_gather(int fd, const std::vector<std::pair<const uint8_t*, size_t>>& parts);
+
+    // Reads exactly `n` bytes at `offset` without moving a shared file position
+    // (pread on POSIX).
+    void pread_all(int fd, uint64_t offset, void* dst, size_t n);
+
+    // Writes all `n` bytes at `offset` without moving a shared file position
+    // (pwrite on POSIX).
+    void pwrite_all(int fd, uint64_t offset, const void* data, size_t n);
+
+    // Flushes the file's data to stable storage (fdatasync where available).
+    void sync_data(int fd);
+
+    bool is_pipe(int fd);
+
+    // Moves `n` bytes at `offset` of `in_fd` to `out_fd` without passing them
+    // through user space: splice when `out_fd` is a pipe, otherwise
+    // copy_file_range (which lets btrfs/XFS share extents instead of copying)
+    // and then sendfile. Returns false, having moved nothing, when the kernel
+    // cannot do it for this pair of descriptors (or on non-Linux platforms);
+    // callers then fall back to read/write.
+    bool kernel_copy(int in_fd, uint64_t offset, size_t n, int out_fd, bool out_is_pipe);
+
+    struct WriterOptions {
+        // Staging buffer; rounded up to a multiple of 4 KiB.
+        size_t buffer_size = size_t(4) << 20;
+        // Bypass the page cache (O_DIRECT on Linux). Falls back to normal
+        // writes where the file system refuses it.
+        bool direct = false;
+    };
+
+    // Writes a file of known final size in large sequential pieces. The file
+    // is preallocated up front (fallocate on Linux) so it is laid out in few
+    // extents, and small appends are gathered in a 4 KiB-aligned buffer that
+    // is written a whole number of blocks at a time.
+    class FileWriter {
+    public:
+        // With `keep` > 0 the file is reopened rather than truncated: its
+        // first `keep` bytes stay and writing continues after them.
+        FileWriter(const std::filesystem::path& path, uint64_t final_size,
+            WriterOptions options = {}, uint64_t keep = 0);
+        ~FileWriter();
+
+        FileWriter(const FileWriter&) = delete;
+        FileWriter& operator=(const FileWriter&) = delete;
+
+        void write(const void* data, size_t n);
+
+        // Space for `n` more bytes in the staging buffer, so a packet can be
+        // read and decrypted in place; call commit(n) once it is filled.
+        uint8_t* prepare(size_t n);
+        void commit(size_t n);
+
+        // Writes what is buffered and trims the file to the bytes written.
+        // Must be called for the output to be complete.
+        void finish();
+
+        uint64_t written() const { return written_ + used_; }
+
+        // Flushes the bytes already handed to the file to stable storage
+        // (fdatasync) and returns how many there are; the buffered tail is
+        // not included.
+        uint64_t sync();
+
+    private:
+        void flush_blocks();
+
+        FileHandle file_;
+        bool direct_ = false;
+        uint8_t* buf_ = nullptr;
+        size_t capacity_ = 0;
+        size_t used_ = 0;
+        uint64_t written_ = 0;  // bytes already handed to the file
+        bool finished_ = false;
+    };
+
+}  // namespace usm
@@ -6,8 +6,13 @@
 #include "types.hpp"
 
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -16,34 +21,110 @@ namespace usm {
 
     using ElementValue =
         std::variant<int8_t, uint8_t, int16_t, uint16_t, int32_t, uint32_t, int64_t,
-        uint64_t, float, double, std::string, Bytes>;
+        uint64_t, float, double, std::pmr::string, PmrBytes>;
 
     struct Element {
         ElementType type;
         ElementValue val;
     };
 
+    // CRI's unsigned column codes map to the signed ElementTypes here (a CRI
+    // u16 arrives as int16_t), so sizes and offsets must be widened from
+    // their own width without sign extension.
+    template <typename T>
+    constexpr uint64_t zero_extend(T v) {
+        return uint64_t(std::make_unsigned_t<T>(v));
+    }
+
+    // Integer value of `e`, zero-extended; null for non-integer elements.
+    std::optional<uint64_t> element_u64(const Element& e);
+
+    // Transparent hash so lookups by string_view do not build a key string.
+    struct PageKeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    // Column layout of one @UTF table: element names and types by slot.
+    // Pages parsed from the same table share one schema, so a name can be
+    // resolved to a slot once and reused for every row (see schema.hpp).
+    class PageSchema {
+    public:
+        using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+        explicit PageSchema(allocator_type alloc = {});
+        PageSchema(const PageSchema& other, allocator_type alloc = {});
+
+        size_t size() const { return names_.size(); }
+        const std::pmr::vector<std::pmr::string>& names() const { return names_; }
+        ElementType type(size_t slot) const { return types_[slot]; }
+        std::optional<size_t> slot(std::string_view name) const;
+
+        // Unique per schema and renewed on every change, so bindings can
+        // cache slots by id without being fooled by a reused address.
+        uint64_t id() const { return id_; }
+
+        size_t add(std::string_view name, ElementType type);
+        void set_type(size_t slot, ElementType type);
+
+    private:
+        uint64_t id_;
+        std::pmr::vector<std::pmr::string> names_;
+        std::pmr::vector<ElementType> types_;
+        std::pmr::unordered_map<std::pmr::string, size_t, PageKeyHash, std::equal_to<>>
+            slots_;
+    };
+
+    // All storage of a page (name, schema, string and byte values) comes from
+    // its allocator, so pages parsed into an arena stay in that arena. Moves
+    // keep the allocator; copies use the default resource unless one is
+    // given. Pages in the same resource share their schema until one of them
+    // adds a key or changes a type.
     class UsmPage {
     public:
-        explicit UsmPage(std::string name);
+        using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
 
-        const std::string& name() const;
-        const std::vector<std::string>& key_order() const;
-        const std::unordered_map<std::string, Element>& dict() const;
+        explicit UsmPage(std::string_view name, allocator_type alloc = {});
+        // A row of a table laid out by `schema`; values are set with set().
+        UsmPage(std::string_view name, std::shared_ptr<PageSchema> schema,
+            allocator_type alloc = {});
+        UsmPage(const UsmPage& other, allocator_type alloc = {});
+        UsmPage(UsmPage&& other) noexcept = default;
+        UsmPage(UsmPage&& other, allocator_type alloc);
+        UsmPage& operator=(const UsmPage& other);
+        UsmPage& operator=(UsmPage&& other);
 
-        void update(const std::string& key, ElementType type, ElementValue value);
+        allocator_type get_allocator() const;
 
-        std::optional<Element> get(const std::string& key) const;
-        const Element& at(const std::string& key) const;
+        const std::pmr::string& name() const;
+        const std::pmr::vector<std::pmr::string>& key_order() const;
+
+        // Null for a page without elements.
+        const PageSchema* schema() const;
+        size_t size() const;
+        const Element& element(size_t slot) const { return values_[slot]; }
+
+        void update(std::string_view key, ElementType type, ElementValue value);
+        // Sets `slot` to a value of the schema's type for it.
+        void set(size_t slot, ElementValue value);
+
+        std::optional<Element> get(std::string_view key) const;
+        const Element* find(std::string_view key) const;
+        const Element& at(std::string_view key) const;
 
     private:
-        std::string name_;
-        std::vector<std::string> order_;
-        std::unordered_map<std::string, Element> dict_;
+        PageSchema& own_schema();
+
+        std::pmr::string name_;
+        std::shared_ptr<PageSchema> schema_;
+        std::pmr::vector<Element> values_;  // by schema slot
     };
 
     std::vector<UsmPage> get_pages(const Bytes& info,
-        const std::string& encoding = "UTF-8");
+        const std::string& encoding = "UTF-8",
+        std::pmr::memory_resource* mr = std::pmr::get_default_resource());
 
     Bytes pack_pages(const std::vector<UsmPage>& pages,
         const std::string& encoding = "UTF-8", int string_padding = 0);
@@ -51,4 +132,4 @@ namespace usm {
     std::vector<int> keyframes_from_seek_pages(
         const std::optional<std::vector<UsmPage>>& seek_pages);
 
-}  // namespace usm
\ No newline at end of file
+}  // namespace usm
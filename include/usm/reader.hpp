@@ -0,0 +1,60 @@
+#pragma once
+
+#include "bytes.hpp"
+#include "usm.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace usm {
+
+    class ByteSource;
+
+    // Random access to the decrypted elementary stream of one track, as if it
+    // had been demuxed to a file. A byte range is mapped to packets by binary
+    // search over packet start positions; only the packets it touches are
+    // read and decrypted, and the last few decrypted packets are kept in an
+    // LRU cache. All reads are positional, so one TrackReader can serve many
+    // threads at once. `track` must outlive the reader.
+    class TrackReader {
+    public:
+        TrackReader(const Usm& usm, const Track& track,
+            std::optional<uint64_t> key_override = std::nullopt,
+            size_t cache_packets = 16);
+
+        // Total size of the decrypted stream.
+        uint64_t size() const;
+
+        size_t packet_count() const;
+        // Stream position of packet `index`; packet_start(packet_count()) is size().
+        uint64_t packet_start(size_t index) const;
+        // Index of the packet containing byte `pos` (pos < size()).
+        size_t packet_at(uint64_t pos) const;
+
+        // Copies up to `n` bytes at `pos` into `dst`; returns the number
+        // copied, which is short only at the end of the stream.
+        size_t read(uint64_t pos, void* dst, size_t n) const;
+
+        // One whole decrypted packet.
+        std::shared_ptr<const Bytes> packet(size_t index) const;
+
+    private:
+        const Track* track_ = nullptr;
+        std::shared_ptr<const ByteSource> source_;
+        std::optional<Keys> keys_;
+        std::vector<uint64_t> starts_;
+
+        using CacheList = std::list<std::pair<size_t, std::shared_ptr<const Bytes>>>;
+        size_t capacity_ = 0;
+        mutable std::mutex mutex_;
+        mutable CacheList lru_;  // most recent first
+        mutable std::unordered_map<size_t, CacheList::iterator> cached_;
+    };
+
+}  // namespace usm
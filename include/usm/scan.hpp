@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace usm {
+
+    // True if the 4 bytes at `p` are a known chunk signature (CRID, @SFV,
+    // @SFA, @ALP, @SBT, @CUE, SFSH, @AHX, @USR, @PST).
+    bool is_chunk_signature(const uint8_t* p);
+
+    // Position of the first chunk signature in `data[0, n)`, or n if there
+    // is none. Checks 16 bytes per step with SSE2 where available; the
+    // scalar version is the fallback and the reference.
+    size_t find_chunk_signature(const uint8_t* data, size_t n);
+    size_t find_chunk_signature_scalar(const uint8_t* data, size_t n);
+
+    // Position of the first occurrence of the big-endian `fourcc` in
+    // `data[0, n)`, or n. SSE2 matches its first two bytes 16 positions at
+    // a time.
+    size_t find_fourcc(const uint8_t* data, size_t n, uint32_t fourcc);
+    size_t find_fourcc_scalar(const uint8_t* data, size_t n, uint32_t fourcc);
+
+    // Total size (header + payload + padding) of the chunk whose 0x20-byte
+    // header is at `header`, per its size field.
+    uint64_t chunk_total_size(const uint8_t* header);
+
+    // Cheap sanity checks on a 0x20-byte chunk header: a known signature, the
+    // standard payload offset, padding that fits in the chunk, and a chunk
+    // that fits in the `remaining` bytes of the file.
+    bool plausible_chunk_header(const uint8_t* header, uint64_t remaining);
+
+}  // namespace usm
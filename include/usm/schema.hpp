@@ -0,0 +1,244 @@
+#pragma once
+
+#include "page.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace usm {
+
+    // A string literal usable as a template argument.
+    template <size_t N>
+    struct FieldName {
+        char chars[N]{};
+
+        constexpr FieldName(const char (&s)[N]) {
+            for (size_t i = 0; i < N; i++) chars[i] = s[i];
+        }
+
+        constexpr std::string_view view() const { return std::string_view(chars, N - 1); }
+    };
+
+    // One element of a known page layout. T is an arithmetic type (any
+    // integer column converts to an integral T), std::string_view for STRING
+    // or std::span<const uint8_t> for BYTES; views point into the page.
+    template <FieldName Name, typename T>
+    struct Field {
+        static constexpr std::string_view name = Name.view();
+        using type = T;
+    };
+
+    namespace detail {
+
+        inline bool is_integer_type(ElementType t) {
+            return t >= ElementType::I8 && t <= ElementType::U64;
+        }
+
+        template <typename T>
+        bool field_accepts(ElementType t) {
+            if constexpr (std::is_same_v<T, std::string_view>) {
+                return t == ElementType::STRING;
+            }
+            else if constexpr (std::is_same_v<T, std::span<const uint8_t>>) {
+                return t == ElementType::BYTES;
+            }
+            else if constexpr (std::is_floating_point_v<T>) {
+                return t == ElementType::F32 || t == ElementType::F64;
+            }
+            else {
+                static_assert(std::is_integral_v<T>, "Unsupported field type");
+                return is_integer_type(t);
+            }
+        }
+
+        template <typename T>
+        T field_value(const Element& e) {
+            if constexpr (std::is_same_v<T, std::string_view>) {
+                return std::get<std::pmr::string>(e.val);
+            }
+            else if constexpr (std::is_same_v<T, std::span<const uint8_t>>) {
+                return std::get<PmrBytes>(e.val);
+            }
+            else {
+                return std::visit([](const auto& v) -> T {
+                    using V = std::decay_t<decltype(v)>;
+                    if constexpr (std::is_arithmetic_v<V>) {
+                        return T(v);
+                    }
+                    else {
+                        throw std::runtime_error("Field is not numeric");
+                    }
+                    }, e.val);
+            }
+        }
+
+        template <typename F, typename... Fs>
+        constexpr size_t field_index() {
+            constexpr bool match[] = { std::is_same_v<F, Fs>... };
+            for (size_t i = 0; i < sizeof...(Fs); i++) {
+                if (match[i]) return i;
+            }
+            return sizeof...(Fs);
+        }
+
+    }  // namespace detail
+
+    // Typed access to the pages of one known layout. Field names are
+    // resolved to schema slots when a page with a new schema comes along;
+    // every other page of the same table reuses those slots, so a loop over
+    // thousands of rows hashes each name once.
+    template <typename... Fields>
+    class PageBinding {
+    public:
+        static constexpr size_t kFields = sizeof...(Fields);
+
+        class Row {
+        public:
+            // Throws when the page lacks the field or has it with another type.
+            template <typename F>
+            typename F::type get() const {
+                const int slot = slot_of<F>();
+                if (slot < 0) {
+                    throw std::runtime_error(std::string(F::name) + " is missing or mistyped");
+                }
+                return detail::field_value<typename F::type>(page_->element(size_t(slot)));
+            }
+
+            template <typename F>
+            std::optional<typename F::type> find() const {
+                const int slot = slot_of<F>();
+                if (slot < 0) return std::nullopt;
+                return detail::field_value<typename F::type>(page_->element(size_t(slot)));
+            }
+
+            const UsmPage& page() const { return *page_; }
+
+        private:
+            friend class PageBinding;
+
+            Row(const UsmPage& page, const std::array<int, kFields>& slots)
+                : page_(&page), slots_(&slots) {
+            }
+
+            template <typename F>
+            int slot_of() const {
+                constexpr size_t i = detail::field_index<F, Fields...>();
+                static_assert(i < kFields, "Field is not part of this binding");
+                return (*slots_)[i];
+            }
+
+            const UsmPage* page_;
+            const std::array<int, kFields>* slots_;
+        };
+
+        // The returned Row is valid until the next call.
+        Row operator()(const UsmPage& page) {
+            const PageSchema* schema = page.schema();
+            const uint64_t id = schema == nullptr ? 0 : schema->id();
+            if (id != bound_id_) bind(schema, id);
+            return Row(page, slots_);
+        }
+
+    private:
+        void bind(const PageSchema* schema, uint64_t id) {
+            size_t i = 0;
+            ((slots_[i++] = slot_for<Fields>(schema)), ...);
+            bound_id_ = id;
+        }
+
+        template <typename F>
+        static int slot_for(const PageSchema* schema) {
+            if (schema == nullptr) return -1;
+            std::optional<size_t> slot = schema->slot(F::name);
+            if (!slot.has_value()) return -1;
+            if (!detail::field_accepts<typename F::type>(schema->type(*slot))) return -1;
+            return int(*slot);
+        }
+
+        uint64_t bound_id_ = ~uint64_t(0);
+        std::array<int, kFields> slots_{};
+    };
+
+    namespace fields {
+
+        namespace crid {
+            using fmtver = Field<"fmtver", int32_t>;
+            using filename = Field<"filename", std::string_view>;
+            using filesize = Field<"filesize", int32_t>;
+            using datasize = Field<"datasize", int32_t>;
+            using stmid = Field<"stmid", int32_t>;
+            using chno = Field<"chno", int16_t>;
+            using minchk = Field<"minchk", int16_t>;
+            using minbuf = Field<"minbuf", int32_t>;
+            using avbps = Field<"avbps", int32_t>;
+        }  // namespace crid
+
+        namespace video_hdr {
+            using width = Field<"width", int32_t>;
+            using height = Field<"height", int32_t>;
+            using mat_width = Field<"mat_width", int32_t>;
+            using mat_height = Field<"mat_height", int32_t>;
+            using disp_width = Field<"disp_width", int32_t>;
+            using disp_height = Field<"disp_height", int32_t>;
+            using mpeg_codec = Field<"mpeg_codec", int32_t>;
+            using alpha_type = Field<"alpha_type", int32_t>;
+            using total_frames = Field<"total_frames", int32_t>;
+            using framerate_n = Field<"framerate_n", int32_t>;
+            using framerate_d = Field<"framerate_d", int32_t>;
+            using metadata_count = Field<"metadata_count", int32_t>;
+            using metadata_size = Field<"metadata_size", int32_t>;
+            using max_picture_size = Field<"max_picture_size", int32_t>;
+        }  // namespace video_hdr
+
+        namespace audio_hdr {
+            using audio_codec = Field<"audio_codec", int32_t>;
+            using sampling_rate = Field<"sampling_rate", int32_t>;
+            using num_channels = Field<"num_channels", int32_t>;
+            using metadata_count = Field<"metadata_count", int32_t>;
+            using metadata_size = Field<"metadata_size", int32_t>;
+            using ambisonics = Field<"ambisonics", int32_t>;
+        }  // namespace audio_hdr
+
+        namespace seek {
+            using ofs_byte = Field<"ofs_byte", int64_t>;
+            using ofs_frmid = Field<"ofs_frmid", int32_t>;
+            using num_skip = Field<"num_skip", int16_t>;
+            using resv = Field<"resv", int16_t>;
+        }  // namespace seek
+
+    }  // namespace fields
+
+    // CRIUSF_DIR_STREAM
+    using CridBinding = PageBinding<fields::crid::fmtver, fields::crid::filename,
+        fields::crid::filesize, fields::crid::datasize, fields::crid::stmid,
+        fields::crid::chno, fields::crid::minchk, fields::crid::minbuf,
+        fields::crid::avbps>;
+
+    // VIDEO_HDRINFO
+    using VideoHeaderBinding = PageBinding<fields::video_hdr::width,
+        fields::video_hdr::height, fields::video_hdr::mat_width,
+        fields::video_hdr::mat_height, fields::video_hdr::disp_width,
+        fields::video_hdr::disp_height, fields::video_hdr::mpeg_codec,
+        fields::video_hdr::alpha_type, fields::video_hdr::total_frames,
+        fields::video_hdr::framerate_n, fields::video_hdr::framerate_d,
+        fields::video_hdr::metadata_count, fields::video_hdr::metadata_size,
+        fields::video_hdr::max_picture_size>;
+
+    // AUDIO_HDRINFO
+    using AudioHeaderBinding = PageBinding<fields::audio_hdr::audio_codec,
+        fields::audio_hdr::sampling_rate, fields::audio_hdr::num_channels,
+        fields::audio_hdr::metadata_count, fields::audio_hdr::metadata_size,
+        fields::audio_hdr::ambisonics>;
+
+    // VIDEO_SEEKINFO
+    using SeekBinding = PageBinding<fields::seek::ofs_byte, fields::seek::ofs_frmid,
+        fields::seek::num_skip, fields::seek::resv>;
+
+}  // namespace usm
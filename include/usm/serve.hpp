@@ -0,0 +1,81 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace usm {
+
+    struct ServeOptions {
+        std::filesystem::path socket;
+        unsigned jobs = 0;  // worker threads (0 = hardware concurrency)
+        // Jobs waiting beyond this many are refused rather than queued.
+        size_t max_queue = 1024;
+        // Opened USMs (chunk scan, pages and packet index) kept for reuse.
+        size_t cache_entries = 64;
+    };
+
+    struct ServeMetrics {
+        size_t queued = 0;
+        size_t running = 0;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+        uint64_t rejected = 0;
+        uint64_t bytes_written = 0;  // by demux and remux jobs
+        uint64_t cache_hits = 0;
+        uint64_t cache_misses = 0;
+        double uptime = 0.0;  // seconds
+        double jobs_per_second = 0.0;
+        double bytes_per_second = 0.0;
+
+        Json to_json() const;
+    };
+
+    // Runs usmtool jobs for local clients over a Unix domain socket, so the
+    // process start-up, library loading and ICU set-up are paid once.
+    //
+    // Clients send one JSON object per line and get one back per request:
+    //   {"id": 1, "op": "demux", "path": "a.usm", "out": "dir", "key": 123}
+    //   {"id": 1, "ok": true, "result": {...}}  or  {"id": 1, "ok": false,
+    //   "error": "..."}
+    // Ops: "info", "index", "demux", "remux" (queued on the worker pool and
+    // answered as they finish, so replies may come out of order), and
+    // "metrics" and "shutdown" (answered at once). "key" may be a number or
+    // a decimal string. "index" needs "hash" ("crc32c" or "xxh64") and
+    // returns, per track, the packet count and a digest over the hashes of
+    // its raw (still encrypted) payloads; with "packet_hashes": true it also
+    // lists every packet's hash. Two files with equal digests carry the
+    // same packets. Opened USMs stay in an LRU cache keyed by path,
+    // key and packet hash, checked against the file's size and mtime, and
+    // their pages and indexes come from one pool shared by all jobs.
+    class JobServer {
+    public:
+        explicit JobServer(ServeOptions options);
+        ~JobServer();
+
+        JobServer(const JobServer&) = delete;
+        JobServer& operator=(const JobServer&) = delete;
+
+        // Binds the socket and serves until stop() or a "shutdown" request.
+        // Jobs still queued then are answered with an error.
+        void run();
+
+        // Safe to call from any thread and from a signal handler.
+        void stop();
+
+        // Runs one request on the calling thread and returns the reply line
+        // (without the newline).
+        std::string execute(const std::string& request);
+
+        ServeMetrics metrics() const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> state_;
+    };
+
+}  // namespace usm
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "bytes.hpp"
+#include "output.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace usm {
+
+    // A file descriptor plus the offset where a source begins inside it; lets
+    // callers use kernel-side copies on file-backed sources.
+    struct NativeFile {
+        int fd = -1;
+        uint64_t offset = 0;
+    };
+
+    // Random-access, read-only bytes. read_at is positional and safe to call
+    // from several threads at once.
+    class ByteSource {
+    public:
+        virtual ~ByteSource() = default;
+
+        virtual uint64_t size() const = 0;
+
+        // Reads exactly `n` bytes at `offset`; throws on a short read.
+        virtual void read_at(uint64_t offset, void* dst, size_t n) const = 0;
+
+        // Whole-source view when the bytes are already in memory.
+        virtual const uint8_t* data() const { return nullptr; }
+
+        virtual std::optional<NativeFile> native_file() const { return std::nullopt; }
+
+        // Display name; demux uses its file name for the output folder.
+        virtual std::string name() const { return {}; }
+    };
+
+    class FileSource : public ByteSource {
+    public:
+        explicit FileSource(const std::filesystem::path& path);
+
+        uint64_t size() const override;
+        void read_at(uint64_t offset, void* dst, size_t n) const override;
+        std::optional<NativeFile> native_file() const override;
+        std::string name() const override;
+
+    private:
+        std::filesystem::path path_;
+        FileHandle file_;
+        uint64_t size_ = 0;
+#ifdef _WIN32
+        mutable std::mutex mutex_;  // _read has a shared file position
+#endif
+    };
+
+    class MmapSource : public ByteSource {
+    public:
+        explicit MmapSource(const std::filesystem::path& path);
+        ~MmapSource() override;
+
+        MmapSource(const MmapSource&) = delete;
+        MmapSource& operator=(const MmapSource&) = delete;
+
+        uint64_t size() const override;
+        void read_at(uint64_t offset, void* dst, size_t n) const override;
+        const uint8_t* data() const override;
+        std::string name() const override;
+
+    private:
+        std::filesystem::path path_;
+        const uint8_t* data_ = nullptr;
+        uint64_t size_ = 0;
+#ifdef _WIN32
+        void* mapping_ = nullptr;
+#endif
+    };
+
+    // A span of memory. The owning constructor keeps the buffer alive; the
+    // pointer constructor requires the caller to.
+    class MemorySource : public ByteSource {
+    public:
+        MemorySource(const uint8_t* data, size_t size, std::string name = {});
+        explicit MemorySource(Bytes data, std::string name = {});
+
+        uint64_t size() const override;
+        void read_at(uint64_t offset, void* dst, size_t n) const override;
+        const uint8_t* data() const override;
+        std::string name() const override;
+
+    private:
+        Bytes owned_;
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+        std::string name_;
+    };
+
+    // [offset, offset + size) of another source, e.g. a USM inside a pack file.
+    class SubrangeSource : public ByteSource {
+    public:
+        SubrangeSource(std::shared_ptr<const ByteSource> parent, uint64_t offset,
+            uint64_t size, std::string name = {});
+
+        uint64_t size() const override;
+        void read_at(uint64_t offset, void* dst, size_t n) const override;
+        const uint8_t* data() const override;
+        std::optional<NativeFile> native_file() const override;
+        std::string name() const override;
+
+    private:
+        std::shared_ptr<const ByteSource> parent_;
+        uint64_t offset_ = 0;
+        uint64_t size_ = 0;
+        std::string name_;
+    };
+
+    // Sequential reader over a ByteSource through a fixed window, so scanning
+    // small chunk headers does not cost one read call each. Memory-backed
+    // sources are viewed directly.
+    class SourceReader {
+    public:
+        explicit SourceReader(const ByteSource& source, size_t window = 1 << 20);
+
+        // Pointer to `n` bytes at `offset`, valid until the next call.
+        // `n` must not exceed the window size.
+        const uint8_t* view(uint64_t offset, size_t n);
+        // Like view(), but ranges larger than the window are read into `spill`.
+        const uint8_t* view(uint64_t offset, size_t n, Bytes& spill);
+
+        // Largest `n` view() accepts: the window, or all of a memory source.
+        size_t max_view() const;
+
+        const ByteSource& source() const { return source_; }
+
+    private:
+        const ByteSource& source_;
+        const uint8_t* direct_ = nullptr;
+        Bytes window_;
+        uint64_t window_offset_ = 0;
+        size_t window_size_ = 0;
+    };
+
+}  // namespace usm
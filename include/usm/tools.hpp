@@ -25,6 +25,10 @@ namespace usm {
 
 	Bytes crypt_audio_packet(const Bytes& packet, const Bytes& audio_key);
 
+	// In-place variants for callers that reuse one packet buffer.
+	void decrypt_video_packet(uint8_t* data, size_t size, const Bytes& video_key);
+	void crypt_audio_packet(uint8_t* data, size_t size, const Bytes& audio_key);
+
 	std::string slugify_utf8(const std::string& s, bool allow_unicode = true);
 
 	std::string basename_utf8(const std::string& path_like);
@@ -34,6 +34,7 @@ namespace usm {
     };
 
     enum class ElementOccurrence : uint8_t {
+        ZERO = 0,  // no stored value; reads as zero (CPK tables)
         RECURRING = 1,
         NON_RECURRING = 2,
     };
@@ -110,6 +111,8 @@ namespace usm {
 
     inline ElementOccurrence element_occurrence_from_u8(uint8_t v) {
         switch (v) {
+        case 0:
+            return ElementOccurrence::ZERO;
         case 1:
             return ElementOccurrence::RECURRING;
         case 2:
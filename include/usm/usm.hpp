@@ -2,11 +2,17 @@
 
 #pragma once
 
+#include "bytes.hpp"
+#include "hash.hpp"
+#include "index.hpp"
+#include "output.hpp"
 #include "page.hpp"
 #include "types.hpp"
 
 #include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
 #include <utility>
@@ -15,41 +21,165 @@
 namespace usm {
 
     struct Track {
+        ChunkType chunk_type = ChunkType::VIDEO;
         int channel_number = 0;
         UsmPage crid{ "CRIUSF_DIR_STREAM" };
         UsmPage header{ "" };
         std::optional<std::vector<UsmPage>> metadata;
-        std::vector<std::pair<uint64_t, uint32_t>> stream;  // (offset, size)
+        // (offset, size) of each payload, with its (frame_time, frame_rate).
+        PacketIndex stream;
+        // Hash of each raw (still encrypted) payload, when requested at open.
+        std::pmr::vector<uint64_t> packet_hashes;
     };
 
+    struct OpenOptions {
+        std::optional<uint64_t> key;
+        std::string encoding = "UTF-8";
+        // Pages and packet indexes are allocated from `mr`; see Usm::open.
+        std::pmr::memory_resource* mr = std::pmr::get_default_resource();
+        // Fills Track::packet_hashes, so two files can be compared packet by
+        // packet without decrypting. Costs a read of every payload.
+        HashAlgorithm packet_hash = HashAlgorithm::NONE;
+        // Skip damaged or truncated regions instead of throwing: after a bad
+        // chunk header the scan resumes at the next plausible chunk (see
+        // scan.hpp), and unreadable page chunks are dropped. What was
+        // skipped is listed by Usm::skipped().
+        bool recover = false;
+        // Threads for the chunk scan. Large files are split into segments
+        // indexed concurrently and stitched back together; the result is
+        // the same as a sequential scan. Ignored with `recover`.
+        unsigned jobs = 1;
+    };
+
+    // A byte range Usm::open skipped in recovery mode.
+    struct SkippedRange {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        std::string reason;
+    };
+
+    struct DemuxOptions {
+        bool video = true;
+        bool audio = true;
+        bool alpha = true;
+        std::optional<uint64_t> key_override;
+        // Also removes HCA-level encryption from HCA audio tracks, so they
+        // come out as plain HCA; see HcaDecrypter.
+        std::optional<uint64_t> hca_key;
+        // Hash of each output, computed on the decrypted packet buffers as
+        // they are written rather than by reading the files back.
+        HashAlgorithm hash = HashAlgorithm::NONE;
+        // Output files are preallocated to their final size and written
+        // through a large aligned buffer; see FileWriter.
+        WriterOptions writer;
+        // Keeps "<output>.manifest" (source size, mtime and fingerprint,
+        // packet count, bytes written) next to each output. Outputs the
+        // manifest marks complete are skipped; partial ones resume after
+        // the last packet known to be on disk. Outputs then always go
+        // through the buffered writer, which is what checkpoints progress.
+        bool incremental = false;
+    };
+
+    struct DemuxedTrack {
+        ChunkType chunk_type = ChunkType::VIDEO;
+        int channel_number = 0;
+        std::filesystem::path path;
+        uint64_t size = 0;
+        std::string hash;  // hex digest; empty without DemuxOptions::hash
+        // DemuxOptions::incremental: already complete and left untouched, or
+        // the bytes kept from an interrupted run.
+        bool skipped = false;
+        uint64_t resumed_at = 0;
+    };
+
+    // Video/audio keys derived from a 64-bit USM key (see generate_keys).
+    struct Keys {
+        Bytes video;
+        Bytes audio;
+    };
+
+    class ByteSource;
+
+    std::optional<Keys> keys_for(std::optional<uint64_t> key);
+
+    // Removes the USM-level encryption of one STREAM payload. Video and alpha
+    // packets use the video key, audio packets the audio key.
+    Bytes decrypt_packet(const Bytes& packet, ChunkType type, const Keys& keys);
+    void decrypt_packet(uint8_t* data, size_t size, ChunkType type, const Keys& keys);
+
     class Usm {
     public:
+        // Pages and packet indexes are allocated from `mr`, which must outlive
+        // the returned Usm (and any moved-from copy of it). Passing a
+        // std::pmr::monotonic_buffer_resource makes a whole open one arena
+        // that is released at once.
         static Usm open(const std::filesystem::path& path,
             std::optional<uint64_t> key = std::nullopt,
-            const std::string& encoding = "UTF-8");
+            const std::string& encoding = "UTF-8",
+            std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+        // Opens a USM from any ByteSource (memory, mmap, a range of a pack
+        // file...). Packets are read back through the source on demux, so it
+        // is kept alive by the Usm. filepath() is the source name.
+        static Usm open(std::shared_ptr<const ByteSource> source,
+            std::optional<uint64_t> key = std::nullopt,
+            const std::string& encoding = "UTF-8",
+            std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+        static Usm open(const std::filesystem::path& path, const OpenOptions& options);
+        static Usm open(std::shared_ptr<const ByteSource> source, const OpenOptions& options);
 
         std::filesystem::path filepath() const;
+        std::shared_ptr<const ByteSource> source() const;
+        std::optional<uint64_t> key() const;
+        const std::string& encoding() const;
 
         const std::vector<Track>& videos() const;
         const std::vector<Track>& audios() const;
         const std::vector<Track>& alphas() const;
 
+        const Track* find_track(ChunkType type, int channel_number) const;
+
         const UsmPage& usm_crid_page() const;
         std::optional<int> version() const;
 
+        // Algorithm of Track::packet_hashes (NONE when not computed).
+        HashAlgorithm packet_hash() const;
+
+        // Ranges skipped by OpenOptions::recover, in file order.
+        const std::vector<SkippedRange>& skipped() const;
+
         // Demux elementary streams (concatenated payloads).
         // If key was provided (or key_override), decrypt is applied.
         void demux(const std::filesystem::path& out_dir, bool save_video = true,
             bool save_audio = true, bool save_alpha = true,
             std::optional<uint64_t> key_override = std::nullopt) const;
 
+        std::vector<DemuxedTrack> demux(const std::filesystem::path& out_dir,
+            const DemuxOptions& options) const;
+
+        // Writes one track's elementary stream to `out_fd` (stdout, a FIFO or
+        // a file). Keyless tracks from a file skip the per-packet loop:
+        // large payloads are moved in the kernel (splice, copy_file_range or
+        // sendfile), small ones gathered into few reads and writev calls.
+        // Encrypted ones go through one reused buffer. `hca_key` is as in
+        // DemuxOptions.
+        void demux_track(const Track& track, int out_fd,
+            std::optional<uint64_t> key_override = std::nullopt,
+            std::optional<uint64_t> hca_key = std::nullopt) const;
+
     private:
+        explicit Usm(std::pmr::memory_resource* mr);
+
         std::filesystem::path path_;
+        std::shared_ptr<const ByteSource> source_;
         std::optional<uint64_t> key_;
         std::string encoding_;
 
         UsmPage usm_crid_{ "CRIUSF_DIR_STREAM" };
         std::optional<int> version_;
+        HashAlgorithm packet_hash_ = HashAlgorithm::NONE;
+        std::vector<SkippedRange> skipped_;
 
         std::vector<Track> videos_;
         std::vector<Track> audios_;
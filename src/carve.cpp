@@ -0,0 +1,200 @@
+#include "usm/carve.hpp"
+
+#include "usm/page.hpp"
+#include "usm/scan.hpp"
+#include "usm/schema.hpp"
+#include "usm/tools.hpp"
+#include "usm/types.hpp"
+#include "usm/usm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace usm {
+
+    // A CRID payload is a handful of small pages; anything larger is a false
+    // match and not worth reading.
+    static constexpr uint64_t kMaxCridPayload = 1 << 20;
+
+    static uint32_t load_be32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+            uint32_t(p[3]);
+    }
+
+    std::string CarvedUsm::name() const {
+        std::ostringstream out;
+        out << std::hex << std::setw(8) << std::setfill('0') << offset << "_";
+        const std::string base = basename_utf8(filename);
+        out << (base.empty() ? "carved.usm" : base);
+        return out.str();
+    }
+
+    // Bytes the USM starting at `offset` spans: chunks are followed until one
+    // is implausible, a CRID comes after stream data (the next USM), or the
+    // walked size equals the `declared` CRID filesize.
+    static uint64_t usm_extent(SourceReader& reader, uint64_t offset, uint64_t declared) {
+        const uint64_t filesize = reader.source().size();
+        uint64_t pos = offset;
+        bool content = false;
+        while (pos + 0x20 <= filesize) {
+            const uint8_t* header = reader.view(pos, 0x20);
+            if (!plausible_chunk_header(header, filesize - pos)) break;
+            const bool info = load_be32(header) == uint32_t(ChunkType::INFO);
+            if (info && content) break;
+            if (!info) content = true;
+            pos += chunk_total_size(header);
+            if (pos - offset == declared) break;
+        }
+        return pos - offset;
+    }
+
+    // The USM starting at `offset`, if there is a CRID chunk there whose
+    // payload parses as a CRIUSF_DIR_STREAM table.
+    static std::optional<CarvedUsm> probe_usm(SourceReader& reader, uint64_t offset,
+        const std::string& encoding, Bytes& spill) {
+        const uint64_t filesize = reader.source().size();
+        if (offset + 0x20 > filesize) return std::nullopt;
+
+        const uint8_t* header = reader.view(offset, 0x20);
+        if (!plausible_chunk_header(header, filesize - offset)) return std::nullopt;
+        const uint32_t padding = (uint32_t(header[0xA]) << 8) | header[0xB];
+        const uint64_t payload_size = chunk_total_size(header) - 0x20 - padding;
+        if (payload_size < 4 || payload_size > kMaxCridPayload) return std::nullopt;
+
+        const uint8_t* p = reader.view(offset + 0x20, size_t(payload_size), spill);
+        const Bytes payload(p, p + payload_size);
+        if (!is_payload_list_pages(payload)) return std::nullopt;
+
+        std::vector<UsmPage> pages;
+        try {
+            pages = get_pages(payload, encoding);
+        }
+        catch (const std::exception&) {
+            return std::nullopt;
+        }
+        if (pages.empty() || pages[0].name() != "CRIUSF_DIR_STREAM") return std::nullopt;
+
+        // The first page describes the USM itself.
+        CridBinding crid_fields;
+        const auto crid = crid_fields(pages[0]);
+        CarvedUsm out;
+        out.offset = offset;
+        if (auto name = crid.find<fields::crid::filename>()) out.filename = std::string(*name);
+        uint64_t declared = 0;
+        if (auto size = crid.find<fields::crid::filesize>(); size && *size > 0) {
+            declared = uint64_t(*size);
+        }
+        out.size = usm_extent(reader, offset, declared);
+        return out;
+    }
+
+    std::vector<CarvedUsm> carve_usms(const ByteSource& source, const CarveOptions& options) {
+        const uint64_t filesize = source.size();
+        const uint64_t segment_size = std::max<uint64_t>(options.segment_size, 1 << 16);
+        const size_t segments = size_t((filesize + segment_size - 1) / segment_size);
+
+        unsigned jobs = options.jobs;
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        jobs = unsigned(std::max<size_t>(1, std::min<size_t>(jobs, segments)));
+
+        std::atomic<size_t> next{ 0 };
+        std::mutex mutex;
+        std::vector<CarvedUsm> found;
+        std::exception_ptr error;
+
+        auto worker = [&]() {
+            // Candidates are checked through a second reader so the scan
+            // window stays valid.
+            SourceReader scan(source);
+            SourceReader check(source);
+            Bytes spill;
+            try {
+                for (size_t s = next++; s < segments; s = next++) {
+                    const uint64_t begin = uint64_t(s) * segment_size;
+                    const uint64_t end = std::min(filesize, begin + segment_size);
+                    // Matches must start inside the segment; the last one
+                    // may run 3 bytes into the next.
+                    uint64_t pos = begin;
+                    while (pos < end) {
+                        const size_t n = size_t(std::min<uint64_t>({ scan.max_view(),
+                            filesize - pos, end - pos + 3 }));
+                        if (n < 4) break;
+                        const uint8_t* p = scan.view(pos, n);
+                        for (size_t i = 0;; i++) {
+                            i += find_fourcc(p + i, n - i, uint32_t(ChunkType::INFO));
+                            if (i >= n) break;
+                            auto usm = probe_usm(check, pos + i, options.encoding, spill);
+                            if (!usm.has_value()) continue;
+                            std::lock_guard<std::mutex> lock(mutex);
+                            found.push_back(std::move(*usm));
+                        }
+                        pos += n - 3;
+                    }
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+                next = segments;
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+        if (error) std::rethrow_exception(error);
+
+        std::sort(found.begin(), found.end(),
+            [](const CarvedUsm& a, const CarvedUsm& b) { return a.offset < b.offset; });
+        std::vector<CarvedUsm> out;
+        for (auto& usm : found) {
+            if (!out.empty() && usm.offset < out.back().offset + out.back().size) continue;
+            out.push_back(std::move(usm));
+        }
+        return out;
+    }
+
+    std::vector<CarveDemuxError> demux_carved(std::shared_ptr<const ByteSource> source,
+        const std::vector<CarvedUsm>& found, const std::filesystem::path& out_dir,
+        std::optional<uint64_t> key, unsigned jobs) {
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        jobs = unsigned(std::min<size_t>(jobs, found.size()));
+
+        std::atomic<size_t> next{ 0 };
+        std::mutex errors_mutex;
+        std::vector<CarveDemuxError> errors;
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < found.size(); i = next++) {
+                const CarvedUsm& c = found[i];
+                try {
+                    auto range = std::make_shared<SubrangeSource>(source, c.offset, c.size,
+                        c.name());
+                    Usm u = Usm::open(range, key);
+                    u.demux(out_dir);
+                }
+                catch (const std::exception& ex) {
+                    std::lock_guard<std::mutex> lock(errors_mutex);
+                    errors.push_back({ c.offset, ex.what() });
+                }
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+
+        std::sort(errors.begin(), errors.end(),
+            [](const CarveDemuxError& a, const CarveDemuxError& b) { return a.offset < b.offset; });
+        return errors;
+    }
+
+}  // namespace usm
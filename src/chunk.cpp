@@ -32,7 +32,35 @@ namespace usm {
         return int(0x20 + payload_bytes.size() + pad);
     }
 
-    UsmChunk UsmChunk::from_bytes(const Bytes& chunk, const std::string& enc) {
+    ChunkHeader ChunkHeader::parse(const uint8_t* header) {
+        auto be32 = [&](size_t off) {
+            return (uint32_t(header[off]) << 24) | (uint32_t(header[off + 1]) << 16) |
+                (uint32_t(header[off + 2]) << 8) | uint32_t(header[off + 3]);
+            };
+
+        const uint32_t chunksize_field = be32(0x4);
+        const uint8_t payload_offset_field = header[0x9];
+        const uint16_t padding_size = uint16_t((header[0xA] << 8) | header[0xB]);
+
+        ChunkHeader h;
+        h.chunk_type = chunk_type_from_u32(be32(0));
+        h.payload_type = payload_type_from_u8(uint8_t(header[0xF] & 0x3));
+        h.payload_offset = int(0x08 + payload_offset_field);
+        h.payload_size =
+            int(chunksize_field) - int(padding_size) - int(payload_offset_field);
+        h.padding = int(padding_size);
+        h.channel_number = int(header[0xC]);
+        h.frame_time = be32(0x10);
+        h.frame_rate = be32(0x14);
+
+        if (h.payload_size < 0) {
+            throw std::runtime_error("Bad payload size");
+        }
+        return h;
+    }
+
+    UsmChunk UsmChunk::from_bytes(const Bytes& chunk, const std::string& enc,
+        std::pmr::memory_resource* mr) {
         if (chunk.size() < 0x20) {
             throw std::runtime_error("Chunk too small");
         }
@@ -69,7 +97,7 @@ namespace usm {
 
         std::variant<Bytes, std::vector<UsmPage>> payload_variant;
         if (is_payload_list_pages(payload_raw)) {
-            payload_variant = get_pages(payload_raw, enc);
+            payload_variant = get_pages(payload_raw, enc, mr);
         }
         else {
             payload_variant = payload_raw;
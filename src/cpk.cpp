@@ -0,0 +1,222 @@
+#include "usm/cpk.hpp"
+
+#include "usm/usm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace usm {
+
+    static uint32_t read_le_u32(const uint8_t* p) {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+            (uint32_t(p[3]) << 24);
+    }
+
+    static bool is_utf(const Bytes& b) {
+        return b.size() >= 4 && std::memcmp(b.data(), "@UTF", 4) == 0;
+    }
+
+    // Tables in some archives are obfuscated with a multiplicative XOR stream.
+    static void decrypt_utf(Bytes& b) {
+        uint8_t x = 0x5F;
+        for (auto& c : b) {
+            c ^= x;
+            x = uint8_t(x * 0x15);
+        }
+    }
+
+    // Reads the @UTF table of a "CPK "/"TOC "/"ITOC" section at `offset`.
+    static std::vector<UsmPage> read_section(const ByteSource& src, uint64_t offset,
+        const char* magic) {
+        uint8_t head[0x10];
+        src.read_at(offset, head, sizeof(head));
+        if (std::memcmp(head, magic, 4) != 0) {
+            throw std::runtime_error(std::string("Missing CPK ") + magic + " section");
+        }
+
+        Bytes table(read_le_u32(head + 8));
+        src.read_at(offset + sizeof(head), table.data(), table.size());
+        if (!is_utf(table)) {
+            decrypt_utf(table);
+            if (!is_utf(table)) throw std::runtime_error("Invalid CPK table signature");
+        }
+        return get_pages(table);
+    }
+
+    // A u16 FileSize of 0x8000 or more comes in as a negative int16_t.
+    static_assert(zero_extend(int16_t(-0x8000)) == 0x8000);
+    static_assert(zero_extend(int32_t(-1)) == 0xFFFFFFFFu);
+
+    static std::optional<uint64_t> page_u64(const UsmPage& p, std::string_view k) {
+        const Element* e = p.find(k);
+        if (e == nullptr) return std::nullopt;
+        return element_u64(*e);
+    }
+
+    static std::string page_str(const UsmPage& p, std::string_view k) {
+        const Element* e = p.find(k);
+        if (e == nullptr || e->type != ElementType::STRING) return {};
+        return std::string(std::get<std::pmr::string>(e->val));
+    }
+
+    static const PmrBytes* page_bytes(const UsmPage& p, std::string_view k) {
+        const Element* e = p.find(k);
+        if (e == nullptr || e->type != ElementType::BYTES) return nullptr;
+        return &std::get<PmrBytes>(e->val);
+    }
+
+    std::string CpkEntry::path() const {
+        return dir.empty() ? name : dir + "/" + name;
+    }
+
+    Cpk Cpk::open(const std::filesystem::path& path) {
+        if (!std::filesystem::exists(path)) {
+            throw std::runtime_error("File not found");
+        }
+        return open(std::make_shared<FileSource>(path));
+    }
+
+    Cpk Cpk::open(std::shared_ptr<const ByteSource> source) {
+        if (source == nullptr) throw std::runtime_error("Null source");
+
+        Cpk out;
+        out.source_ = std::move(source);
+        const ByteSource& src = *out.source_;
+
+        std::vector<UsmPage> header = read_section(src, 0, "CPK ");
+        if (header.empty()) throw std::runtime_error("Empty CPK header");
+        out.header_ = std::move(header[0]);
+
+        const uint64_t content_offset = page_u64(out.header_, "ContentOffset").value_or(0);
+        const uint64_t toc_offset = page_u64(out.header_, "TocOffset").value_or(0);
+        const uint64_t itoc_offset = page_u64(out.header_, "ItocOffset").value_or(0);
+
+        if (toc_offset != 0) {
+            // TOC FileOffsets are relative to whichever of the TOC and the
+            // content area comes first.
+            uint64_t base = toc_offset;
+            if (content_offset != 0) base = std::min(base, content_offset);
+
+            for (const auto& row : read_section(src, toc_offset, "TOC ")) {
+                CpkEntry e;
+                e.dir = page_str(row, "DirName");
+                e.name = page_str(row, "FileName");
+                e.id = uint32_t(page_u64(row, "ID").value_or(0));
+                e.offset = base + page_u64(row, "FileOffset").value_or(0);
+                e.size = page_u64(row, "FileSize").value_or(0);
+                e.extract_size = page_u64(row, "ExtractSize").value_or(e.size);
+                out.entries_.push_back(std::move(e));
+            }
+        }
+        else if (itoc_offset != 0) {
+            // ID-only archive: files follow each other from the content area
+            // in ID order, each aligned to Align. Small files are listed in
+            // DataL, large ones in DataH.
+            std::vector<UsmPage> itoc = read_section(src, itoc_offset, "ITOC");
+            if (itoc.empty()) throw std::runtime_error("Empty CPK ITOC");
+
+            for (const char* column : { "DataL", "DataH" }) {
+                const PmrBytes* data = page_bytes(itoc[0], column);
+                if (data == nullptr || data->empty()) continue;
+                for (const auto& row : get_pages(Bytes(data->begin(), data->end()))) {
+                    CpkEntry e;
+                    e.id = uint32_t(page_u64(row, "ID").value_or(0));
+                    e.name = std::to_string(e.id);
+                    e.size = page_u64(row, "FileSize").value_or(0);
+                    e.extract_size = page_u64(row, "ExtractSize").value_or(e.size);
+                    out.entries_.push_back(std::move(e));
+                }
+            }
+
+            std::sort(out.entries_.begin(), out.entries_.end(),
+                [](const CpkEntry& a, const CpkEntry& b) { return a.id < b.id; });
+
+            const uint64_t align =
+                std::max<uint64_t>(1, page_u64(out.header_, "Align").value_or(1));
+            uint64_t pos = content_offset;
+            for (auto& e : out.entries_) {
+                e.offset = pos;
+                pos += (e.size + align - 1) / align * align;
+            }
+        }
+        else {
+            throw std::runtime_error("CPK has neither TOC nor ITOC");
+        }
+
+        for (const auto& e : out.entries_) {
+            if (e.offset > src.size() || e.size > src.size() - e.offset) {
+                throw std::runtime_error("CPK entry out of bounds: " + e.path());
+            }
+        }
+
+        return out;
+    }
+
+    const UsmPage& Cpk::header() const { return header_; }
+    const std::vector<CpkEntry>& Cpk::entries() const { return entries_; }
+
+    const CpkEntry* Cpk::find(std::string_view path) const {
+        for (const auto& e : entries_) {
+            if (e.path() == path) return &e;
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<const ByteSource> Cpk::open_entry(const CpkEntry& entry) const {
+        if (entry.compressed()) {
+            throw std::runtime_error("Compressed CPK entry: " + entry.path());
+        }
+        return std::make_shared<SubrangeSource>(source_, entry.offset, entry.size,
+            entry.path());
+    }
+
+    std::vector<const CpkEntry*> Cpk::usm_entries() const {
+        std::vector<const CpkEntry*> out;
+        for (const auto& e : entries_) {
+            if (e.compressed() || e.size < 4) continue;
+            char magic[4];
+            source_->read_at(e.offset, magic, 4);
+            if (std::memcmp(magic, "CRID", 4) == 0) out.push_back(&e);
+        }
+        return out;
+    }
+
+    std::vector<CpkDemuxError> Cpk::demux_all(const std::vector<const CpkEntry*>& entries,
+        const std::filesystem::path& out_dir, std::optional<uint64_t> key,
+        unsigned jobs) const {
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        jobs = unsigned(std::min<size_t>(jobs, entries.size()));
+
+        std::atomic<size_t> next{ 0 };
+        std::mutex errors_mutex;
+        std::vector<CpkDemuxError> errors;
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < entries.size(); i = next++) {
+                const CpkEntry& e = *entries[i];
+                try {
+                    Usm u = Usm::open(open_entry(e), key);
+                    u.demux(out_dir / e.dir);
+                }
+                catch (const std::exception& ex) {
+                    std::lock_guard<std::mutex> lock(errors_mutex);
+                    errors.push_back({ e.path(), ex.what() });
+                }
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+
+        std::sort(errors.begin(), errors.end(),
+            [](const CpkDemuxError& a, const CpkDemuxError& b) { return a.path < b.path; });
+        return errors;
+    }
+
+}  // namespace usm
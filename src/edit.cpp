@@ -0,0 +1,1029 @@
+#include "usm/edit.hpp"
+
+#include "usm/chunk.hpp"
+#include "usm/hca.hpp"
+#include "usm/output.hpp"
+#include "usm/scan.hpp"
+#include "usm/source.hpp"
+#include "usm/tools.hpp"
+#include "usm/usm.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <stdexcept>
+
+namespace usm {
+
+    // A grown chunk gets this much extra padding, so the next small edit
+    // fits in place instead of rewriting the file again.
+    static constexpr size_t kRewriteSlack = 0x100;
+
+    namespace {
+
+        // One chunk before the stream data, read whole.
+        struct PageChunk {
+            uint64_t offset = 0;
+            ChunkHeader header;
+            Bytes bytes;
+        };
+
+        struct Prefix {
+            std::vector<PageChunk> chunks;
+            uint64_t end = 0;  // offset of the first STREAM chunk
+            uint64_t filesize = 0;
+        };
+
+    }  // namespace
+
+    static void store_be32(uint8_t* p, uint32_t v) {
+        p[0] = uint8_t(v >> 24);
+        p[1] = uint8_t(v >> 16);
+        p[2] = uint8_t(v >> 8);
+        p[3] = uint8_t(v);
+    }
+
+    // Reads the chunks in front of the stream data. Every USM writes its
+    // CRID, HEADER and METADATA chunks there, so a multi-GB file costs one
+    // header read per chunk up to its first packet.
+    static Prefix read_prefix(const std::filesystem::path& path) {
+        FileSource source(path);
+        Prefix prefix;
+        prefix.filesize = source.size();
+        uint64_t offset = 0;
+        while (offset + 0x20 <= prefix.filesize) {
+            uint8_t header[0x20];
+            source.read_at(offset, header, sizeof(header));
+            if (!plausible_chunk_header(header, prefix.filesize - offset)) {
+                throw std::runtime_error("Damaged chunk at offset " + std::to_string(offset));
+            }
+            PageChunk c;
+            c.offset = offset;
+            c.header = ChunkHeader::parse(header);
+            if (c.header.payload_type == PayloadType::STREAM) break;
+            c.bytes.resize(size_t(chunk_total_size(header)));
+            source.read_at(offset, c.bytes.data(), c.bytes.size());
+            offset += c.bytes.size();
+            prefix.chunks.push_back(std::move(c));
+        }
+        prefix.end = offset;
+        return prefix;
+    }
+
+    // Empty when the payload is not an @UTF table.
+    static std::vector<UsmPage> chunk_pages(const PageChunk& c, const std::string& encoding) {
+        const auto begin = c.bytes.begin() + c.header.payload_offset;
+        const Bytes payload(begin, begin + c.header.payload_size);
+        if (!is_payload_list_pages(payload)) return {};
+        return get_pages(payload, encoding);
+    }
+
+    // `payload` behind a copy of `header` with its size and padding fields
+    // rewritten; the other header bytes are kept as they were.
+    static Bytes build_chunk(const Bytes& header, const Bytes& payload, size_t padding) {
+        Bytes out(header.begin(), header.begin() + 0x20);
+        store_be32(out.data() + 4, uint32_t(0x18 + payload.size() + padding));
+        out[0x9] = 0x18;
+        out[0xA] = uint8_t(padding >> 8);
+        out[0xB] = uint8_t(padding);
+        out.insert(out.end(), payload.begin(), payload.end());
+        out.insert(out.end(), padding, 0x00);
+        return out;
+    }
+
+    // `pages` packed into a chunk of exactly the size of `c`, or nothing if
+    // they no longer fit. Slack beyond what the 16-bit padding field holds
+    // goes into the @UTF string pool instead.
+    static std::optional<Bytes> repack_same_size(const PageChunk& c,
+        const std::vector<UsmPage>& pages, const std::string& encoding) {
+        const size_t total = c.bytes.size();
+        Bytes payload = pack_pages(pages, encoding);
+        if (0x20 + payload.size() > total) return std::nullopt;
+        size_t padding = total - 0x20 - payload.size();
+        if (padding > 0xFFFF) {
+            payload = pack_pages(pages, encoding, int(padding - 0xFFFF));
+            padding = 0xFFFF;
+        }
+        return build_chunk(c.bytes, payload, padding);
+    }
+
+    static bool is_target(const PageChunk& c, const PatchTarget& target) {
+        if (c.header.chunk_type != target.chunk_type) return false;
+        if (target.chunk_type == ChunkType::INFO) return true;
+        return c.header.payload_type == PayloadType::HEADER &&
+            c.header.channel_number == target.channel_number;
+    }
+
+    // Sets an existing integer element, keeping its type.
+    static void set_integer(UsmPage& page, std::string_view key, int64_t value) {
+        const Element* e = page.find(key);
+        if (e == nullptr) return;
+        const ElementType type = e->type;
+        switch (type) {
+        case ElementType::I8:
+            page.update(key, type, int8_t(value));
+            break;
+        case ElementType::U8:
+            page.update(key, type, uint8_t(value));
+            break;
+        case ElementType::I16:
+            page.update(key, type, int16_t(value));
+            break;
+        case ElementType::U16:
+            page.update(key, type, uint16_t(value));
+            break;
+        case ElementType::I32:
+            page.update(key, type, int32_t(value));
+            break;
+        case ElementType::U32:
+            page.update(key, type, uint32_t(value));
+            break;
+        case ElementType::I64:
+            page.update(key, type, int64_t(value));
+            break;
+        case ElementType::U64:
+            page.update(key, type, uint64_t(value));
+            break;
+        default:
+            throw std::runtime_error("Unexpected type for " + std::string(key));
+        }
+    }
+
+    static void shift_element(UsmPage& page, std::string_view key, int64_t delta) {
+        const Element* e = page.find(key);
+        if (e == nullptr) return;
+        const std::optional<uint64_t> value = element_u64(*e);
+        if (!value.has_value()) throw std::runtime_error(std::string(key) + " is not an integer");
+        set_integer(page, key, int64_t(*value + uint64_t(delta)));
+    }
+
+    // VIDEO_SEEKINFO tables travel in METADATA chunks of video/alpha channels.
+    static bool is_seek_chunk(const PageChunk& c) {
+        return c.header.payload_type == PayloadType::METADATA &&
+            (c.header.chunk_type == ChunkType::VIDEO || c.header.chunk_type == ChunkType::ALPHA);
+    }
+
+    static void overwrite(const std::filesystem::path& path, uint64_t offset, const Bytes& data) {
+        FileHandle file = FileHandle::open_update(path);
+        pwrite_all(file.fd(), offset, data.data(), data.size());
+    }
+
+    // Writes `prefix` followed by the original bytes from `from` to the end
+    // of `path` into `out`, in the kernel where it can. `out` is synced to
+    // disk before this returns.
+    static void write_rewritten(const std::filesystem::path& path, uint64_t from,
+        uint64_t filesize, const Bytes& prefix, const std::filesystem::path& out) {
+        FileHandle in = FileHandle::open_read(path);
+        FileHandle file = FileHandle::open_write(out);
+        write_all(file.fd(), prefix.data(), prefix.size());
+
+        const size_t step = size_t(1) << 30;
+        uint64_t pos = from;
+        while (pos < filesize) {
+            const size_t n = size_t(std::min<uint64_t>(filesize - pos, step));
+            if (!kernel_copy(in.fd(), pos, n, file.fd(), false)) break;
+            pos += n;
+        }
+
+        Bytes buf;
+        while (pos < filesize) {
+            const size_t n = size_t(std::min<uint64_t>(filesize - pos, 4 << 20));
+            buf.resize(n);
+            pread_all(in.fd(), pos, buf.data(), n);
+            write_all(file.fd(), buf.data(), n);
+            pos += n;
+        }
+        // On disk before it is renamed over the original.
+        sync_data(file.fd());
+    }
+
+    PatchResult patch_pages(const std::filesystem::path& path, const PatchTarget& target,
+        const PageEditor& edit, const std::string& encoding) {
+        Prefix prefix = read_prefix(path);
+        auto it = std::find_if(prefix.chunks.begin(), prefix.chunks.end(),
+            [&](const PageChunk& c) { return is_target(c, target); });
+        if (it == prefix.chunks.end()) {
+            throw std::runtime_error("No " + fourcc_to_string(uint32_t(target.chunk_type)) +
+                " page chunk for channel " + std::to_string(target.channel_number));
+        }
+        PageChunk& chunk = *it;
+
+        std::vector<UsmPage> pages = chunk_pages(chunk, encoding);
+        if (pages.empty()) {
+            throw std::runtime_error("Chunk at offset " + std::to_string(chunk.offset) +
+                " carries no pages");
+        }
+        edit(pages);
+        if (pages.empty()) throw std::runtime_error("Patched chunk has no pages");
+
+        if (auto same = repack_same_size(chunk, pages, encoding)) {
+            overwrite(path, chunk.offset, *same);
+            return PatchResult::IN_PLACE;
+        }
+
+        // The chunk grows: pad it to a 0x20 boundary plus some slack and move
+        // everything after it.
+        const Bytes payload = pack_pages(pages, encoding);
+        const size_t used = 0x20 + payload.size();
+        const size_t padding = (0x20 - used % 0x20) % 0x20 + kRewriteSlack;
+        const uint64_t grown_at = chunk.offset;
+        const int64_t delta = int64_t(used + padding) - int64_t(chunk.bytes.size());
+
+        // The USM's own CRID page records the file size, and the seek tables
+        // record absolute keyframe offsets; both are integers, so updating
+        // them does not change any chunk's size.
+        if (chunk.header.chunk_type == ChunkType::INFO) {
+            shift_element(pages[0], "filesize", delta);
+            chunk.bytes = build_chunk(chunk.bytes, pack_pages(pages, encoding), padding);
+        }
+        else {
+            chunk.bytes = build_chunk(chunk.bytes, payload, padding);
+        }
+
+        for (PageChunk& c : prefix.chunks) {
+            if (&c == &chunk) continue;
+            const bool crid = c.header.chunk_type == ChunkType::INFO;
+            if (!crid && !is_seek_chunk(c)) continue;
+
+            std::vector<UsmPage> other = chunk_pages(c, encoding);
+            if (other.empty()) continue;
+            if (crid) {
+                shift_element(other[0], "filesize", delta);
+            }
+            else {
+                for (UsmPage& p : other) {
+                    if (p.name() != "VIDEO_SEEKINFO") continue;
+                    const Element* ofs = p.find("ofs_byte");
+                    if (ofs == nullptr) continue;
+                    const std::optional<uint64_t> at = element_u64(*ofs);
+                    if (at.has_value() && *at > grown_at) {
+                        shift_element(p, "ofs_byte", delta);
+                    }
+                }
+            }
+            auto repacked = repack_same_size(c, other, encoding);
+            if (!repacked.has_value()) {
+                throw std::runtime_error("Page chunk at offset " + std::to_string(c.offset) +
+                    " no longer fits after updating offsets");
+            }
+            c.bytes = std::move(*repacked);
+        }
+
+        Bytes head;
+        for (const PageChunk& c : prefix.chunks) {
+            head.insert(head.end(), c.bytes.begin(), c.bytes.end());
+        }
+
+        std::filesystem::path tmp = path;
+        tmp += ".patch.tmp";
+        try {
+            write_rewritten(path, prefix.end, prefix.filesize, head, tmp);
+            std::filesystem::permissions(tmp, std::filesystem::status(path).permissions());
+            std::filesystem::rename(tmp, path);
+        }
+        catch (...) {
+            std::error_code ec;
+            std::filesystem::remove(tmp, ec);
+            throw;
+        }
+        return PatchResult::REWRITTEN;
+    }
+
+    namespace {
+
+        using ChannelKey = std::pair<uint32_t, int>;  // (chunk type, channel number)
+
+        // One concatenated input: its page chunks, and once its packets are
+        // copied, where they went and how long it plays.
+        struct ConcatInput {
+            Prefix prefix;
+            uint64_t out_start = 0;  // output offset of its first STREAM chunk
+            double seconds = 0.0;
+            std::map<ChannelKey, int64_t> frames;  // STREAM chunks per channel
+        };
+
+        // Timing of the last STREAM chunk seen on a channel.
+        struct ChannelClock {
+            uint32_t time = 0;
+            uint32_t step = 0;
+            uint32_t rate = 0;
+            bool seen = false;
+        };
+
+    }  // namespace
+
+    static ChannelKey channel_key(const PageChunk& c) {
+        return { uint32_t(c.header.chunk_type), c.header.channel_number };
+    }
+
+    static const PageChunk* find_like(const Prefix& prefix, const PageChunk& like) {
+        for (const PageChunk& c : prefix.chunks) {
+            if (c.header.payload_type == like.header.payload_type &&
+                channel_key(c) == channel_key(like)) {
+                return &c;
+            }
+        }
+        return nullptr;
+    }
+
+    // HEADER page elements that are per-file totals and may differ.
+    static bool is_total(std::string_view key) {
+        return key == "total_frames" || key == "total_samples" || key == "max_picture_size" ||
+            key == "metadata_count" || key == "metadata_size";
+    }
+
+    // Throws unless `other` has the CRID streams, HEADER pages and seek
+    // table layout of `first`.
+    static void check_compatible(const Prefix& first, const Prefix& other,
+        const std::filesystem::path& name, const std::string& encoding) {
+        auto fail = [&](const std::string& why) {
+            throw std::runtime_error("Cannot concatenate " + name.string() + ": " + why);
+            };
+
+        size_t headers = 0;
+        for (const PageChunk& c : first.chunks) {
+            const bool header = c.header.payload_type == PayloadType::HEADER;
+            if (!header && !is_seek_chunk(c)) continue;
+            headers += header;
+            const std::string what = fourcc_to_string(uint32_t(c.header.chunk_type)) + " " +
+                std::to_string(c.header.channel_number);
+            const PageChunk* match = find_like(other, c);
+            if (match == nullptr) {
+                if (header) fail("no " + what + " HEADER chunk");
+                continue;
+            }
+
+            const auto a = chunk_pages(c, encoding);
+            const auto b = chunk_pages(*match, encoding);
+            if (!header) {
+                if (!a.empty() && !b.empty() && a[0].key_order() != b[0].key_order()) {
+                    fail("different seek table layout for " + what);
+                }
+                continue;
+            }
+            if (a.size() != b.size()) fail("different page count in " + what);
+
+            const bool crid = c.header.chunk_type == ChunkType::INFO;
+            for (size_t j = 0; j < a.size(); j++) {
+                if (a[j].name() != b[j].name()) fail("different pages in " + what);
+                for (const auto& key : a[j].key_order()) {
+                    if (crid ? key != "stmid" && key != "chno" : is_total(key)) continue;
+                    const Element* ea = a[j].find(key);
+                    const Element* eb = b[j].find(key);
+                    if (eb == nullptr || ea->type != eb->type || ea->val != eb->val) {
+                        fail(std::string(a[j].name()) + "." + std::string(key) + " differs");
+                    }
+                }
+            }
+        }
+        const size_t other_headers = size_t(std::count_if(other.chunks.begin(),
+            other.chunks.end(),
+            [](const PageChunk& c) { return c.header.payload_type == PayloadType::HEADER; }));
+        if (other_headers != headers) fail("different track layout");
+    }
+
+    static std::optional<uint64_t> page_u64(const UsmPage& page, std::string_view key) {
+        const Element* e = page.find(key);
+        if (e == nullptr) return std::nullopt;
+        return element_u64(*e);
+    }
+
+    static uint64_t element_or(const UsmPage& page, std::string_view key, uint64_t fallback) {
+        return page_u64(page, key).value_or(fallback);
+    }
+
+    // `pages` packed into the chunk `c`, grown to a 0x20 boundary if they
+    // no longer fit.
+    static Bytes repack_chunk(const PageChunk& c, const std::vector<UsmPage>& pages,
+        const std::string& encoding) {
+        if (auto same = repack_same_size(c, pages, encoding)) return std::move(*same);
+        const Bytes payload = pack_pages(pages, encoding);
+        const size_t used = 0x20 + payload.size();
+        return build_chunk(c.bytes, payload, (0x20 - used % 0x20) % 0x20);
+    }
+
+    // The seek tables of every input for the channel of `c`, one after the
+    // other, with keyframe offsets and frame numbers moved to the output.
+    static std::vector<UsmPage> merged_seek(const std::vector<ConcatInput>& inputs,
+        const PageChunk& c, const std::string& encoding) {
+        std::vector<UsmPage> out;
+        int64_t frames_before = 0;
+        for (const ConcatInput& in : inputs) {
+            if (const PageChunk* seek = find_like(in.prefix, c)) {
+                for (UsmPage& p : chunk_pages(*seek, encoding)) {
+                    if (p.name() == "VIDEO_SEEKINFO") {
+                        shift_element(p, "ofs_byte",
+                            int64_t(in.out_start) - int64_t(in.prefix.end));
+                        shift_element(p, "ofs_frmid", frames_before);
+                    }
+                    out.push_back(std::move(p));
+                }
+            }
+            auto it = in.frames.find(channel_key(c));
+            if (it != in.frames.end()) frames_before += it->second;
+        }
+        return out;
+    }
+
+    // CRID sizes add up, buffer requirements take the largest, and the bit
+    // rate is averaged over play time. The USM's own page gets `out_size`.
+    static void merge_crid(std::vector<UsmPage>& pages,
+        const std::vector<std::vector<UsmPage>>& all, const std::vector<ConcatInput>& inputs,
+        uint64_t out_size) {
+        double seconds = 0.0;
+        for (const ConcatInput& in : inputs) seconds += in.seconds;
+        for (size_t j = 0; j < pages.size(); j++) {
+            uint64_t filesize = 0, datasize = 0, minchk = 0, minbuf = 0;
+            double bits = 0.0;
+            for (size_t k = 0; k < all.size(); k++) {
+                const UsmPage& p = all[k][j];
+                filesize += element_or(p, "filesize", 0);
+                datasize += element_or(p, "datasize", 0);
+                minchk = std::max(minchk, element_or(p, "minchk", 0));
+                minbuf = std::max(minbuf, element_or(p, "minbuf", 0));
+                bits += double(element_or(p, "avbps", 0)) * inputs[k].seconds;
+            }
+            set_integer(pages[j], "filesize", int64_t(j == 0 ? out_size : filesize));
+            set_integer(pages[j], "datasize", int64_t(datasize));
+            set_integer(pages[j], "minchk", int64_t(minchk));
+            set_integer(pages[j], "minbuf", int64_t(minbuf));
+            if (seconds > 0.0) set_integer(pages[j], "avbps", std::llround(bits / seconds));
+        }
+    }
+
+    // Frame and sample counts add up; the largest picture wins. A
+    // metadata_size naming the seek chunk follows its new size.
+    static void merge_header(std::vector<UsmPage>& pages,
+        const std::vector<std::vector<UsmPage>>& all, const PageChunk* seek,
+        const Bytes* merged_seek) {
+        for (size_t j = 0; j < pages.size(); j++) {
+            uint64_t frames = 0, samples = 0, picture = 0;
+            for (const auto& input_pages : all) {
+                const UsmPage& p = input_pages[j];
+                frames += element_or(p, "total_frames", 0);
+                samples += element_or(p, "total_samples", 0);
+                picture = std::max(picture, element_or(p, "max_picture_size", 0));
+            }
+            set_integer(pages[j], "total_frames", int64_t(frames));
+            set_integer(pages[j], "total_samples", int64_t(samples));
+            set_integer(pages[j], "max_picture_size", int64_t(picture));
+
+            if (seek == nullptr) continue;
+            const std::optional<uint64_t> size = page_u64(pages[j], "metadata_size");
+            if (size == uint64_t(seek->bytes.size())) {
+                set_integer(pages[j], "metadata_size", int64_t(merged_seek->size()));
+            }
+            else if (size == uint64_t(seek->header.payload_size)) {
+                const size_t padding = (size_t((*merged_seek)[0xA]) << 8) | (*merged_seek)[0xB];
+                set_integer(pages[j], "metadata_size",
+                    int64_t(merged_seek->size() - 0x20 - padding));
+            }
+        }
+    }
+
+    // The output's page chunks: the first input's, with totals merged over
+    // all inputs and each seek table covering all of them. Element types
+    // never change, so the size does not depend on the values.
+    static Bytes merged_prefix(const std::vector<ConcatInput>& inputs, uint64_t out_size,
+        const std::string& encoding) {
+        const Prefix& first = inputs[0].prefix;
+
+        std::map<ChannelKey, std::pair<const PageChunk*, Bytes>> seeks;
+        for (const PageChunk& c : first.chunks) {
+            if (!is_seek_chunk(c) || chunk_pages(c, encoding).empty()) continue;
+            seeks[channel_key(c)] = { &c, repack_chunk(c, merged_seek(inputs, c, encoding),
+                encoding) };
+        }
+
+        Bytes out;
+        for (const PageChunk& c : first.chunks) {
+            Bytes chunk;
+            if (auto it = seeks.find(channel_key(c)); it != seeks.end() && is_seek_chunk(c)) {
+                chunk = it->second.second;
+            }
+            else if (c.header.payload_type == PayloadType::HEADER) {
+                std::vector<UsmPage> pages = chunk_pages(c, encoding);
+                std::vector<std::vector<UsmPage>> all;
+                for (const ConcatInput& in : inputs) {
+                    all.push_back(chunk_pages(*find_like(in.prefix, c), encoding));
+                }
+                if (c.header.chunk_type == ChunkType::INFO) {
+                    merge_crid(pages, all, inputs, out_size);
+                }
+                else {
+                    auto it = seeks.find(channel_key(c));
+                    const bool has_seek = it != seeks.end();
+                    merge_header(pages, all, has_seek ? it->second.first : nullptr,
+                        has_seek ? &it->second.second : nullptr);
+                }
+                chunk = repack_chunk(c, pages, encoding);
+            }
+            else {
+                chunk = c.bytes;
+            }
+            out.insert(out.end(), chunk.begin(), chunk.end());
+        }
+        return out;
+    }
+
+    // Copies the chunks after the page chunks of `path`, moving STREAM
+    // frame_time by `offset` seconds, and records the input's frame counts
+    // and play time. "#CONTENTS END" chunks are dropped unless `last`.
+    static void copy_stream(const std::filesystem::path& path, ConcatInput& in, double offset,
+        bool last, FileWriter& writer) {
+        FileSource source(path);
+        SourceReader reader(source);
+        std::map<ChannelKey, ChannelClock> clocks;
+        const uint64_t filesize = in.prefix.filesize;
+        uint64_t pos = in.prefix.end;
+        while (pos + 0x20 <= filesize) {
+            uint8_t header[0x20];
+            std::memcpy(header, reader.view(pos, 0x20), sizeof(header));
+            if (!plausible_chunk_header(header, filesize - pos)) {
+                throw std::runtime_error("Damaged chunk at offset " + std::to_string(pos) +
+                    " of " + path.string());
+            }
+            const ChunkHeader h = ChunkHeader::parse(header);
+            const uint64_t total = chunk_total_size(header);
+            if (h.payload_type == PayloadType::SECTION_END && !last) {
+                pos += total;
+                continue;
+            }
+
+            if (h.payload_type == PayloadType::STREAM) {
+                const ChannelKey key{ uint32_t(h.chunk_type), h.channel_number };
+                in.frames[key]++;
+                ChannelClock& clock = clocks[key];
+                if (clock.seen && h.frame_time > clock.time) clock.step = h.frame_time - clock.time;
+                clock.time = h.frame_time;
+                clock.rate = h.frame_rate;
+                clock.seen = true;
+                store_be32(header + 0x10,
+                    uint32_t(int64_t(h.frame_time) + std::llround(offset * h.frame_rate)));
+            }
+
+            writer.write(header, sizeof(header));
+            for (uint64_t done = sizeof(header); done < total;) {
+                const size_t n = size_t(std::min<uint64_t>(total - done, reader.max_view()));
+                writer.write(reader.view(pos + done, n), n);
+                done += n;
+            }
+            pos += total;
+        }
+        if (pos != filesize) {
+            throw std::runtime_error("Truncated chunk at offset " + std::to_string(pos) + " of " +
+                path.string());
+        }
+
+        // An input ends one step after its last packet on the longest channel.
+        for (const auto& [key, clock] : clocks) {
+            if (clock.rate == 0) continue;
+            in.seconds = std::max(in.seconds, double(clock.time + clock.step) / clock.rate);
+        }
+    }
+
+    void concat_usms(const std::vector<std::filesystem::path>& inputs,
+        const std::filesystem::path& out, const ConcatOptions& options) {
+        if (inputs.empty()) throw std::runtime_error("concat_usms: no inputs");
+
+        std::vector<ConcatInput> parts(inputs.size());
+        uint64_t stream_bytes = 0;
+        for (size_t k = 0; k < inputs.size(); k++) {
+            std::error_code ec;
+            if (std::filesystem::equivalent(inputs[k], out, ec)) {
+                throw std::runtime_error("Output is also an input: " + out.string());
+            }
+            parts[k].prefix = read_prefix(inputs[k]);
+            if (k > 0) check_compatible(parts[0].prefix, parts[k].prefix, inputs[k],
+                options.encoding);
+            stream_bytes += parts[k].prefix.filesize - parts[k].prefix.end;
+        }
+
+        // Offsets and totals are only known once everything is copied, so
+        // the page chunks are written now at their final size and again at
+        // the end with the real values.
+        const Bytes head = merged_prefix(parts, 0, options.encoding);
+        {
+            FileWriter writer(out, head.size() + stream_bytes, options.writer);
+            writer.write(head.data(), head.size());
+            double offset = 0.0;
+            for (size_t k = 0; k < inputs.size(); k++) {
+                parts[k].out_start = writer.written();
+                copy_stream(inputs[k], parts[k], offset, k + 1 == inputs.size(), writer);
+                offset += parts[k].seconds;
+            }
+            writer.finish();
+        }
+
+        const Bytes final_head =
+            merged_prefix(parts, std::filesystem::file_size(out), options.encoding);
+        if (final_head.size() != head.size()) {
+            throw std::runtime_error("concat_usms: page chunks changed size");
+        }
+        overwrite(out, 0, final_head);
+    }
+
+    // AUDIO_HDRINFO audio_codec values.
+    static constexpr int kCodecAdx = 2;
+    static constexpr int kCodecHca = 4;
+
+    // New audio packets hold whole blocks up to about this many bytes.
+    static constexpr uint32_t kAudioPacketTarget = 0x8000;
+
+    namespace {
+
+        struct AudioPacket {
+            uint64_t offset = 0;
+            uint32_t size = 0;
+            uint64_t sample = 0;  // first sample, per channel
+        };
+
+        // An HCA or ADX file cut into packets: the header, then whole blocks.
+        struct AudioStream {
+            int codec = 0;
+            uint32_t sample_rate = 0;
+            int channels = 0;
+            uint64_t samples = 0;
+            std::vector<AudioPacket> packets;
+        };
+
+    }  // namespace
+
+    static uint32_t load_be32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+            uint32_t(p[3]);
+    }
+
+    static AudioStream read_audio_stream(const ByteSource& source) {
+        const uint64_t filesize = source.size();
+        Bytes head(size_t(std::min<uint64_t>(filesize, 0x10000)));
+        source.read_at(0, head.data(), head.size());
+
+        AudioStream out;
+        uint64_t data_start = 0;
+        uint64_t frame_size = 0;
+        uint64_t frame_samples = 0;
+        uint64_t frames = 0;
+        if (auto hca = parse_hca_header(head.data(), head.size())) {
+            out.codec = kCodecHca;
+            out.sample_rate = hca->sample_rate;
+            out.channels = hca->channels;
+            data_start = hca->header_size;
+            frame_size = hca->block_size;
+            frame_samples = kHcaBlockSamples;
+            frames = hca->block_count;
+            out.samples = frames * frame_samples;
+        }
+        else if (head.size() >= 0x14 && head[0] == 0x80 && head[1] == 0x00) {
+            // The header ends with "(c)CRI" at its copyright offset.
+            data_start = ((uint32_t(head[2]) << 8) | head[3]) + 4;
+            if (data_start < 0x14 || data_start > head.size() ||
+                std::memcmp(head.data() + data_start - 6, "(c)CRI", 6) != 0) {
+                throw std::runtime_error("Bad ADX header");
+            }
+            out.codec = kCodecAdx;
+            out.channels = head[7];
+            out.sample_rate = load_be32(head.data() + 8);
+            out.samples = load_be32(head.data() + 0xC);
+            const uint32_t block = head[5];
+            const uint32_t bits = head[6];
+            if (block <= 2 || bits == 0) throw std::runtime_error("Bad ADX header");
+            frame_size = uint64_t(block) * out.channels;
+            frame_samples = (block - 2) * 8 / bits;
+            frames = (out.samples + frame_samples - 1) / frame_samples;
+        }
+        else {
+            throw std::runtime_error("Audio is neither HCA nor ADX");
+        }
+        if (frame_size == 0 || out.sample_rate == 0 || out.channels == 0) {
+            throw std::runtime_error("Audio header has no block layout");
+        }
+        frames = std::min(frames, (filesize - data_start) / frame_size);
+
+        // Whatever follows the last block (an ADX end marker) rides along
+        // with the last packet.
+        const uint64_t per_packet = std::max<uint64_t>(1, kAudioPacketTarget / frame_size);
+        out.packets.push_back({ 0, uint32_t(data_start), 0 });
+        for (uint64_t f = 0; f < frames; f += per_packet) {
+            const uint64_t offset = data_start + f * frame_size;
+            const uint64_t end = f + per_packet >= frames ? filesize
+                : offset + per_packet * frame_size;
+            out.packets.push_back({ offset, uint32_t(end - offset), f * frame_samples });
+        }
+        return out;
+    }
+
+    // New chunks end on a 0x20 boundary.
+    static uint32_t stream_padding(size_t payload) {
+        return uint32_t((0x20 - payload % 0x20) % 0x20);
+    }
+
+    // A fresh chunk header for a payload of `payload` bytes.
+    static void make_chunk_header(uint8_t* header, ChunkType type, PayloadType payload_type,
+        int channel, uint32_t frame_time, uint32_t frame_rate, size_t payload) {
+        const uint32_t padding = stream_padding(payload);
+        std::memset(header, 0, 0x20);
+        store_be32(header, uint32_t(type));
+        store_be32(header + 4, uint32_t(0x18 + payload + padding));
+        header[0x9] = 0x18;
+        header[0xA] = uint8_t(padding >> 8);
+        header[0xB] = uint8_t(padding);
+        header[0xC] = uint8_t(channel);
+        header[0xF] = uint8_t(payload_type);
+        store_be32(header + 0x10, frame_time);
+        store_be32(header + 0x14, frame_rate);
+    }
+
+    // Sets an integer element, adding it as a 32-bit one if it is missing.
+    static void put_integer(UsmPage& page, std::string_view key, int64_t value) {
+        if (page.find(key) != nullptr) set_integer(page, key, value);
+        else page.update(key, ElementType::I32, int32_t(value));
+    }
+
+    namespace {
+
+        // Everything replace_audio decides before copying.
+        struct AudioPlan {
+            const Prefix* prefix = nullptr;
+            int channel = 0;
+            bool add = false;
+            ChannelKey template_key{ 0, 0 };  // whose SECTION_END chunks the new channel copies
+            const PageChunk* insert_after = nullptr;  // added HEADER chunk goes behind it
+            std::vector<UsmPage> crid;
+            PageChunk header;  // the channel's HEADER chunk, pages not yet packed
+            std::vector<UsmPage> header_pages;
+        };
+
+    }  // namespace
+
+    static bool is_target_audio(const PageChunk& c, int channel) {
+        return c.header.chunk_type == ChunkType::AUDIO && c.header.channel_number == channel;
+    }
+
+    // A copy of a SECTION_END chunk for the added channel.
+    static Bytes section_end_copy(const Bytes& chunk, int channel) {
+        Bytes out = chunk;
+        store_be32(out.data(), uint32_t(ChunkType::AUDIO));
+        out[0xC] = uint8_t(channel);
+        return out;
+    }
+
+    // The output's page chunks; `out_size` and `rebased` keyframe offsets
+    // only change values, never sizes.
+    static Bytes audio_prefix(const AudioPlan& plan, uint64_t out_size,
+        const std::map<uint64_t, uint64_t>& rebased, const std::string& encoding) {
+        Bytes out;
+        auto append = [&](const Bytes& b) { out.insert(out.end(), b.begin(), b.end()); };
+        for (const PageChunk& c : plan.prefix->chunks) {
+            if (c.header.chunk_type == ChunkType::INFO) {
+                std::vector<UsmPage> crid = plan.crid;
+                set_integer(crid[0], "filesize", int64_t(out_size));
+                append(repack_chunk(c, crid, encoding));
+            }
+            else if (!plan.add && is_target_audio(c, plan.channel) &&
+                c.header.payload_type == PayloadType::HEADER) {
+                append(repack_chunk(plan.header, plan.header_pages, encoding));
+            }
+            else if (!plan.add && is_target_audio(c, plan.channel) &&
+                c.header.payload_type == PayloadType::METADATA) {
+                continue;  // described the old stream
+            }
+            else if (is_seek_chunk(c) && !chunk_pages(c, encoding).empty()) {
+                std::vector<UsmPage> pages = chunk_pages(c, encoding);
+                for (UsmPage& p : pages) {
+                    const Element* e = p.find("ofs_byte");
+                    if (p.name() != "VIDEO_SEEKINFO" || e == nullptr) continue;
+                    auto it = rebased.find(element_u64(*e).value_or(~uint64_t(0)));
+                    if (it != rebased.end()) set_integer(p, "ofs_byte", int64_t(it->second));
+                }
+                append(repack_chunk(c, pages, encoding));
+            }
+            else {
+                append(c.bytes);
+            }
+
+            if (!plan.add) continue;
+            if (&c == plan.insert_after) append(repack_chunk(plan.header, plan.header_pages,
+                encoding));
+            if (c.header.payload_type == PayloadType::SECTION_END &&
+                channel_key(c) == plan.template_key) {
+                append(section_end_copy(c.bytes, plan.channel));
+            }
+        }
+        return out;
+    }
+
+    static AudioPlan plan_audio(const Prefix& prefix, const AudioStream& audio,
+        uint64_t channel_bytes, const AudioReplaceOptions& options, const std::string& name) {
+        const std::string& encoding = options.encoding;
+        AudioPlan plan;
+        plan.prefix = &prefix;
+        plan.channel = options.channel_number;
+
+        const PageChunk* crid_chunk = nullptr;
+        const PageChunk* target = nullptr;
+        const PageChunk* first_audio = nullptr;
+        const PageChunk* last_audio = nullptr;
+        const PageChunk* last_header = nullptr;
+        const PageChunk* first_stream_header = nullptr;
+        for (const PageChunk& c : prefix.chunks) {
+            if (c.header.payload_type != PayloadType::HEADER) continue;
+            if (c.header.chunk_type == ChunkType::INFO) {
+                if (crid_chunk == nullptr) crid_chunk = &c;
+                continue;
+            }
+            last_header = &c;
+            if (first_stream_header == nullptr) first_stream_header = &c;
+            if (c.header.chunk_type != ChunkType::AUDIO) continue;
+            if (first_audio == nullptr) first_audio = &c;
+            last_audio = &c;
+            if (c.header.channel_number == plan.channel) target = &c;
+        }
+        if (crid_chunk == nullptr) throw std::runtime_error("USM has no CRID chunk");
+
+        plan.add = target == nullptr;
+        const PageChunk* model = target ? target : first_audio;
+        if (model != nullptr) {
+            plan.header = *model;
+            plan.header_pages = chunk_pages(*model, encoding);
+        }
+        else {
+            plan.header.bytes.resize(0x20);
+            make_chunk_header(plan.header.bytes.data(), ChunkType::AUDIO, PayloadType::HEADER,
+                plan.channel, 0, 3000, 0);
+            plan.header.header = ChunkHeader::parse(plan.header.bytes.data());
+        }
+        if (plan.header_pages.empty()) plan.header_pages.emplace_back("AUDIO_HDRINFO");
+        plan.header.bytes[0xC] = uint8_t(plan.channel);
+        put_integer(plan.header_pages[0], "audio_codec", audio.codec);
+        put_integer(plan.header_pages[0], "sampling_rate", audio.sample_rate);
+        put_integer(plan.header_pages[0], "num_channels", audio.channels);
+
+        if (plan.add) {
+            plan.insert_after = last_audio ? last_audio : last_header ? last_header : crid_chunk;
+            const PageChunk* sections = first_audio ? first_audio : first_stream_header;
+            if (sections != nullptr) plan.template_key = channel_key(*sections);
+        }
+
+        // The channel's CRID page: the old one, or a copy of another
+        // stream's page.
+        plan.crid = chunk_pages(*crid_chunk, encoding);
+        if (plan.crid.empty()) throw std::runtime_error("CRID chunk carries no pages");
+        const int32_t audio_id = int32_t(ChunkType::AUDIO);
+        auto is_audio_page = [&](const UsmPage& p) {
+            return element_or(p, "stmid", 0) == audio_id;
+            };
+        auto page = std::find_if(plan.crid.begin() + 1, plan.crid.end(), [&](const UsmPage& p) {
+            return is_audio_page(p) &&
+                element_or(p, "chno", ~uint64_t(0)) == uint64_t(plan.channel);
+            });
+        if (page == plan.crid.end()) {
+            auto model_page = std::find_if(plan.crid.begin() + 1, plan.crid.end(), is_audio_page);
+            UsmPage copy = model_page != plan.crid.end() ? *model_page : plan.crid.back();
+            put_integer(copy, "stmid", audio_id);
+            put_integer(copy, "chno", plan.channel);
+            plan.crid.push_back(std::move(copy));
+            page = plan.crid.end() - 1;
+        }
+        page->update("filename", ElementType::STRING, std::pmr::string(name));
+        put_integer(*page, "filesize", int64_t(channel_bytes));
+        if (audio.samples > 0 && page->find("avbps") != nullptr) {
+            const double seconds = double(audio.samples) / audio.sample_rate;
+            set_integer(*page, "avbps", std::llround(channel_bytes * 8.0 / seconds));
+        }
+        return plan;
+    }
+
+    void replace_audio(const std::filesystem::path& usm_path,
+        const std::filesystem::path& audio_path, const std::filesystem::path& out,
+        const AudioReplaceOptions& options) {
+        std::error_code ec;
+        if (std::filesystem::equivalent(usm_path, out, ec) ||
+            std::filesystem::equivalent(audio_path, out, ec)) {
+            throw std::runtime_error("Output is also an input: " + out.string());
+        }
+        const int channel = options.channel_number;
+        if (channel < 0 || channel > 0xFF) throw std::runtime_error("Bad audio channel number");
+
+        FileSource audio_source(audio_path);
+        const AudioStream audio = read_audio_stream(audio_source);
+        const Prefix prefix = read_prefix(usm_path);
+        const std::optional<Keys> keys = keys_for(options.key);
+
+        // New packets share the clock of the file's first STREAM chunk.
+        FileSource source(usm_path);
+        uint32_t rate = 3000;
+        if (prefix.end + 0x20 <= prefix.filesize) {
+            uint8_t header[0x20];
+            source.read_at(prefix.end, header, sizeof(header));
+            rate = std::max<uint32_t>(1, ChunkHeader::parse(header).frame_rate);
+        }
+        std::vector<uint32_t> times;
+        uint64_t channel_bytes = 0;
+        for (const AudioPacket& p : audio.packets) {
+            times.push_back(uint32_t(p.sample * rate / audio.sample_rate));
+            channel_bytes += 0x20 + p.size + stream_padding(p.size);
+        }
+
+        const std::string name = options.filename.empty() ? audio_path.filename().string()
+            : options.filename;
+        const AudioPlan plan = plan_audio(prefix, audio, channel_bytes, options, name);
+
+        std::map<uint64_t, uint64_t> rebased;
+        for (const PageChunk& c : prefix.chunks) {
+            if (!is_seek_chunk(c)) continue;
+            for (const UsmPage& p : chunk_pages(c, options.encoding)) {
+                const Element* e = p.find("ofs_byte");
+                if (p.name() != "VIDEO_SEEKINFO" || e == nullptr) continue;
+                if (auto at = element_u64(*e)) rebased[*at] = *at;
+            }
+        }
+
+        const Bytes head = audio_prefix(plan, 0, rebased, options.encoding);
+        {
+            const uint64_t bound = head.size() + prefix.filesize + audio_source.size() +
+                channel_bytes;
+            FileWriter writer(out, bound, options.writer);
+            writer.write(head.data(), head.size());
+
+            Bytes buf;
+            Bytes channel_end;
+            size_t next = 0;
+            // Writes the new packets timed at or before `until` (frame_time
+            // at `until_rate`).
+            auto emit = [&](uint64_t until, uint32_t until_rate, bool all) {
+                for (; next < audio.packets.size(); next++) {
+                    if (!all && uint64_t(times[next]) * until_rate > until * rate) break;
+                    const AudioPacket& p = audio.packets[next];
+                    buf.resize(p.size);
+                    audio_source.read_at(p.offset, buf.data(), buf.size());
+                    if (keys.has_value()) crypt_audio_packet(buf.data(), buf.size(), keys->audio);
+                    uint8_t header[0x20];
+                    make_chunk_header(header, ChunkType::AUDIO, PayloadType::STREAM, channel,
+                        times[next], rate, buf.size());
+                    writer.write(header, sizeof(header));
+                    writer.write(buf.data(), buf.size());
+                    buf.assign(stream_padding(p.size), 0x00);
+                    writer.write(buf.data(), buf.size());
+                }
+                };
+
+            SourceReader reader(source);
+            uint64_t pos = prefix.end;
+            while (pos + 0x20 <= prefix.filesize) {
+                const uint8_t* header = reader.view(pos, 0x20);
+                if (!plausible_chunk_header(header, prefix.filesize - pos)) {
+                    throw std::runtime_error("Damaged chunk at offset " + std::to_string(pos));
+                }
+                const ChunkHeader h = ChunkHeader::parse(header);
+                const uint64_t total = chunk_total_size(header);
+                const bool dropped = h.payload_type != PayloadType::SECTION_END &&
+                    h.chunk_type == ChunkType::AUDIO && h.channel_number == channel;
+                if (dropped) {
+                    pos += total;
+                    continue;
+                }
+
+                if (h.payload_type == PayloadType::STREAM && h.frame_rate != 0) {
+                    emit(h.frame_time, h.frame_rate, false);
+                }
+                if (auto it = rebased.find(pos); it != rebased.end()) it->second = writer.written();
+
+                // The channel's own "#CONTENTS END" (kept, or copied from the
+                // template channel's) waits until its last packet is out;
+                // other channels ending does not cut the interleave short.
+                if (h.payload_type == PayloadType::SECTION_END &&
+                    h.chunk_type == ChunkType::AUDIO && h.channel_number == channel) {
+                    const uint8_t* p = reader.view(pos, size_t(total), buf);
+                    channel_end.assign(p, p + total);
+                    pos += total;
+                    continue;
+                }
+                if (plan.add && h.payload_type == PayloadType::SECTION_END &&
+                    ChannelKey{ uint32_t(h.chunk_type), h.channel_number } == plan.template_key) {
+                    const uint8_t* p = reader.view(pos, size_t(total), buf);
+                    channel_end = section_end_copy(Bytes(p, p + total), channel);
+                }
+                for (uint64_t done = 0; done < total;) {
+                    const size_t n = size_t(std::min<uint64_t>(total - done, reader.max_view()));
+                    writer.write(reader.view(pos + done, n), n);
+                    done += n;
+                }
+                pos += total;
+            }
+            emit(0, 0, true);
+            writer.write(channel_end.data(), channel_end.size());
+            writer.finish();
+        }
+
+        const Bytes final_head =
+            audio_prefix(plan, std::filesystem::file_size(out), rebased, options.encoding);
+        if (final_head.size() != head.size()) {
+            throw std::runtime_error("replace_audio: page chunks changed size");
+        }
+        overwrite(out, 0, final_head);
+    }
+
+}  // namespace usm
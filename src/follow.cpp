@@ -0,0 +1,294 @@
+#include "usm/follow.hpp"
+
+#include "usm/hca.hpp"
+#include "usm/schema.hpp"
+#include "usm/tools.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace usm {
+
+    static uint64_t current_size(const std::filesystem::path& path) {
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(path, ec);
+        return ec ? 0 : size;
+    }
+
+    static bool is_track_type(ChunkType type) {
+        return type == ChunkType::VIDEO || type == ChunkType::AUDIO ||
+            type == ChunkType::ALPHA;
+    }
+
+    UsmFollower::UsmFollower(const std::filesystem::path& path, FollowOptions options)
+        : path_(path), options_(std::move(options)), keys_(keys_for(options_.key)),
+        file_(FileHandle::open_read(path)) {
+#ifdef __linux__
+        watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd_ >= 0 &&
+            inotify_add_watch(watch_fd_, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            ::close(watch_fd_);
+            watch_fd_ = -1;
+        }
+#endif
+    }
+
+    UsmFollower::~UsmFollower() {
+#ifdef __linux__
+        if (watch_fd_ >= 0) ::close(watch_fd_);
+#endif
+    }
+
+    std::vector<FollowPacket> UsmFollower::poll() {
+        std::vector<FollowPacket> packets;
+        const uint64_t size = current_size(path_);
+
+        uint8_t header[0x20];
+        while (offset_ + 0x20 <= size) {
+            pread_all(file_.fd(), offset_, header, sizeof(header));
+            if (!magic_checked_) {
+                Bytes magic(header, header + 4);
+                if (!is_usm_magic(magic)) {
+                    throw std::runtime_error("Invalid file signature: " + bytes_to_hex(magic));
+                }
+                magic_checked_ = true;
+            }
+
+            ChunkHeader h = ChunkHeader::parse(header);
+            // A chunk is usable once its payload is on disk; the padding only
+            // has to arrive before the next header is read.
+            if (offset_ + 0x20 + uint64_t(h.payload_size) > size) break;
+
+            if (h.payload_type == PayloadType::STREAM && is_track_type(h.chunk_type)) {
+                seen_.insert({ h.chunk_type, h.channel_number });
+                packets.push_back({ h.chunk_type, h.channel_number,
+                    offset_ + uint64_t(h.payload_offset), uint32_t(h.payload_size),
+                    h.frame_time, h.frame_rate });
+            }
+            else {
+                handle_chunk(h, offset_);
+            }
+            offset_ += 0x20 + uint64_t(h.payload_size) + h.padding;
+        }
+        return packets;
+    }
+
+    void UsmFollower::handle_chunk(const ChunkHeader& h, uint64_t offset) {
+        const bool track = is_track_type(h.chunk_type);
+        if (h.chunk_type != ChunkType::INFO && !track) return;
+        if (h.payload_type == PayloadType::METADATA) return;
+
+        chunk_bytes_.resize(size_t(0x20 + h.payload_size));
+        pread_all(file_.fd(), offset, chunk_bytes_.data(), chunk_bytes_.size());
+
+        if (h.payload_type == PayloadType::SECTION_END) {
+            // "#HEADER END", "#METADATA END" and "#CONTENTS END" all share
+            // this payload type; only the last one ends a channel.
+            static constexpr std::string_view kContentsEnd = "#CONTENTS END";
+            const size_t begin = size_t(h.payload_offset);
+            if (track && chunk_bytes_.size() >= begin + kContentsEnd.size() &&
+                std::memcmp(chunk_bytes_.data() + begin, kContentsEnd.data(),
+                    kContentsEnd.size()) == 0) {
+                ended_.insert({ h.chunk_type, h.channel_number });
+            }
+            return;
+        }
+
+        UsmChunk c = UsmChunk::from_bytes(chunk_bytes_, options_.encoding);
+        if (!std::holds_alternative<std::vector<UsmPage>>(c.payload)) return;
+        auto& pages = std::get<std::vector<UsmPage>>(c.payload);
+
+        if (c.chunk_type == ChunkType::INFO) {
+            CridBinding crid_fields;
+            for (auto& p : pages) {
+                auto row = crid_fields(p);
+                auto chno = row.find<fields::crid::chno>();
+                auto stmid = row.find<fields::crid::stmid>();
+                if (chno.has_value() && *chno >= 0 && stmid.has_value()) {
+                    const auto type = static_cast<ChunkType>(uint32_t(*stmid));
+                    if (is_track_type(type)) declared_.insert({ type, int(*chno) });
+                }
+                crids_.push_back(std::move(p));
+            }
+        }
+        else if (c.payload_type == PayloadType::HEADER && !pages.empty()) {
+            headers_.insert_or_assign({ h.chunk_type, h.channel_number }, std::move(pages[0]));
+        }
+    }
+
+    bool UsmFollower::wait(std::chrono::milliseconds timeout) {
+#ifdef __linux__
+        if (watch_fd_ >= 0) {
+            pollfd pfd{ watch_fd_, POLLIN, 0 };
+            int r = ::poll(&pfd, 1, int(timeout.count()));
+            if (r <= 0) return false;
+            // Drain the queued events; only their arrival matters.
+            alignas(inotify_event) char events[4096];
+            while (::read(watch_fd_, events, sizeof(events)) > 0) {
+            }
+            return true;
+        }
+#endif
+        const uint64_t before = current_size(path_);
+        std::this_thread::sleep_for(std::min(timeout, options_.poll_interval));
+        return current_size(path_) != before;
+    }
+
+    bool UsmFollower::run(const std::function<void(const FollowPacket&)>& on_packet) {
+        using clock = std::chrono::steady_clock;
+        // Re-poll at least this often in case an inotify event was missed.
+        constexpr std::chrono::milliseconds kMaxWait{ 1000 };
+
+        auto last_growth = clock::now();
+        uint64_t last_size = 0;
+        while (true) {
+            for (const auto& p : poll()) on_packet(p);
+            if (finished()) return true;
+
+            const uint64_t size = current_size(path_);
+            if (size != last_size) {
+                last_size = size;
+                last_growth = clock::now();
+            }
+
+            std::chrono::milliseconds timeout = kMaxWait;
+            if (options_.idle_timeout.count() > 0) {
+                auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    clock::now() - last_growth);
+                if (idle >= options_.idle_timeout) return false;
+                timeout = std::min(timeout, options_.idle_timeout - idle);
+            }
+            wait(timeout);
+        }
+    }
+
+    bool UsmFollower::finished() const {
+        if (crids_.empty()) return false;
+        // Without a declared channel list, fall back to the channels seen.
+        const auto& expected = declared_.empty() ? seen_ : declared_;
+        if (expected.empty()) return false;
+        return std::includes(ended_.begin(), ended_.end(), expected.begin(), expected.end());
+    }
+
+    const UsmPage* UsmFollower::crid(ChunkType type, int channel_number) const {
+        CridBinding crid_fields;
+        for (const auto& p : crids_) {
+            auto row = crid_fields(p);
+            auto chno = row.find<fields::crid::chno>();
+            auto stmid = row.find<fields::crid::stmid>();
+            if (chno == int16_t(channel_number) && stmid == int32_t(uint32_t(type))) {
+                return &p;
+            }
+        }
+        return nullptr;
+    }
+
+    const UsmPage* UsmFollower::header(ChunkType type, int channel_number) const {
+        auto it = headers_.find({ type, channel_number });
+        return it == headers_.end() ? nullptr : &it->second;
+    }
+
+    void UsmFollower::read_packet(const FollowPacket& packet, Bytes& out) const {
+        out.resize(packet.size);
+        pread_all(file_.fd(), packet.offset, out.data(), packet.size);
+        if (keys_.has_value()) decrypt_packet(out.data(), packet.size, packet.chunk_type, *keys_);
+    }
+
+    std::vector<DemuxedTrack> follow_demux(const std::filesystem::path& path,
+        const std::filesystem::path& out_dir, const FollowOptions& options,
+        const DemuxOptions& demux) {
+        FollowOptions opts = options;
+        if (demux.key_override.has_value()) opts.key = demux.key_override;
+        UsmFollower follower(path, opts);
+
+        std::string folder = path.filename().string();
+        if (folder.empty()) folder = "usm";
+        const std::filesystem::path out_root = out_dir / slugify_utf8(folder, true);
+
+        struct Output {
+            FileHandle file;
+            Hasher hasher;
+            DemuxedTrack result;
+            std::optional<HcaDecrypter> hca;
+        };
+        std::map<std::pair<ChunkType, int>, Output> outputs;
+
+        CridBinding crid_fields;
+        Bytes buf;
+        const bool done = follower.run([&](const FollowPacket& p) {
+                const char* subdir = nullptr;
+                if (p.chunk_type == ChunkType::VIDEO && demux.video) subdir = "videos";
+                else if (p.chunk_type == ChunkType::AUDIO && demux.audio) subdir = "audios";
+                else if (p.chunk_type == ChunkType::ALPHA && demux.alpha) subdir = "alphas";
+                if (subdir == nullptr) return;
+
+                auto it = outputs.find({ p.chunk_type, p.channel_number });
+                if (it == outputs.end()) {
+                    const UsmPage* crid = follower.crid(p.chunk_type, p.channel_number);
+                    if (crid == nullptr) {
+                        throw std::runtime_error("No crid page found for channel " +
+                            std::to_string(p.channel_number));
+                    }
+                    std::string name(crid_fields(*crid).get<fields::crid::filename>());
+                    name = slugify_utf8(basename_utf8(name), true);
+
+                    std::filesystem::path sub = out_root / subdir;
+                    std::filesystem::create_directories(sub);
+                    Output out{ FileHandle::open_write(sub / name), Hasher(demux.hash),
+                        DemuxedTrack{ p.chunk_type, p.channel_number, sub / name, 0, {} },
+                        std::nullopt };
+                    if (demux.hca_key.has_value() && p.chunk_type == ChunkType::AUDIO) {
+                        out.hca.emplace(*demux.hca_key);
+                    }
+                    it = outputs.emplace(std::make_pair(p.chunk_type, p.channel_number),
+                        std::move(out)).first;
+                }
+
+                // Written straight to the fd so a reader sees each packet at once.
+                Output& out = it->second;
+                follower.read_packet(p, buf);
+                if (out.hca.has_value()) out.hca->process(buf.data(), buf.size());
+                out.hasher.update(buf.data(), buf.size());
+                write_all(out.file.fd(), buf.data(), buf.size());
+                out.result.size += buf.size();
+            });
+        if (!done) throw std::runtime_error("Timed out waiting for " + path.string());
+
+        std::vector<DemuxedTrack> results;
+        for (ChunkType type : { ChunkType::VIDEO, ChunkType::AUDIO, ChunkType::ALPHA }) {
+            for (auto& [key, out] : outputs) {
+                if (key.first != type) continue;
+                if (demux.hash != HashAlgorithm::NONE) out.result.hash = out.hasher.hex();
+                results.push_back(std::move(out.result));
+            }
+        }
+        return results;
+    }
+
+    void follow_demux_track(const std::filesystem::path& path, ChunkType type,
+        int channel_number, int out_fd, const FollowOptions& options,
+        std::optional<uint64_t> hca_key) {
+        UsmFollower follower(path, options);
+        std::optional<HcaDecrypter> hca;
+        if (hca_key.has_value() && type == ChunkType::AUDIO) hca.emplace(*hca_key);
+        Bytes buf;
+        const bool done = follower.run([&](const FollowPacket& p) {
+                if (p.chunk_type != type || p.channel_number != channel_number) return;
+                follower.read_packet(p, buf);
+                if (hca.has_value()) hca->process(buf.data(), buf.size());
+                write_all(out_fd, buf.data(), buf.size());
+            });
+        if (!done) throw std::runtime_error("Timed out waiting for " + path.string());
+    }
+
+}  // namespace usm
@@ -0,0 +1,271 @@
+#include "usm/hash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define USM_CRC32C_X86 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define USM_CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+namespace usm {
+
+    std::optional<HashAlgorithm> hash_algorithm_from_string(std::string_view name) {
+        if (name == "none") return HashAlgorithm::NONE;
+        if (name == "crc32c") return HashAlgorithm::CRC32C;
+        if (name == "xxh64") return HashAlgorithm::XXH64;
+        return std::nullopt;
+    }
+
+    const char* hash_algorithm_name(HashAlgorithm algorithm) {
+        switch (algorithm) {
+        case HashAlgorithm::CRC32C: return "crc32c";
+        case HashAlgorithm::XXH64: return "xxh64";
+        default: return "none";
+        }
+    }
+
+    static uint64_t load_le64(const uint8_t* p) {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+        return v;
+    }
+
+    static uint32_t load_le32(const uint8_t* p) {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+            (uint32_t(p[3]) << 24);
+    }
+
+    // ---- CRC-32C ----
+
+    // Slicing-by-8 tables for the portable path.
+    static constexpr std::array<std::array<uint32_t, 256>, 8> make_crc_tables() {
+        std::array<std::array<uint32_t, 256>, 8> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (size_t s = 1; s < 8; s++) {
+            for (size_t i = 0; i < 256; i++) {
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+        return t;
+    }
+
+    static constexpr auto kCrcTables = make_crc_tables();
+
+    static uint32_t crc32c_table(uint32_t c, const uint8_t* p, size_t n) {
+        while (n >= 8) {
+            uint32_t lo = load_le32(p) ^ c;
+            uint32_t hi = load_le32(p + 4);
+            c = kCrcTables[7][lo & 0xFF] ^ kCrcTables[6][(lo >> 8) & 0xFF] ^
+                kCrcTables[5][(lo >> 16) & 0xFF] ^ kCrcTables[4][lo >> 24] ^
+                kCrcTables[3][hi & 0xFF] ^ kCrcTables[2][(hi >> 8) & 0xFF] ^
+                kCrcTables[1][(hi >> 16) & 0xFF] ^ kCrcTables[0][hi >> 24];
+            p += 8;
+            n -= 8;
+        }
+        while (n-- > 0) c = (c >> 8) ^ kCrcTables[0][(c ^ *p++) & 0xFF];
+        return c;
+    }
+
+#if defined(USM_CRC32C_X86)
+#if defined(__GNUC__) || defined(__clang__)
+    __attribute__((target("sse4.2")))
+#endif
+    static uint32_t crc32c_hw(uint32_t c, const uint8_t* p, size_t n) {
+        uint64_t c64 = c;
+        while (n >= 8) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            c64 = _mm_crc32_u64(c64, v);
+            p += 8;
+            n -= 8;
+        }
+        c = uint32_t(c64);
+        while (n-- > 0) c = _mm_crc32_u8(c, *p++);
+        return c;
+    }
+
+    static bool cpu_has_crc32c() {
+#ifdef _MSC_VER
+        int regs[4];
+        __cpuid(regs, 1);
+        return (regs[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    }
+#elif defined(USM_CRC32C_ARM)
+    static uint32_t crc32c_hw(uint32_t c, const uint8_t* p, size_t n) {
+        while (n >= 8) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            c = __crc32cd(c, v);
+            p += 8;
+            n -= 8;
+        }
+        while (n-- > 0) c = __crc32cb(c, *p++);
+        return c;
+    }
+
+    static bool cpu_has_crc32c() { return true; }
+#endif
+
+    uint32_t crc32c(const void* data, size_t n, uint32_t crc) {
+        const auto* p = static_cast<const uint8_t*>(data);
+#if defined(USM_CRC32C_X86) || defined(USM_CRC32C_ARM)
+        static const bool hw = cpu_has_crc32c();
+        if (hw) return ~crc32c_hw(~crc, p, n);
+#endif
+        return ~crc32c_table(~crc, p, n);
+    }
+
+    // ---- XXH64 ----
+
+    static constexpr uint64_t P1 = 11400714785074694791ull;
+    static constexpr uint64_t P2 = 14029467366897019727ull;
+    static constexpr uint64_t P3 = 1609587929392839161ull;
+    static constexpr uint64_t P4 = 9650029242287828579ull;
+    static constexpr uint64_t P5 = 2870177450012600261ull;
+
+    static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        return rotl64(acc, 31) * P1;
+    }
+
+    static uint64_t xxh_merge(uint64_t h, uint64_t acc) {
+        h ^= xxh_round(0, acc);
+        return h * P1 + P4;
+    }
+
+    static void xxh_stripes(uint64_t acc[4], const uint8_t*& p, size_t& n) {
+        while (n >= 32) {
+            acc[0] = xxh_round(acc[0], load_le64(p));
+            acc[1] = xxh_round(acc[1], load_le64(p + 8));
+            acc[2] = xxh_round(acc[2], load_le64(p + 16));
+            acc[3] = xxh_round(acc[3], load_le64(p + 24));
+            p += 32;
+            n -= 32;
+        }
+    }
+
+    static uint64_t xxh_finish(const uint64_t acc[4], uint64_t total, const uint8_t* p,
+        size_t n, uint64_t seed) {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) +
+                rotl64(acc[3], 18);
+            for (int i = 0; i < 4; i++) h = xxh_merge(h, acc[i]);
+        }
+        else {
+            h = seed + P5;
+        }
+        h += total;
+
+        while (n >= 8) {
+            h ^= xxh_round(0, load_le64(p));
+            h = rotl64(h, 27) * P1 + P4;
+            p += 8;
+            n -= 8;
+        }
+        if (n >= 4) {
+            h ^= uint64_t(load_le32(p)) * P1;
+            h = rotl64(h, 23) * P2 + P3;
+            p += 4;
+            n -= 4;
+        }
+        while (n-- > 0) {
+            h ^= (*p++) * P5;
+            h = rotl64(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static void xxh_init(uint64_t acc[4], uint64_t seed) {
+        acc[0] = seed + P1 + P2;
+        acc[1] = seed + P2;
+        acc[2] = seed;
+        acc[3] = seed - P1;
+    }
+
+    uint64_t xxh64(const void* data, size_t n, uint64_t seed) {
+        const auto* p = static_cast<const uint8_t*>(data);
+        uint64_t acc[4];
+        xxh_init(acc, seed);
+        const uint64_t total = n;
+        xxh_stripes(acc, p, n);
+        return xxh_finish(acc, total, p, n, seed);
+    }
+
+    // ---- Hasher ----
+
+    Hasher::Hasher(HashAlgorithm algorithm) : algorithm_(algorithm) {
+        xxh_init(acc_, 0);
+    }
+
+    void Hasher::update(const void* data, size_t n) {
+        if (algorithm_ == HashAlgorithm::CRC32C) {
+            crc_ = crc32c(data, n, crc_);
+            return;
+        }
+        if (algorithm_ != HashAlgorithm::XXH64) return;
+
+        const auto* p = static_cast<const uint8_t*>(data);
+        total_ += n;
+        if (buffered_ > 0) {
+            size_t take = std::min(n, sizeof(buf_) - buffered_);
+            std::memcpy(buf_ + buffered_, p, take);
+            buffered_ += take;
+            p += take;
+            n -= take;
+            if (buffered_ < sizeof(buf_)) return;
+            const uint8_t* b = buf_;
+            size_t bn = sizeof(buf_);
+            xxh_stripes(acc_, b, bn);
+            buffered_ = 0;
+        }
+        xxh_stripes(acc_, p, n);
+        std::memcpy(buf_, p, n);
+        buffered_ = n;
+    }
+
+    uint64_t Hasher::digest() const {
+        switch (algorithm_) {
+        case HashAlgorithm::CRC32C: return crc_;
+        case HashAlgorithm::XXH64: return xxh_finish(acc_, total_, buf_, buffered_, 0);
+        default: return 0;
+        }
+    }
+
+    std::string hash_hex(uint64_t digest, HashAlgorithm algorithm) {
+        const int digits = algorithm == HashAlgorithm::CRC32C ? 8 : 16;
+        static const char* kHex = "0123456789abcdef";
+        std::string out(size_t(digits), '0');
+        for (int i = 0; i < digits; i++) {
+            out[size_t(digits - 1 - i)] = kHex[(digest >> (4 * i)) & 0xF];
+        }
+        return out;
+    }
+
+    std::string Hasher::hex() const { return hash_hex(digest(), algorithm_); }
+
+}  // namespace usm
@@ -0,0 +1,199 @@
+#include "usm/hca.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace usm {
+
+    static uint32_t load_be32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+            uint32_t(p[3]);
+    }
+
+    static uint16_t load_be16(const uint8_t* p) { return uint16_t((p[0] << 8) | p[1]); }
+
+    static void store_be16(uint8_t* p, uint16_t v) {
+        p[0] = uint8_t(v >> 8);
+        p[1] = uint8_t(v);
+    }
+
+    // Header chunk tags may have their high bits set to hide them.
+    static constexpr uint32_t kTagMask = 0x7F7F7F7F;
+
+    static constexpr uint32_t tag(const char (&s)[5]) {
+        return (uint32_t(uint8_t(s[0])) << 24) | (uint32_t(uint8_t(s[1])) << 16) |
+            (uint32_t(uint8_t(s[2])) << 8) | uint32_t(uint8_t(s[3]));
+    }
+
+    static const std::array<uint16_t, 256>& crc_table() {
+        static const std::array<uint16_t, 256> table = [] {
+            std::array<uint16_t, 256> t{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i << 8;
+                for (int b = 0; b < 8; b++) c = (c & 0x8000) ? (c << 1) ^ 0x8005 : c << 1;
+                t[i] = uint16_t(c);
+            }
+            return t;
+            }();
+        return table;
+    }
+
+    uint16_t hca_crc16(const uint8_t* data, size_t n, uint16_t crc) {
+        const auto& t = crc_table();
+        for (size_t i = 0; i < n; i++) crc = uint16_t((crc << 8) ^ t[(crc >> 8) ^ data[i]]);
+        return crc;
+    }
+
+    // Decryption tables as built by the CRI HCA library.
+    static void cipher_table1(std::array<uint8_t, 256>& table) {
+        uint32_t v = 0;
+        for (int i = 1; i < 255; i++) {
+            v = (v * 13 + 11) & 0xFF;
+            if (v == 0 || v == 0xFF) v = (v * 13 + 11) & 0xFF;
+            table[i] = uint8_t(v);
+        }
+        table[0] = 0;
+        table[0xFF] = 0xFF;
+    }
+
+    static void cipher_row56(uint8_t* row, uint8_t key) {
+        const uint32_t mul = ((key & 1) << 3) | 5;
+        const uint32_t add = (key & 0xE) | 1;
+        uint32_t v = key >> 4;
+        for (int i = 0; i < 16; i++) {
+            v = (v * mul + add) & 0xF;
+            row[i] = uint8_t(v);
+        }
+    }
+
+    static void cipher_table56(std::array<uint8_t, 256>& table, uint64_t keycode) {
+        if (keycode != 0) keycode--;
+        uint8_t kc[7];
+        for (auto& k : kc) {
+            k = uint8_t(keycode);
+            keycode >>= 8;
+        }
+
+        const uint8_t seed[16] = {
+            kc[1], uint8_t(kc[1] ^ kc[6]), uint8_t(kc[2] ^ kc[3]), kc[2],
+            uint8_t(kc[2] ^ kc[1]), uint8_t(kc[3] ^ kc[4]), kc[3], uint8_t(kc[3] ^ kc[2]),
+            uint8_t(kc[4] ^ kc[5]), kc[4], uint8_t(kc[4] ^ kc[3]), uint8_t(kc[5] ^ kc[6]),
+            kc[5], uint8_t(kc[5] ^ kc[4]), uint8_t(kc[6] ^ kc[1]), kc[6],
+        };
+
+        uint8_t rows[16];
+        uint8_t cols[16];
+        uint8_t base[256];
+        cipher_row56(rows, kc[0]);
+        for (int r = 0; r < 16; r++) {
+            cipher_row56(cols, seed[r]);
+            for (int c = 0; c < 16; c++) base[r * 16 + c] = uint8_t((rows[r] << 4) | cols[c]);
+        }
+
+        // Walk the 16x16 square with a stride of 17, skipping 0 and 0xFF.
+        uint32_t x = 0;
+        int pos = 1;
+        for (int i = 0; i < 256; i++) {
+            x = (x + 17) & 0xFF;
+            if (base[x] != 0 && base[x] != 0xFF) table[pos++] = base[x];
+        }
+        table[0] = 0;
+        table[0xFF] = 0xFF;
+    }
+
+    std::optional<HcaInfo> parse_hca_header(const uint8_t* data, size_t n) {
+        if (n < 8 || (load_be32(data) & kTagMask) != tag("HCA\0")) return std::nullopt;
+
+        HcaInfo info;
+        info.header_size = load_be16(data + 6);
+        if (info.header_size < 10 || info.header_size > n) {
+            throw std::runtime_error("HCA header not within the first audio packet");
+        }
+
+        // Chunks come in a fixed order; the cipher chunk is always before
+        // the variable-size comment and padding chunks.
+        size_t pos = 8;
+        const size_t end = info.header_size - 2;
+        while (pos + 4 <= end) {
+            const uint32_t t = load_be32(data + pos) & kTagMask;
+            size_t size = 0;
+            if (t == tag("fmt\0")) size = 16;
+            else if (t == tag("comp")) size = 16;
+            else if (t == tag("dec\0")) size = 12;
+            else if (t == tag("vbr\0")) size = 8;
+            else if (t == tag("ath\0")) size = 6;
+            else if (t == tag("loop")) size = 16;
+            else if (t == tag("ciph")) size = 6;
+            else if (t == tag("rva\0")) size = 8;
+            else break;
+            if (pos + size > end) throw std::runtime_error("Truncated HCA header");
+
+            if (t == tag("fmt\0")) {
+                info.channels = data[pos + 4];
+                info.sample_rate = load_be32(data + pos + 4) & 0xFFFFFF;
+                info.block_count = load_be32(data + pos + 8);
+            }
+            if (t == tag("comp") || t == tag("dec\0")) info.block_size = load_be16(data + pos + 4);
+            if (t == tag("ciph")) {
+                info.cipher_offset = pos + 4;
+                info.cipher_type = load_be16(data + pos + 4);
+            }
+            pos += size;
+        }
+        return info;
+    }
+
+    HcaDecrypter::HcaDecrypter(uint64_t keycode) : keycode_(keycode) {}
+
+    // Returns the header size, or 0 if the stream is not HCA.
+    size_t HcaDecrypter::parse_header(uint8_t* data, size_t n) {
+        header_done_ = true;
+        const std::optional<HcaInfo> info = parse_hca_header(data, n);
+        if (!info.has_value()) return 0;
+
+        block_size_ = info->block_size;
+        cipher_type_ = info->cipher_type;
+        if (info->cipher_offset == 0 || cipher_type_ == 0) return info->header_size;
+        if (cipher_type_ == 1) cipher_table1(table_);
+        else if (cipher_type_ == 56) cipher_table56(table_, keycode_);
+        else throw std::runtime_error("Unknown HCA cipher type " + std::to_string(cipher_type_));
+        if (block_size_ < 3) throw std::runtime_error("HCA header has no block size");
+
+        const size_t end = info->header_size - 2;
+        store_be16(data + info->cipher_offset, 0);
+        store_be16(data + end, hca_crc16(data, end));
+        active_ = true;
+        return info->header_size;
+    }
+
+    void HcaDecrypter::process(uint8_t* data, size_t n) {
+        if (!header_done_) {
+            const size_t header_size = parse_header(data, n);
+            data += header_size;
+            n -= header_size;
+        }
+        if (!active_) return;
+
+        const uint32_t body = block_size_ - 2;
+        while (n > 0) {
+            if (block_pos_ < body) {
+                const size_t run = std::min<size_t>(n, body - block_pos_);
+                for (size_t i = 0; i < run; i++) data[i] = table_[data[i]];
+                crc_ = hca_crc16(data, run, crc_);
+                data += run;
+                n -= run;
+                block_pos_ += uint32_t(run);
+                continue;
+            }
+            // The two CRC bytes may also be split across calls.
+            *data++ = block_pos_ == body ? uint8_t(crc_ >> 8) : uint8_t(crc_);
+            n--;
+            if (++block_pos_ == block_size_) {
+                block_pos_ = 0;
+                crc_ = 0;
+            }
+        }
+    }
+
+}  // namespace usm
@@ -0,0 +1,169 @@
+#include "usm/index.hpp"
+
+#include <stdexcept>
+
+namespace usm {
+
+    static void put_varint(std::pmr::vector<uint8_t>& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(uint8_t(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(uint8_t(v));
+    }
+
+    static uint64_t get_varint(const uint8_t* p, size_t& pos) {
+        uint64_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            const uint8_t b = p[pos++];
+            v |= uint64_t(b & 0x7F) << shift;
+            if ((b & 0x80) == 0) return v;
+        }
+    }
+
+    static uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+    static int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+    PacketIndex::PacketIndex(allocator_type alloc)
+        : blocks_(alloc), data_(alloc), times_(alloc) {
+    }
+
+    PacketIndex::PacketIndex(const PacketIndex& other, allocator_type alloc)
+        : blocks_(other.blocks_, alloc), data_(other.data_, alloc), times_(other.times_, alloc),
+        count_(other.count_), has_times_(other.has_times_), total_bytes_(other.total_bytes_),
+        last_end_(other.last_end_), last_frame_time_(other.last_frame_time_),
+        last_frame_step_(other.last_frame_step_), last_frame_rate_(other.last_frame_rate_) {
+    }
+
+    PacketIndex::PacketIndex(PacketIndex&& other, allocator_type alloc)
+        : blocks_(std::move(other.blocks_), alloc), data_(std::move(other.data_), alloc),
+        times_(std::move(other.times_), alloc), count_(other.count_),
+        has_times_(other.has_times_), total_bytes_(other.total_bytes_),
+        last_end_(other.last_end_), last_frame_time_(other.last_frame_time_),
+        last_frame_step_(other.last_frame_step_), last_frame_rate_(other.last_frame_rate_) {
+    }
+
+    void PacketIndex::push_packet(uint64_t offset, uint32_t size) {
+        if (count_ % kBlockSize == 0) {
+            if (data_.size() > UINT32_MAX || times_.size() > UINT32_MAX) {
+                throw std::runtime_error("Packet index too large");
+            }
+            blocks_.push_back({ offset, uint32_t(data_.size()), uint32_t(times_.size()) });
+            last_frame_time_ = 0;
+            last_frame_step_ = 0;
+            last_frame_rate_ = 0;
+        }
+        else {
+            if (offset < last_end_) throw std::runtime_error("Packets out of file order");
+            put_varint(data_, offset - last_end_);
+        }
+        put_varint(data_, size);
+        last_end_ = offset + size;
+        total_bytes_ += size;
+    }
+
+    void PacketIndex::push_back(uint64_t offset, uint32_t size) {
+        if (has_times_) throw std::runtime_error("Packet index needs times");
+        push_packet(offset, size);
+        count_++;
+    }
+
+    void PacketIndex::push_back(uint64_t offset, uint32_t size, uint32_t frame_time,
+        uint32_t frame_rate) {
+        if (count_ == 0) has_times_ = true;
+        if (!has_times_) throw std::runtime_error("Packet index has no times");
+        push_packet(offset, size);
+        // Frame times usually advance by a constant step and the rate rarely
+        // changes, so store the change in step, with the low bit flagging a
+        // new rate: one byte per packet in the common case.
+        const uint32_t step = frame_time - last_frame_time_;
+        const bool new_rate = frame_rate != last_frame_rate_;
+        put_varint(times_, (uint64_t(zigzag(int32_t(step - last_frame_step_))) << 1) |
+            (new_rate ? 1 : 0));
+        if (new_rate) put_varint(times_, frame_rate);
+        last_frame_time_ = frame_time;
+        last_frame_step_ = step;
+        last_frame_rate_ = frame_rate;
+        count_++;
+    }
+
+    void PacketIndex::append(const PacketIndex& other) {
+        for (auto it = other.begin(); it != other.end(); ++it) {
+            const auto [offset, size] = *it;
+            if (other.has_times_) {
+                const auto [frame_time, frame_rate] = it.time();
+                push_back(offset, size, frame_time, frame_rate);
+            }
+            else {
+                push_back(offset, size);
+            }
+        }
+    }
+
+    PacketIndex::value_type PacketIndex::at(size_t i) const {
+        if (i >= count_) throw std::out_of_range("Packet index out of range");
+        return (*this)[i];
+    }
+
+    PacketIndex::time_type PacketIndex::time(size_t i) const {
+        if (!has_times_) throw std::runtime_error("Packet index has no times");
+        return iterator_at(i).time();
+    }
+
+    PacketIndex::const_iterator PacketIndex::end() const {
+        const_iterator it;
+        it.index_ = this;
+        it.i_ = count_;
+        return it;
+    }
+
+    PacketIndex::const_iterator PacketIndex::iterator_at(size_t i) const {
+        if (i >= count_) return end();
+        const_iterator it(this, i - i % kBlockSize);
+        while (it.i_ < i) ++it;
+        return it;
+    }
+
+    size_t PacketIndex::memory_usage() const {
+        return blocks_.capacity() * sizeof(Block) + data_.capacity() + times_.capacity();
+    }
+
+    void PacketIndex::shrink_to_fit() {
+        blocks_.shrink_to_fit();
+        data_.shrink_to_fit();
+        times_.shrink_to_fit();
+    }
+
+    PacketIndex::const_iterator::const_iterator(const PacketIndex* index, size_t i)
+        : index_(index), i_(i) {
+        decode();
+    }
+
+    void PacketIndex::const_iterator::decode() {
+        if (i_ >= index_->count_) return;
+
+        const uint8_t* data = index_->data_.data();
+        if (i_ % kBlockSize == 0) {
+            const Block& b = index_->blocks_[i_ / kBlockSize];
+            data_pos_ = b.data_pos;
+            time_pos_ = b.time_pos;
+            offset_ = b.offset;
+            frame_time_ = 0;
+            frame_step_ = 0;
+            frame_rate_ = 0;
+        }
+        else {
+            offset_ += size_ + get_varint(data, data_pos_);
+        }
+        size_ = uint32_t(get_varint(data, data_pos_));
+
+        if (index_->has_times_) {
+            const uint8_t* times = index_->times_.data();
+            const uint64_t v = get_varint(times, time_pos_);
+            frame_step_ += uint32_t(unzigzag(uint32_t(v >> 1)));
+            frame_time_ += frame_step_;
+            if (v & 1) frame_rate_ = uint32_t(get_varint(times, time_pos_));
+        }
+    }
+
+}  // namespace usm
@@ -0,0 +1,340 @@
+#include "usm/json.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <type_traits>
+
+namespace usm {
+
+    namespace {
+
+        class JsonParser {
+        public:
+            explicit JsonParser(std::string_view text) : text_(text) {}
+
+            Json parse_document() {
+                Json v = parse_value(0);
+                skip_space();
+                if (pos_ != text_.size()) fail("trailing characters");
+                return v;
+            }
+
+        private:
+            // Requests are flat; this only guards the stack.
+            static constexpr int kMaxDepth = 64;
+
+            [[noreturn]] void fail(const char* what) const {
+                throw std::runtime_error("Bad JSON at offset " + std::to_string(pos_) + ": " +
+                    what);
+            }
+
+            void skip_space() {
+                while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' ||
+                    text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                    pos_++;
+                }
+            }
+
+            bool consume(std::string_view word) {
+                if (text_.substr(pos_, word.size()) != word) return false;
+                pos_ += word.size();
+                return true;
+            }
+
+            Json parse_value(int depth) {
+                if (depth > kMaxDepth) fail("nested too deeply");
+                skip_space();
+                if (pos_ >= text_.size()) fail("unexpected end");
+                const char c = text_[pos_];
+                if (c == '{') return parse_object(depth);
+                if (c == '[') return parse_array(depth);
+                if (c == '"') return Json(parse_string());
+                if (consume("true")) return Json(true);
+                if (consume("false")) return Json(false);
+                if (consume("null")) return Json();
+                if (c == '-' || (c >= '0' && c <= '9')) return parse_number();
+                fail("unexpected character");
+            }
+
+            Json parse_object(int depth) {
+                pos_++;
+                Json::Object obj;
+                skip_space();
+                if (pos_ < text_.size() && text_[pos_] == '}') {
+                    pos_++;
+                    return Json(std::move(obj));
+                }
+                while (true) {
+                    skip_space();
+                    if (pos_ >= text_.size() || text_[pos_] != '"') fail("expected a key");
+                    std::string key = parse_string();
+                    skip_space();
+                    if (pos_ >= text_.size() || text_[pos_] != ':') fail("expected ':'");
+                    pos_++;
+                    obj[std::move(key)] = parse_value(depth + 1);
+                    skip_space();
+                    if (pos_ < text_.size() && text_[pos_] == ',') {
+                        pos_++;
+                        continue;
+                    }
+                    if (pos_ < text_.size() && text_[pos_] == '}') {
+                        pos_++;
+                        return Json(std::move(obj));
+                    }
+                    fail("expected ',' or '}'");
+                }
+            }
+
+            Json parse_array(int depth) {
+                pos_++;
+                Json::Array arr;
+                skip_space();
+                if (pos_ < text_.size() && text_[pos_] == ']') {
+                    pos_++;
+                    return Json(std::move(arr));
+                }
+                while (true) {
+                    arr.push_back(parse_value(depth + 1));
+                    skip_space();
+                    if (pos_ < text_.size() && text_[pos_] == ',') {
+                        pos_++;
+                        continue;
+                    }
+                    if (pos_ < text_.size() && text_[pos_] == ']') {
+                        pos_++;
+                        return Json(std::move(arr));
+                    }
+                    fail("expected ',' or ']'");
+                }
+            }
+
+            uint32_t parse_hex4() {
+                if (pos_ + 4 > text_.size()) fail("short \\u escape");
+                uint32_t v = 0;
+                auto [end, ec] = std::from_chars(text_.data() + pos_, text_.data() + pos_ + 4, v,
+                    16);
+                if (ec != std::errc() || end != text_.data() + pos_ + 4) fail("bad \\u escape");
+                pos_ += 4;
+                return v;
+            }
+
+            static void append_utf8(std::string& out, uint32_t cp) {
+                if (cp < 0x80) {
+                    out += char(cp);
+                }
+                else if (cp < 0x800) {
+                    out += char(0xC0 | (cp >> 6));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+                else if (cp < 0x10000) {
+                    out += char(0xE0 | (cp >> 12));
+                    out += char(0x80 | ((cp >> 6) & 0x3F));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+                else {
+                    out += char(0xF0 | (cp >> 18));
+                    out += char(0x80 | ((cp >> 12) & 0x3F));
+                    out += char(0x80 | ((cp >> 6) & 0x3F));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+            }
+
+            std::string parse_string() {
+                pos_++;
+                std::string out;
+                while (true) {
+                    if (pos_ >= text_.size()) fail("unterminated string");
+                    const char c = text_[pos_++];
+                    if (c == '"') return out;
+                    if (uint8_t(c) < 0x20) fail("control character in string");
+                    if (c != '\\') {
+                        out += c;
+                        continue;
+                    }
+                    if (pos_ >= text_.size()) fail("unterminated string");
+                    const char e = text_[pos_++];
+                    switch (e) {
+                    case '"': out += '"'; break;
+                    case '\\': out += '\\'; break;
+                    case '/': out += '/'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u': {
+                        uint32_t cp = parse_hex4();
+                        if (cp >= 0xD800 && cp < 0xDC00 && consume("\\u")) {
+                            const uint32_t low = parse_hex4();
+                            if (low < 0xDC00 || low >= 0xE000) fail("bad surrogate pair");
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        append_utf8(out, cp);
+                        break;
+                    }
+                    default:
+                        fail("bad escape");
+                    }
+                }
+            }
+
+            Json parse_number() {
+                const size_t start = pos_;
+                if (text_[pos_] == '-') pos_++;
+                while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') pos_++;
+                bool integral = true;
+                if (pos_ < text_.size() && text_[pos_] == '.') {
+                    integral = false;
+                    pos_++;
+                    while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') pos_++;
+                }
+                if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+                    integral = false;
+                    pos_++;
+                    if (pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')) pos_++;
+                    while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') pos_++;
+                }
+                const char* first = text_.data() + start;
+                const char* last = text_.data() + pos_;
+                if (integral) {
+                    if (*first == '-') {
+                        int64_t v = 0;
+                        if (std::from_chars(first, last, v).ec == std::errc()) return Json(v);
+                    }
+                    else {
+                        uint64_t v = 0;
+                        if (std::from_chars(first, last, v).ec == std::errc()) return Json(v);
+                    }
+                }
+                // from_chars for double is missing from some standard
+                // libraries still in use.
+                const std::string token(first, last);
+                char* end = nullptr;
+                const double v = std::strtod(token.c_str(), &end);
+                if (end != token.c_str() + token.size()) fail("bad number");
+                return Json(v);
+            }
+
+            std::string_view text_;
+            size_t pos_ = 0;
+        };
+
+        void dump_string(std::string& out, const std::string& s) {
+            out += '"';
+            for (char c : s) {
+                switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (uint8_t(c) < 0x20) {
+                        char buf[8];
+                        std::snprintf(buf, sizeof(buf), "\\u%04x", unsigned(uint8_t(c)));
+                        out += buf;
+                    }
+                    else {
+                        out += c;
+                    }
+                }
+            }
+            out += '"';
+        }
+
+    }  // namespace
+
+    Json Json::parse(std::string_view text) { return JsonParser(text).parse_document(); }
+
+    std::string Json::dump() const {
+        std::string out;
+        std::visit([&](const auto& v) {
+            using T = std::decay_t<decltype(v)>;
+            if constexpr (std::is_same_v<T, std::nullptr_t>) {
+                out += "null";
+            }
+            else if constexpr (std::is_same_v<T, bool>) {
+                out += v ? "true" : "false";
+            }
+            else if constexpr (std::is_same_v<T, double>) {
+                if (!std::isfinite(v)) {
+                    out += "null";
+                    return;
+                }
+                char buf[32];
+                std::snprintf(buf, sizeof(buf), "%.17g", v);
+                out += buf;
+            }
+            else if constexpr (std::is_integral_v<T>) {
+                out += std::to_string(v);
+            }
+            else if constexpr (std::is_same_v<T, std::string>) {
+                dump_string(out, v);
+            }
+            else if constexpr (std::is_same_v<T, Array>) {
+                out += '[';
+                for (size_t i = 0; i < v.size(); i++) {
+                    if (i > 0) out += ',';
+                    out += v[i].dump();
+                }
+                out += ']';
+            }
+            else {
+                out += '{';
+                bool first = true;
+                for (const auto& [key, value] : v) {
+                    if (!first) out += ',';
+                    first = false;
+                    dump_string(out, key);
+                    out += ':';
+                    out += value.dump();
+                }
+                out += '}';
+            }
+            }, value_);
+        return out;
+    }
+
+    std::optional<bool> Json::as_bool() const {
+        if (auto* b = std::get_if<bool>(&value_)) return *b;
+        return std::nullopt;
+    }
+
+    std::optional<uint64_t> Json::as_u64() const {
+        if (auto* u = std::get_if<uint64_t>(&value_)) return *u;
+        if (auto* i = std::get_if<int64_t>(&value_); i && *i >= 0) return uint64_t(*i);
+        if (auto* s = std::get_if<std::string>(&value_)) {
+            uint64_t v = 0;
+            auto [end, ec] = std::from_chars(s->data(), s->data() + s->size(), v);
+            if (ec == std::errc() && end == s->data() + s->size() && !s->empty()) return v;
+        }
+        return std::nullopt;
+    }
+
+    std::optional<double> Json::as_double() const {
+        if (auto* d = std::get_if<double>(&value_)) return *d;
+        if (auto* u = std::get_if<uint64_t>(&value_)) return double(*u);
+        if (auto* i = std::get_if<int64_t>(&value_)) return double(*i);
+        return std::nullopt;
+    }
+
+    const std::string* Json::as_string() const { return std::get_if<std::string>(&value_); }
+    const Json::Array* Json::as_array() const { return std::get_if<Array>(&value_); }
+    const Json::Object* Json::as_object() const { return std::get_if<Object>(&value_); }
+
+    const Json* Json::find(std::string_view key) const {
+        const Object* obj = as_object();
+        if (obj == nullptr) return nullptr;
+        auto it = obj->find(key);
+        return it == obj->end() ? nullptr : &it->second;
+    }
+
+    Json& Json::operator[](const std::string& key) {
+        if (!is_object()) value_ = Object{};
+        return std::get<Object>(value_)[key];
+    }
+
+}  // namespace usm
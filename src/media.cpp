@@ -0,0 +1,1495 @@
+#include "usm/media.hpp"
+
+#include "usm/reader.hpp"
+#include "usm/schema.hpp"
+#include "usm/source.hpp"
+#include "usm/tools.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/dict.h>
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <libavutil/samplefmt.h>
+#include <libswscale/swscale.h>
+}
+
+namespace usm {
+
+    static constexpr int kAvioBufferSize = 0x8000;
+
+    static std::string av_error_string(int err) {
+        char buf[AV_ERROR_MAX_STRING_SIZE] = {};
+        av_strerror(err, buf, sizeof(buf));
+        return std::string(buf);
+    }
+
+    // A STRING page element, or nullopt if it is missing or of another type.
+    static std::optional<std::string> page_string(const UsmPage& p, std::string_view k) {
+        const Element* e = p.find(k);
+        if (e == nullptr || e->type != ElementType::STRING) return std::nullopt;
+        return std::string(std::get<std::pmr::string>(e->val));
+    }
+
+    // Owns an input AVFormatContext opened on a custom AVIOContext.
+    struct FormatInput {
+        AVFormatContext* ctx = nullptr;
+
+        // `options` go to the demuxer (e.g. the hca demuxer's key).
+        explicit FormatInput(AVIOContext* pb, AVDictionary** options = nullptr) {
+            ctx = avformat_alloc_context();
+            if (ctx == nullptr) throw std::runtime_error("avformat_alloc_context failed");
+            ctx->pb = pb;
+            ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+            // On failure avformat_open_input frees ctx and nulls it.
+            int err = avformat_open_input(&ctx, nullptr, nullptr, options);
+            if (err < 0) {
+                throw std::runtime_error("Failed to open track: " + av_error_string(err));
+            }
+            err = avformat_find_stream_info(ctx, nullptr);
+            if (err < 0) {
+                avformat_close_input(&ctx);
+                throw std::runtime_error("Failed to read stream info: " +
+                    av_error_string(err));
+            }
+            if (ctx->nb_streams == 0) {
+                avformat_close_input(&ctx);
+                throw std::runtime_error("No streams found in track");
+            }
+        }
+        ~FormatInput() { avformat_close_input(&ctx); }
+
+        FormatInput(const FormatInput&) = delete;
+        FormatInput& operator=(const FormatInput&) = delete;
+    };
+
+    struct TrackIO::State {
+        State(const Usm& usm, const Track& track, std::optional<uint64_t> key_override)
+            : reader(usm, track, key_override) {
+        }
+
+        TrackReader reader;
+        uint64_t pos = 0;
+    };
+
+    TrackIO::TrackIO(const Usm& usm, const Track& track,
+        std::optional<uint64_t> key_override)
+        : state_(std::make_unique<State>(usm, track, key_override)) {
+        auto* buffer = static_cast<unsigned char*>(av_malloc(kAvioBufferSize));
+        if (buffer == nullptr) throw std::runtime_error("av_malloc failed");
+
+        auto read = [](void* opaque, uint8_t* dst, int n) -> int {
+            auto* s = static_cast<State*>(opaque);
+            if (s->pos >= s->reader.size()) return AVERROR_EOF;
+
+            try {
+                size_t done = s->reader.read(s->pos, dst, size_t(n));
+                s->pos += done;
+                return int(done);
+            }
+            catch (const std::exception&) {
+                return AVERROR(EIO);
+            }
+            };
+
+        auto seek = [](void* opaque, int64_t offset, int whence) -> int64_t {
+            auto* s = static_cast<State*>(opaque);
+            const int64_t total = int64_t(s->reader.size());
+            if (whence & AVSEEK_SIZE) return total;
+
+            int64_t target = 0;
+            switch (whence & ~AVSEEK_FORCE) {
+            case SEEK_SET:
+                target = offset;
+                break;
+            case SEEK_CUR:
+                target = int64_t(s->pos) + offset;
+                break;
+            case SEEK_END:
+                target = total + offset;
+                break;
+            default:
+                return AVERROR(EINVAL);
+            }
+            if (target < 0 || target > total) return AVERROR(EINVAL);
+            s->pos = uint64_t(target);
+            return target;
+            };
+
+        ctx_ = avio_alloc_context(buffer, kAvioBufferSize, 0, state_.get(),
+            read, nullptr, seek);
+        if (ctx_ == nullptr) {
+            av_free(buffer);
+            throw std::runtime_error("avio_alloc_context failed");
+        }
+    }
+
+    TrackIO::~TrackIO() {
+        if (ctx_ != nullptr) {
+            av_freep(&ctx_->buffer);
+            avio_context_free(&ctx_);
+        }
+    }
+
+    AVIOContext* TrackIO::context() const { return ctx_; }
+
+    uint64_t TrackIO::size() const { return state_->reader.size(); }
+
+    size_t TrackIO::packet_at(uint64_t pos) const { return state_->reader.packet_at(pos); }
+
+    MediaInfo probe_track(const Usm& usm, const Track& track,
+        std::optional<uint64_t> key_override) {
+        TrackIO io(usm, track, key_override);
+
+        FormatInput in(io.context());
+        AVFormatContext* fmt = in.ctx;
+        const int si = 0;  // elementary streams carry exactly one stream
+
+        const AVStream* st = fmt->streams[si];
+        const AVCodecParameters* par = st->codecpar;
+
+        MediaInfo info;
+        info.format = fmt->iformat->name;
+        info.codec = avcodec_get_name(par->codec_id);
+        info.width = par->width;
+        info.height = par->height;
+        info.sample_rate = par->sample_rate;
+        info.channels = par->ch_layout.nb_channels;
+        info.bit_rate = par->bit_rate > 0 ? par->bit_rate : fmt->bit_rate;
+        info.frame_count = st->nb_frames;
+
+        if (st->duration != AV_NOPTS_VALUE) {
+            info.duration = double(st->duration) * av_q2d(st->time_base);
+        }
+        else if (fmt->duration != AV_NOPTS_VALUE) {
+            info.duration = double(fmt->duration) / AV_TIME_BASE;
+        }
+
+        if (track.chunk_type != ChunkType::AUDIO) {
+            VideoHeaderBinding bind;
+            auto hdr = bind(track.header);
+            auto frames = hdr.find<fields::video_hdr::total_frames>();
+            auto fr_n = hdr.find<fields::video_hdr::framerate_n>();
+            auto fr_d = hdr.find<fields::video_hdr::framerate_d>();
+            if (frames.has_value() && *frames > 0) info.frame_count = *frames;
+            if (info.frame_count > 0 && fr_n.value_or(0) > 0 && fr_d.value_or(0) > 0) {
+                info.duration = double(info.frame_count) * double(*fr_d) / double(*fr_n);
+            }
+        }
+
+        if (info.frame_count <= 0) {
+            AVPacket* pkt = av_packet_alloc();
+            if (pkt == nullptr) throw std::runtime_error("av_packet_alloc failed");
+            int64_t count = 0;
+            while (av_read_frame(fmt, pkt) >= 0) {
+                if (pkt->stream_index == si) count++;
+                av_packet_unref(pkt);
+            }
+            av_packet_free(&pkt);
+            info.frame_count = count;
+        }
+
+        return info;
+    }
+
+    // One remuxed track: its demuxer and the next packet, already retimed to
+    // the output stream time base.
+    struct RemuxInput {
+        const Track* track = nullptr;
+        std::unique_ptr<TrackIO> io;
+        std::unique_ptr<FormatInput> in;
+        AVStream* out = nullptr;
+        AVPacket* pkt = nullptr;
+        bool eof = false;
+        int64_t anchor = 0;
+        int64_t last_dts = AV_NOPTS_VALUE;
+
+        ~RemuxInput() { av_packet_free(&pkt); }
+
+        // Output timestamp for a chunk's (frame_time, frame_rate).
+        int64_t chunk_ts(size_t i) const {
+            const auto [ft, fr] = track->stream.time(i);
+            return av_rescale_q(int64_t(ft), AVRational{ 1, int(fr == 0 ? 1 : fr) },
+                out->time_base);
+        }
+
+        void advance() {
+            const AVStream* ist = in->ctx->streams[0];
+            while (true) {
+                av_packet_unref(pkt);
+                int err = av_read_frame(in->ctx, pkt);
+                if (err == AVERROR_EOF) {
+                    eof = true;
+                    return;
+                }
+                if (err < 0) {
+                    throw std::runtime_error("Failed to read track packet: " +
+                        av_error_string(err));
+                }
+                if (pkt->stream_index == 0) break;
+            }
+
+            const bool has_pts = pkt->pts != AV_NOPTS_VALUE;
+            const bool has_dts = pkt->dts != AV_NOPTS_VALUE;
+            int64_t dts = 0;
+            int64_t pts = 0;
+
+            if (track->chunk_type != ChunkType::AUDIO && pkt->pos >= 0 &&
+                track->stream.has_times()) {
+                dts = chunk_ts(io->packet_at(uint64_t(pkt->pos)));
+                pts = dts;
+                if (has_pts && has_dts && pkt->pts > pkt->dts) {
+                    pts += av_rescale_q(pkt->pts - pkt->dts, ist->time_base, out->time_base);
+                }
+            }
+            else {
+                const int64_t src = has_dts ? pkt->dts : (has_pts ? pkt->pts : 0);
+                dts = anchor + av_rescale_q(src, ist->time_base, out->time_base);
+                pts = has_pts && has_dts
+                    ? dts + av_rescale_q(pkt->pts - pkt->dts, ist->time_base, out->time_base)
+                    : dts;
+            }
+
+            // Chunks split across demuxed packets map to the same chunk time.
+            if (last_dts != AV_NOPTS_VALUE && dts <= last_dts) dts = last_dts + 1;
+            if (pts < dts) pts = dts;
+            last_dts = dts;
+
+            pkt->dts = dts;
+            pkt->pts = pts;
+            pkt->duration = av_rescale_q(pkt->duration, ist->time_base, out->time_base);
+            pkt->stream_index = out->index;
+            pkt->pos = -1;
+        }
+    };
+
+    static std::string track_language(const Track& t, const RemuxOptions& options) {
+        for (const char* k : { "language", "lang" }) {
+            if (auto v = page_string(t.crid, k); v.has_value() && !v->empty()) return *v;
+        }
+        if (t.chunk_type == ChunkType::AUDIO) {
+            auto it = options.audio_languages.find(t.channel_number);
+            if (it != options.audio_languages.end()) return it->second;
+        }
+        return "";
+    }
+
+    void remux(const Usm& usm, const std::filesystem::path& out,
+        const RemuxOptions& options) {
+        std::vector<const Track*> tracks;
+        if (options.video) for (const auto& t : usm.videos()) tracks.push_back(&t);
+        if (options.audio) for (const auto& t : usm.audios()) tracks.push_back(&t);
+        if (options.alpha) for (const auto& t : usm.alphas()) tracks.push_back(&t);
+        if (tracks.empty()) throw std::runtime_error("No tracks selected for remux");
+
+        const std::string out_name = out.string();
+        AVFormatContext* oc = nullptr;
+        int err = avformat_alloc_output_context2(&oc, nullptr,
+            options.format.empty() ? nullptr : options.format.c_str(), out_name.c_str());
+        if (err < 0 || oc == nullptr) {
+            throw std::runtime_error("Failed to create muxer: " + av_error_string(err));
+        }
+        auto close_output = [&]() {
+            if (!(oc->oformat->flags & AVFMT_NOFILE)) avio_closep(&oc->pb);
+            avformat_free_context(oc);
+            oc = nullptr;
+            };
+
+        std::vector<std::unique_ptr<RemuxInput>> inputs;
+        try {
+            CridBinding crid_fields;
+            for (const Track* t : tracks) {
+                auto ri = std::make_unique<RemuxInput>();
+                ri->track = t;
+                ri->io = std::make_unique<TrackIO>(usm, *t, options.key_override);
+                ri->in = std::make_unique<FormatInput>(ri->io->context());
+                ri->pkt = av_packet_alloc();
+                if (ri->pkt == nullptr) throw std::runtime_error("av_packet_alloc failed");
+
+                const AVStream* ist = ri->in->ctx->streams[0];
+                ri->out = avformat_new_stream(oc, nullptr);
+                if (ri->out == nullptr) throw std::runtime_error("avformat_new_stream failed");
+                err = avcodec_parameters_copy(ri->out->codecpar, ist->codecpar);
+                if (err < 0) throw std::runtime_error("Failed to copy codec parameters");
+                ri->out->codecpar->codec_tag = 0;
+                ri->out->time_base = t->chunk_type == ChunkType::AUDIO
+                    ? ist->time_base
+                    : AVRational{ 1, int(t->stream.has_times() ? t->stream.time(0).second : 30) };
+
+                if (auto name = crid_fields(t->crid).find<fields::crid::filename>()) {
+                    av_dict_set(&ri->out->metadata, "title",
+                        basename_utf8(std::string(*name)).c_str(), 0);
+                }
+                std::string lang = track_language(*t, options);
+                if (!lang.empty()) av_dict_set(&ri->out->metadata, "language", lang.c_str(), 0);
+
+                inputs.push_back(std::move(ri));
+            }
+
+            if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+                err = avio_open(&oc->pb, out_name.c_str(), AVIO_FLAG_WRITE);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to open output: " + out_name);
+                }
+            }
+
+            err = avformat_write_header(oc, nullptr);
+            if (err < 0) {
+                throw std::runtime_error("Failed to write header: " + av_error_string(err));
+            }
+
+            // Output time bases are final only after the header is written.
+            for (auto& ri : inputs) {
+                if (ri->track->chunk_type == ChunkType::AUDIO && ri->track->stream.has_times()) {
+                    ri->anchor = ri->chunk_ts(0);
+                }
+                ri->advance();
+            }
+
+            while (true) {
+                RemuxInput* next = nullptr;
+                for (auto& ri : inputs) {
+                    if (ri->eof) continue;
+                    if (next == nullptr || av_compare_ts(ri->pkt->dts, ri->out->time_base,
+                        next->pkt->dts, next->out->time_base) < 0) {
+                        next = ri.get();
+                    }
+                }
+                if (next == nullptr) break;
+
+                err = av_interleaved_write_frame(oc, next->pkt);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to write packet: " + av_error_string(err));
+                }
+                next->advance();
+            }
+
+            err = av_write_trailer(oc);
+            if (err < 0) {
+                throw std::runtime_error("Failed to write trailer: " + av_error_string(err));
+            }
+        }
+        catch (...) {
+            inputs.clear();
+            close_output();
+            throw;
+        }
+
+        inputs.clear();
+        close_output();
+    }
+
+    // Appends a decoded frame as interleaved signed 16-bit samples.
+    static void append_s16(const AVFrame* frame, int channels, std::vector<int16_t>& out) {
+        const int n = frame->nb_samples;
+        const size_t base = out.size();
+        out.resize(base + size_t(n) * size_t(channels));
+        int16_t* dst = out.data() + base;
+
+        auto from_float = [](double v) {
+            return int16_t(std::lrint(std::clamp(v, -1.0, 1.0) * 32767.0));
+            };
+        auto sample = [&](int c, int i) -> int16_t {
+            const auto fmt = AVSampleFormat(frame->format);
+            const bool planar = av_sample_fmt_is_planar(fmt) != 0;
+            const uint8_t* p = frame->extended_data[planar ? c : 0];
+            const int idx = planar ? i : i * channels + c;
+            switch (fmt) {
+            case AV_SAMPLE_FMT_S16:
+            case AV_SAMPLE_FMT_S16P:
+                return reinterpret_cast<const int16_t*>(p)[idx];
+            case AV_SAMPLE_FMT_S32:
+            case AV_SAMPLE_FMT_S32P:
+                return int16_t(reinterpret_cast<const int32_t*>(p)[idx] >> 16);
+            case AV_SAMPLE_FMT_FLT:
+            case AV_SAMPLE_FMT_FLTP:
+                return from_float(reinterpret_cast<const float*>(p)[idx]);
+            case AV_SAMPLE_FMT_DBL:
+            case AV_SAMPLE_FMT_DBLP:
+                return from_float(reinterpret_cast<const double*>(p)[idx]);
+            default:
+                throw std::runtime_error("Unsupported sample format");
+            }
+            };
+
+        for (int i = 0; i < n; i++) {
+            for (int c = 0; c < channels; c++) *dst++ = sample(c, i);
+        }
+    }
+
+    // A WAV (pcm_s16le) or FLAC file fed interleaved 16-bit samples.
+    struct AudioOutput {
+        AVFormatContext* oc = nullptr;
+        AVCodecContext* enc = nullptr;
+        AVStream* st = nullptr;
+        AVFrame* frame = nullptr;
+        AVPacket* pkt = nullptr;
+        std::vector<int16_t> pending;  // interleaved, not yet a full frame
+        int channels = 0;
+        int frame_size = 0;
+        int64_t pts = 0;
+
+        AudioOutput(const std::filesystem::path& path, AudioFormat format,
+            const AVCodecContext* dec) {
+            const bool flac = format == AudioFormat::FLAC;
+            const std::string name = path.string();
+            int err = avformat_alloc_output_context2(&oc, nullptr, flac ? "flac" : "wav",
+                name.c_str());
+            if (err < 0 || oc == nullptr) {
+                throw std::runtime_error("Failed to create muxer: " + av_error_string(err));
+            }
+
+            try {
+                const AVCodec* codec = avcodec_find_encoder(
+                    flac ? AV_CODEC_ID_FLAC : AV_CODEC_ID_PCM_S16LE);
+                if (codec == nullptr) throw std::runtime_error("No audio encoder available");
+                enc = avcodec_alloc_context3(codec);
+                if (enc == nullptr) throw std::runtime_error("avcodec_alloc_context3 failed");
+                enc->sample_fmt = AV_SAMPLE_FMT_S16;
+                enc->sample_rate = dec->sample_rate;
+                enc->time_base = AVRational{ 1, dec->sample_rate };
+                av_channel_layout_copy(&enc->ch_layout, &dec->ch_layout);
+                if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
+                    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+                }
+                err = avcodec_open2(enc, codec, nullptr);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to open encoder: " + av_error_string(err));
+                }
+                channels = enc->ch_layout.nb_channels;
+                if (channels <= 0) throw std::runtime_error("Audio track has no channels");
+                // PCM takes any frame size.
+                frame_size = enc->frame_size > 0 ? enc->frame_size : 4096;
+
+                st = avformat_new_stream(oc, nullptr);
+                if (st == nullptr) throw std::runtime_error("avformat_new_stream failed");
+                err = avcodec_parameters_from_context(st->codecpar, enc);
+                if (err < 0) throw std::runtime_error("Failed to copy codec parameters");
+                st->time_base = enc->time_base;
+
+                frame = av_frame_alloc();
+                pkt = av_packet_alloc();
+                if (frame == nullptr || pkt == nullptr) {
+                    throw std::runtime_error("av_frame_alloc failed");
+                }
+
+                err = avio_open(&oc->pb, name.c_str(), AVIO_FLAG_WRITE);
+                if (err < 0) throw std::runtime_error("Failed to open output: " + name);
+                err = avformat_write_header(oc, nullptr);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to write header: " + av_error_string(err));
+                }
+            }
+            catch (...) {
+                close();
+                throw;
+            }
+        }
+        ~AudioOutput() { close(); }
+
+        AudioOutput(const AudioOutput&) = delete;
+        AudioOutput& operator=(const AudioOutput&) = delete;
+
+        void close() {
+            av_frame_free(&frame);
+            av_packet_free(&pkt);
+            avcodec_free_context(&enc);
+            if (oc != nullptr) {
+                avio_closep(&oc->pb);
+                avformat_free_context(oc);
+                oc = nullptr;
+            }
+        }
+
+        void write(const AVFrame* decoded) {
+            append_s16(decoded, channels, pending);
+            const size_t per_frame = size_t(frame_size) * size_t(channels);
+            size_t done = 0;
+            for (; pending.size() - done >= per_frame; done += per_frame) {
+                encode(pending.data() + done, frame_size);
+            }
+            pending.erase(pending.begin(), pending.begin() + std::ptrdiff_t(done));
+        }
+
+        void finish() {
+            if (!pending.empty()) encode(pending.data(), int(pending.size() / size_t(channels)));
+            pending.clear();
+            send(nullptr);
+            const int err = av_write_trailer(oc);
+            if (err < 0) {
+                throw std::runtime_error("Failed to write trailer: " + av_error_string(err));
+            }
+        }
+
+        void encode(const int16_t* samples, int n) {
+            av_frame_unref(frame);
+            frame->format = AV_SAMPLE_FMT_S16;
+            frame->nb_samples = n;
+            frame->sample_rate = enc->sample_rate;
+            av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout);
+            int err = av_frame_get_buffer(frame, 0);
+            if (err < 0) throw std::runtime_error("av_frame_get_buffer failed");
+            std::memcpy(frame->data[0], samples, size_t(n) * size_t(channels) * sizeof(int16_t));
+            frame->pts = pts;
+            pts += n;
+            send(frame);
+        }
+
+        void send(const AVFrame* f) {
+            int err = avcodec_send_frame(enc, f);
+            if (err < 0) {
+                throw std::runtime_error("Failed to encode audio: " + av_error_string(err));
+            }
+            while ((err = avcodec_receive_packet(enc, pkt)) >= 0) {
+                av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+                pkt->stream_index = st->index;
+                err = av_interleaved_write_frame(oc, pkt);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to write packet: " + av_error_string(err));
+                }
+            }
+            if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+                throw std::runtime_error("Failed to encode audio: " + av_error_string(err));
+            }
+        }
+    };
+
+    // Owns a decoder opened on the only stream of a FormatInput.
+    struct AudioDecoder {
+        AVCodecContext* ctx = nullptr;
+
+        explicit AudioDecoder(const AVStream* st) {
+            const AVCodec* codec = avcodec_find_decoder(st->codecpar->codec_id);
+            if (codec == nullptr) {
+                throw std::runtime_error(std::string("No decoder for ") +
+                    avcodec_get_name(st->codecpar->codec_id));
+            }
+            ctx = avcodec_alloc_context3(codec);
+            if (ctx == nullptr) throw std::runtime_error("avcodec_alloc_context3 failed");
+            int err = avcodec_parameters_to_context(ctx, st->codecpar);
+            if (err >= 0) err = avcodec_open2(ctx, codec, nullptr);
+            if (err < 0) {
+                avcodec_free_context(&ctx);
+                throw std::runtime_error("Failed to open decoder: " + av_error_string(err));
+            }
+        }
+        ~AudioDecoder() { avcodec_free_context(&ctx); }
+
+        AudioDecoder(const AudioDecoder&) = delete;
+        AudioDecoder& operator=(const AudioDecoder&) = delete;
+    };
+
+    void decode_audio(const Usm& usm, const Track& track, const std::filesystem::path& out,
+        const AudioDecodeOptions& options) {
+        if (track.chunk_type != ChunkType::AUDIO) throw std::runtime_error("Not an audio track");
+
+        TrackIO io(usm, track, options.key_override);
+        AVDictionary* demux_opts = nullptr;
+        if (options.hca_key.has_value()) {
+            av_dict_set_int(&demux_opts, "hca_lowkey", int64_t(*options.hca_key & 0xFFFFFFFF), 0);
+            av_dict_set_int(&demux_opts, "hca_highkey", int64_t(*options.hca_key >> 32), 0);
+        }
+        std::unique_ptr<FormatInput> in;
+        try {
+            in = std::make_unique<FormatInput>(io.context(), &demux_opts);
+        }
+        catch (...) {
+            av_dict_free(&demux_opts);
+            throw;
+        }
+        av_dict_free(&demux_opts);
+
+        AudioDecoder dec(in->ctx->streams[0]);
+        AudioOutput output(out, options.format, dec.ctx);
+
+        AVPacket* pkt = av_packet_alloc();
+        AVFrame* frame = av_frame_alloc();
+        try {
+            if (pkt == nullptr || frame == nullptr) {
+                throw std::runtime_error("av_packet_alloc failed");
+            }
+
+            auto drain = [&]() {
+                int err;
+                while ((err = avcodec_receive_frame(dec.ctx, frame)) >= 0) {
+                    output.write(frame);
+                    av_frame_unref(frame);
+                }
+                if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+                    throw std::runtime_error("Failed to decode audio: " + av_error_string(err));
+                }
+                };
+
+            while (true) {
+                int err = av_read_frame(in->ctx, pkt);
+                if (err == AVERROR_EOF) break;
+                if (err < 0) {
+                    throw std::runtime_error("Failed to read track packet: " +
+                        av_error_string(err));
+                }
+                if (pkt->stream_index == 0) {
+                    err = avcodec_send_packet(dec.ctx, pkt);
+                    if (err < 0) {
+                        throw std::runtime_error("Failed to decode audio: " +
+                            av_error_string(err));
+                    }
+                    drain();
+                }
+                av_packet_unref(pkt);
+            }
+            avcodec_send_packet(dec.ctx, nullptr);
+            drain();
+            output.finish();
+        }
+        catch (...) {
+            av_packet_free(&pkt);
+            av_frame_free(&frame);
+            throw;
+        }
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+    }
+
+    std::vector<std::filesystem::path> decode_audio_tracks(const Usm& usm,
+        const std::filesystem::path& out_dir, const AudioDecodeOptions& options) {
+        const std::vector<Track>& tracks = usm.audios();
+        const char* ext = options.format == AudioFormat::FLAC ? ".flac" : ".wav";
+
+        std::vector<std::filesystem::path> paths;
+        // Tracks often share a CRID filename (or differ only in case or
+        // extension), and the decodes run at once: a repeated name gets the
+        // channel number, then a counter, appended to its stem.
+        std::set<std::string> taken;
+        auto claim = [&](const std::string& stem) {
+                std::string key = stem + ext;
+                std::transform(key.begin(), key.end(), key.begin(),
+                    [](unsigned char c) { return char(std::tolower(c)); });
+                return taken.insert(key).second;
+            };
+        CridBinding crid_fields;
+        for (const Track& t : tracks) {
+            std::string name;
+            if (auto v = crid_fields(t.crid).find<fields::crid::filename>()) {
+                name = slugify_utf8(basename_utf8(std::string(*v)), true);
+            }
+            std::string stem = name.empty() ? "audio_" + std::to_string(t.channel_number)
+                : std::filesystem::path(name).replace_extension().string();
+            if (!claim(stem)) {
+                const std::string base = stem + "_" + std::to_string(t.channel_number);
+                stem = base;
+                for (int n = 2; !claim(stem); n++) stem = base + "_" + std::to_string(n);
+            }
+            paths.push_back(out_dir / (stem + ext));
+        }
+        if (tracks.empty()) return paths;
+        std::filesystem::create_directories(out_dir);
+
+        unsigned jobs = options.jobs;
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        jobs = unsigned(std::min<size_t>(jobs, tracks.size()));
+
+        std::atomic<size_t> next{ 0 };
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < tracks.size(); i = next++) {
+                try {
+                    decode_audio(usm, tracks[i], paths[i], options);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) error = std::current_exception();
+                }
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+        if (error) std::rethrow_exception(error);
+
+        return paths;
+    }
+
+    // USM VP9 tracks are IVF streams: the first packet starts with the 32-byte
+    // file header and every frame carries a 12-byte frame header.
+    static Bytes strip_ivf(const Bytes& p) {
+        size_t pos = 0;
+        if (p.size() >= 32 && p[0] == 'D' && p[1] == 'K' && p[2] == 'I' && p[3] == 'F') {
+            pos = size_t(p[6]) | (size_t(p[7]) << 8);
+        }
+
+        Bytes out;
+        while (pos + 12 <= p.size()) {
+            size_t sz = size_t(p[pos]) | (size_t(p[pos + 1]) << 8) |
+                (size_t(p[pos + 2]) << 16) | (size_t(p[pos + 3]) << 24);
+            pos += 12;
+            if (pos + sz > p.size()) throw std::runtime_error("Truncated IVF frame");
+            out.insert(out.end(), p.begin() + pos, p.begin() + pos + sz);
+            pos += sz;
+        }
+        return out;
+    }
+
+    static std::string codecs_string(const AVCodecParameters* par) {
+        char buf[32];
+        if (par->codec_id == AV_CODEC_ID_H264 && par->extradata_size >= 4) {
+            const uint8_t* ed = par->extradata;
+            const int n = par->extradata_size;
+            if (ed[0] == 1) {
+                std::snprintf(buf, sizeof(buf), "avc1.%02X%02X%02X", ed[1], ed[2], ed[3]);
+                return buf;
+            }
+            for (int i = 0; i + 6 < n; i++) {
+                if (ed[i] == 0 && ed[i + 1] == 0 && ed[i + 2] == 1 && (ed[i + 3] & 0x1F) == 7) {
+                    std::snprintf(buf, sizeof(buf), "avc1.%02X%02X%02X",
+                        ed[i + 4], ed[i + 5], ed[i + 6]);
+                    return buf;
+                }
+            }
+            return "avc1";
+        }
+        if (par->codec_id == AV_CODEC_ID_MPEG2VIDEO) return "mp4v.61";
+        if (par->codec_id == AV_CODEC_ID_VP9) return "vp09.00.10.08";
+        return avcodec_get_name(par->codec_id);
+    }
+
+    struct Segmenter::State {
+        const Usm* usm = nullptr;
+        const Track* track = nullptr;
+        std::optional<Keys> keys;
+
+        AVCodecParameters* par = nullptr;
+        bool ivf = false;
+
+        int timescale = 30;
+        int64_t frame_duration = 1;
+        std::vector<int64_t> ts;     // per packet, in timescale units
+        std::vector<bool> keyframe;  // per packet
+        std::vector<SegmentInfo> segments;
+
+        ~State() { avcodec_parameters_free(&par); }
+
+        int64_t packet_duration(size_t i) const {
+            return i + 1 < ts.size() ? std::max<int64_t>(ts[i + 1] - ts[i], 1)
+                : frame_duration;
+        }
+
+        // Which packets of a run are B-frames, from the codec parser.
+        std::vector<bool> bframes(const std::vector<Bytes>& packets) const {
+            std::vector<bool> out(packets.size(), false);
+            AVCodecParserContext* parser = av_parser_init(par->codec_id);
+            if (parser == nullptr) return out;
+            AVCodecContext* ctx = avcodec_alloc_context3(nullptr);
+            if (ctx == nullptr || avcodec_parameters_to_context(ctx, par) < 0) {
+                avcodec_free_context(&ctx);
+                av_parser_close(parser);
+                throw std::runtime_error("Failed to create parser context");
+            }
+            parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+
+            Bytes padded;
+            for (size_t k = 0; k < packets.size(); k++) {
+                padded.assign(packets[k].begin(), packets[k].end());
+                padded.resize(packets[k].size() + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+                uint8_t* data = nullptr;
+                int size = 0;
+                av_parser_parse2(parser, ctx, &data, &size, padded.data(),
+                    int(packets[k].size()), AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+                out[k] = parser->pict_type == AV_PICTURE_TYPE_B;
+            }
+            av_parser_close(parser);
+            avcodec_free_context(&ctx);
+            return out;
+        }
+
+        // Presentation times of the packets [first, first + packets.size()),
+        // which are in decode order. An I/P frame is shown only once the next
+        // I/P frame has been decoded, a B-frame as soon as it is decoded; the
+        // shown frames take the run's decode times in order, one frame late
+        // so that no frame is shown before it is decoded.
+        std::vector<int64_t> presentation_times(const std::vector<Bytes>& packets,
+            size_t first) const {
+            const size_t m = packets.size();
+            std::vector<int64_t> pts(ts.begin() + first, ts.begin() + first + m);
+            if (ivf) return pts;
+
+            const std::vector<bool> b = bframes(packets);
+            if (par->video_delay <= 0 && std::find(b.begin(), b.end(), true) == b.end()) {
+                return pts;
+            }
+
+            std::vector<size_t> shown;
+            shown.reserve(m);
+            std::optional<size_t> held;
+            for (size_t k = 0; k < m; k++) {
+                if (b[k]) {
+                    shown.push_back(k);
+                    continue;
+                }
+                if (held.has_value()) shown.push_back(*held);
+                held = k;
+            }
+            if (held.has_value()) shown.push_back(*held);
+            for (size_t j = 0; j < m; j++) pts[shown[j]] = ts[first + j] + frame_duration;
+            return pts;
+        }
+
+        // Opens an fMP4 muxer writing into a dynamic buffer; the header
+        // (ftyp + empty moov) is written immediately.
+        AVFormatContext* open_muxer(size_t fragment_index) const {
+            AVFormatContext* oc = nullptr;
+            int err = avformat_alloc_output_context2(&oc, nullptr, "mp4", nullptr);
+            if (err < 0 || oc == nullptr) {
+                throw std::runtime_error("Failed to create fMP4 muxer: " + av_error_string(err));
+            }
+
+            AVDictionary* opts = nullptr;
+            try {
+                AVStream* st = avformat_new_stream(oc, nullptr);
+                if (st == nullptr) throw std::runtime_error("avformat_new_stream failed");
+                if (avcodec_parameters_copy(st->codecpar, par) < 0) {
+                    throw std::runtime_error("Failed to copy codec parameters");
+                }
+                st->codecpar->codec_tag = 0;
+                st->time_base = AVRational{ 1, timescale };
+
+                if (avio_open_dyn_buf(&oc->pb) < 0) {
+                    throw std::runtime_error("avio_open_dyn_buf failed");
+                }
+
+                av_dict_set(&opts, "movflags",
+                    "+frag_custom+empty_moov+default_base_moof+frag_discont", 0);
+                av_dict_set_int(&opts, "video_track_timescale", timescale, 0);
+                av_dict_set_int(&opts, "fragment_index", int64_t(fragment_index), 0);
+
+                err = avformat_write_header(oc, &opts);
+                av_dict_free(&opts);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to write fMP4 header: " +
+                        av_error_string(err));
+                }
+            }
+            catch (...) {
+                av_dict_free(&opts);
+                close_muxer(oc);
+                throw;
+            }
+            return oc;
+        }
+
+        static Bytes take_buffer(AVFormatContext* oc) {
+            uint8_t* data = nullptr;
+            int n = avio_close_dyn_buf(oc->pb, &data);
+            oc->pb = nullptr;
+            Bytes out(data, data + std::max(n, 0));
+            av_free(data);
+            return out;
+        }
+
+        static void close_muxer(AVFormatContext* oc) {
+            if (oc == nullptr) return;
+            if (oc->pb != nullptr) take_buffer(oc);
+            avformat_free_context(oc);
+        }
+    };
+
+    Segmenter::Segmenter(const Usm& usm, const Track& track, double target_duration,
+        std::optional<uint64_t> key_override)
+        : state_(std::make_unique<State>()) {
+        if (track.chunk_type == ChunkType::AUDIO) {
+            throw std::runtime_error("Segmenter requires a video or alpha track");
+        }
+        if (track.stream.empty()) throw std::runtime_error("Track has no packets");
+
+        State& s = *state_;
+        s.usm = &usm;
+        s.track = &track;
+        s.keys = keys_for(key_override.has_value() ? key_override : usm.key());
+
+        {
+            // Probing reads only the first packets of the track.
+            TrackIO io(usm, track, key_override);
+            FormatInput in(io.context());
+            s.par = avcodec_parameters_alloc();
+            if (s.par == nullptr ||
+                avcodec_parameters_copy(s.par, in.ctx->streams[0]->codecpar) < 0) {
+                throw std::runtime_error("Failed to copy codec parameters");
+            }
+            s.ivf = std::strcmp(in.ctx->iformat->name, "ivf") == 0;
+        }
+
+        const size_t n = track.stream.size();
+        const bool timed = track.stream.has_times();
+        s.timescale = !timed || track.stream.time(0).second == 0
+            ? 30 : int(track.stream.time(0).second);
+        s.ts.resize(n);
+        for (auto it = track.stream.begin(); it != track.stream.end(); ++it) {
+            const size_t i = it.index();
+            const auto [ft, fr] = it.time();
+            if (timed && fr != 0) {
+                s.ts[i] = av_rescale_q(int64_t(ft), AVRational{ 1, int(fr) },
+                    AVRational{ 1, s.timescale });
+            }
+            else {
+                s.ts[i] = i == 0 ? 0 : s.ts[i - 1] + 1;
+            }
+        }
+
+        VideoHeaderBinding bind;
+        auto hdr = bind(track.header);
+        auto fr_n = hdr.find<fields::video_hdr::framerate_n>();
+        auto fr_d = hdr.find<fields::video_hdr::framerate_d>();
+        if (fr_n.value_or(0) > 0 && fr_d.value_or(0) > 0) {
+            s.frame_duration = std::max<int64_t>(
+                int64_t(s.timescale) * *fr_d / *fr_n, 1);
+        }
+        else if (n > 1) {
+            s.frame_duration = std::max<int64_t>(s.ts[1] - s.ts[0], 1);
+        }
+
+        s.keyframe.assign(n, false);
+        for (size_t k : track_keyframes(track)) s.keyframe[k] = true;
+
+        const int64_t target = std::max<int64_t>(
+            int64_t(std::llround(target_duration * s.timescale)), 1);
+        size_t start = 0;
+        for (size_t i = 1; i <= n; i++) {
+            bool boundary = i == n || (s.keyframe[i] && s.ts[i] - s.ts[start] >= target);
+            if (!boundary) continue;
+            int64_t end_ts = i == n ? s.ts[n - 1] + s.packet_duration(n - 1) : s.ts[i];
+            s.segments.push_back(SegmentInfo{ start, i, s.ts[start], end_ts - s.ts[start] });
+            start = i;
+        }
+    }
+
+    Segmenter::~Segmenter() = default;
+
+    const std::vector<SegmentInfo>& Segmenter::segments() const { return state_->segments; }
+
+    int Segmenter::timescale() const { return state_->timescale; }
+
+    Bytes Segmenter::init_segment() const {
+        AVFormatContext* oc = state_->open_muxer(1);
+        Bytes out = State::take_buffer(oc);
+        State::close_muxer(oc);
+        return out;
+    }
+
+    Bytes Segmenter::segment(size_t index) const {
+        const State& s = *state_;
+        if (index >= s.segments.size()) throw std::runtime_error("Segment index out of range");
+        const SegmentInfo& seg = s.segments[index];
+
+        const ByteSource& in = *s.usm->source();
+
+        AVFormatContext* oc = s.open_muxer(index + 1);
+        AVPacket* pkt = av_packet_alloc();
+        Bytes out;
+        try {
+            if (pkt == nullptr) throw std::runtime_error("av_packet_alloc failed");
+
+            // Drop the init bytes; the segment is everything after them.
+            State::take_buffer(oc);
+            if (avio_open_dyn_buf(&oc->pb) < 0) {
+                throw std::runtime_error("avio_open_dyn_buf failed");
+            }
+
+            std::vector<Bytes> packets(seg.end_packet - seg.first_packet);
+            auto it = s.track->stream.iterator_at(seg.first_packet);
+            for (Bytes& buf : packets) {
+                const auto [off, sz] = *it;
+                ++it;
+                buf.resize(sz);
+                in.read_at(off, buf.data(), sz);
+                if (s.keys.has_value()) {
+                    decrypt_packet(buf.data(), sz, s.track->chunk_type, *s.keys);
+                }
+                if (s.ivf) buf = strip_ivf(buf);
+            }
+            const std::vector<int64_t> pts = s.presentation_times(packets, seg.first_packet);
+
+            for (size_t i = seg.first_packet; i < seg.end_packet; i++) {
+                const Bytes& buf = packets[i - seg.first_packet];
+                if (av_new_packet(pkt, int(buf.size())) < 0) {
+                    throw std::runtime_error("av_new_packet failed");
+                }
+                std::memcpy(pkt->data, buf.data(), buf.size());
+                pkt->pts = pts[i - seg.first_packet];
+                pkt->dts = s.ts[i];
+                pkt->duration = s.packet_duration(i);
+                pkt->stream_index = 0;
+                if (s.keyframe[i]) pkt->flags |= AV_PKT_FLAG_KEY;
+
+                int err = av_write_frame(oc, pkt);
+                av_packet_unref(pkt);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to write packet: " + av_error_string(err));
+                }
+            }
+
+            // With frag_custom a NULL packet flushes the fragment.
+            int err = av_write_frame(oc, nullptr);
+            if (err < 0) {
+                throw std::runtime_error("Failed to flush fragment: " + av_error_string(err));
+            }
+            out = State::take_buffer(oc);
+        }
+        catch (...) {
+            av_packet_free(&pkt);
+            State::close_muxer(oc);
+            throw;
+        }
+        av_packet_free(&pkt);
+        State::close_muxer(oc);
+        return out;
+    }
+
+    std::string Segmenter::segment_name(size_t index) {
+        return "seg-" + std::to_string(index) + ".m4s";
+    }
+
+    std::string Segmenter::hls_playlist(const std::string& init_name) const {
+        const State& s = *state_;
+        double max_duration = 0.0;
+        for (const auto& seg : s.segments) {
+            max_duration = std::max(max_duration, double(seg.duration) / s.timescale);
+        }
+
+        std::ostringstream oss;
+        oss << "#EXTM3U\n"
+            << "#EXT-X-VERSION:7\n"
+            << "#EXT-X-TARGETDURATION:" << int(std::ceil(max_duration)) << "\n"
+            << "#EXT-X-MEDIA-SEQUENCE:0\n"
+            << "#EXT-X-PLAYLIST-TYPE:VOD\n"
+            << "#EXT-X-INDEPENDENT-SEGMENTS\n"
+            << "#EXT-X-MAP:URI=\"" << init_name << "\"\n";
+        oss.setf(std::ios::fixed);
+        oss.precision(6);
+        for (size_t i = 0; i < s.segments.size(); i++) {
+            oss << "#EXTINF:" << double(s.segments[i].duration) / s.timescale << ",\n"
+                << segment_name(i) << "\n";
+        }
+        oss << "#EXT-X-ENDLIST\n";
+        return oss.str();
+    }
+
+    std::string Segmenter::dash_manifest(const std::string& init_name) const {
+        const State& s = *state_;
+        int64_t total = 0;
+        uint64_t bytes = 0;
+        for (const auto& seg : s.segments) total += seg.duration;
+        for (const auto& [off, sz] : s.track->stream) bytes += sz;
+        const double seconds = double(total) / s.timescale;
+        const int64_t bandwidth = seconds > 0 ? int64_t(double(bytes) * 8.0 / seconds) : 0;
+
+        std::ostringstream oss;
+        oss.setf(std::ios::fixed);
+        oss.precision(3);
+        oss << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" type=\"static\""
+            << " profiles=\"urn:mpeg:dash:profile:isoff-live:2011\""
+            << " minBufferTime=\"PT2S\" mediaPresentationDuration=\"PT" << seconds
+            << "S\">\n"
+            << "  <Period start=\"PT0S\">\n"
+            << "    <AdaptationSet contentType=\"video\" mimeType=\"video/mp4\""
+            << " segmentAlignment=\"true\" startWithSAP=\"1\">\n"
+            << "      <Representation id=\"" << s.track->channel_number << "\""
+            << " codecs=\"" << codecs_string(s.par) << "\""
+            << " width=\"" << s.par->width << "\" height=\"" << s.par->height << "\""
+            << " bandwidth=\"" << bandwidth << "\">\n"
+            << "        <SegmentTemplate timescale=\"" << s.timescale << "\""
+            << " initialization=\"" << init_name << "\" media=\"seg-$Number$.m4s\""
+            << " startNumber=\"0\">\n"
+            << "          <SegmentTimeline>\n";
+        for (const auto& seg : s.segments) {
+            oss << "            <S t=\"" << seg.start << "\" d=\"" << seg.duration << "\"/>\n";
+        }
+        oss << "          </SegmentTimeline>\n"
+            << "        </SegmentTemplate>\n"
+            << "      </Representation>\n"
+            << "    </AdaptationSet>\n"
+            << "  </Period>\n"
+            << "</MPD>\n";
+        return oss.str();
+    }
+
+    void Segmenter::write_all(const std::filesystem::path& dir) const {
+        std::filesystem::create_directories(dir);
+
+        auto write_file = [](const std::filesystem::path& p, const void* data, size_t n) {
+            std::ofstream out(p, std::ios::binary);
+            if (!out) throw std::runtime_error("Failed to open output: " + p.string());
+            out.write(static_cast<const char*>(data), std::streamsize(n));
+            };
+
+        Bytes init = init_segment();
+        write_file(dir / "init.mp4", init.data(), init.size());
+        for (size_t i = 0; i < state_->segments.size(); i++) {
+            Bytes seg = segment(i);
+            write_file(dir / segment_name(i), seg.data(), seg.size());
+        }
+
+        std::string m3u8 = hls_playlist();
+        write_file(dir / "index.m3u8", m3u8.data(), m3u8.size());
+        std::string mpd = dash_manifest();
+        write_file(dir / "manifest.mpd", mpd.data(), mpd.size());
+    }
+
+    // VIDEO_SEEKINFO ofs_frmid is a frame number at the header frame rate,
+    // which equals the packet index only while every chunk holds exactly one
+    // frame, so the frame's time is looked up in the chunk times instead.
+    static std::optional<size_t> packet_for_frame(const Track& track, int64_t frame_id) {
+        const size_t n = track.stream.size();
+        if (frame_id < 0) return std::nullopt;
+
+        VideoHeaderBinding bind;
+        auto hdr = bind(track.header);
+        auto fr_n = hdr.find<fields::video_hdr::framerate_n>();
+        auto fr_d = hdr.find<fields::video_hdr::framerate_d>();
+        if (!track.stream.has_times() || fr_n.value_or(0) <= 0 || fr_d.value_or(0) <= 0) {
+            if (uint64_t(frame_id) >= n) return std::nullopt;
+            return size_t(frame_id);
+        }
+
+        auto seconds = [&](size_t i) {
+            const auto [ft, fr] = track.stream.time(i);
+            return fr == 0 ? 0.0 : double(ft) / double(fr);
+        };
+        const double frame = double(*fr_d) / double(*fr_n);
+        const double target = seconds(0) + (double(frame_id) - 0.5) * frame;
+
+        // Chunk times are in decode order and never go back.
+        size_t lo = 0;
+        size_t hi = n;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (seconds(mid) < target) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == n) return std::nullopt;
+        return lo;
+    }
+
+    std::vector<size_t> track_keyframes(const Track& track) {
+        std::vector<size_t> out{ 0 };
+        for (int id : keyframes_from_seek_pages(track.metadata)) {
+            if (auto k = packet_for_frame(track, id); k.has_value()) out.push_back(*k);
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+
+    // A decoded, scaled frame as packed RGB24.
+    struct RgbImage {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> pixels;
+    };
+
+    // What every thumbnail of one track shares; read-only once built, so
+    // decode_keyframe can run on several threads.
+    struct ThumbnailSource {
+        const Usm* usm = nullptr;
+        const Track* track = nullptr;
+        std::optional<Keys> keys;
+        AVCodecParameters* par = nullptr;
+        bool ivf = false;
+
+        // Stop feeding a keyframe's decoder after this many packets.
+        static constexpr size_t kMaxPackets = 64;
+
+        ThumbnailSource(const Usm& u, const Track& t, std::optional<uint64_t> key_override)
+            : usm(&u), track(&t) {
+            if (t.chunk_type == ChunkType::AUDIO) {
+                throw std::runtime_error("Thumbnails require a video or alpha track");
+            }
+            if (t.stream.empty()) throw std::runtime_error("Track has no packets");
+            keys = keys_for(key_override.has_value() ? key_override : u.key());
+
+            // Probe with a small budget: only the first packets are read.
+            TrackIO io(u, t, key_override);
+            AVDictionary* opts = nullptr;
+            av_dict_set_int(&opts, "probesize", 1 << 20, 0);
+            try {
+                FormatInput in(io.context(), &opts);
+                par = avcodec_parameters_alloc();
+                if (par == nullptr ||
+                    avcodec_parameters_copy(par, in.ctx->streams[0]->codecpar) < 0) {
+                    throw std::runtime_error("Failed to copy codec parameters");
+                }
+                ivf = std::strcmp(in.ctx->iformat->name, "ivf") == 0;
+            }
+            catch (...) {
+                av_dict_free(&opts);
+                avcodec_parameters_free(&par);
+                throw;
+            }
+            av_dict_free(&opts);
+        }
+        ~ThumbnailSource() { avcodec_parameters_free(&par); }
+
+        ThumbnailSource(const ThumbnailSource&) = delete;
+        ThumbnailSource& operator=(const ThumbnailSource&) = delete;
+
+        // Decodes from keyframe packet `first` up to the first frame and
+        // scales it to `width` (0 = source width).
+        RgbImage decode_keyframe(size_t first, int width) const {
+            const AVCodec* codec = avcodec_find_decoder(par->codec_id);
+            if (codec == nullptr) {
+                throw std::runtime_error(std::string("No decoder for ") +
+                    avcodec_get_name(par->codec_id));
+            }
+            AVCodecContext* dec = avcodec_alloc_context3(codec);
+            AVPacket* pkt = av_packet_alloc();
+            AVFrame* frame = av_frame_alloc();
+            RgbImage image;
+            try {
+                if (dec == nullptr || pkt == nullptr || frame == nullptr) {
+                    throw std::runtime_error("Failed to allocate decoder");
+                }
+                int err = avcodec_parameters_to_context(dec, par);
+                // Threads work across keyframes; frame threading only adds delay.
+                dec->thread_count = 1;
+                if (err >= 0) err = avcodec_open2(dec, codec, nullptr);
+                if (err < 0) {
+                    throw std::runtime_error("Failed to open decoder: " + av_error_string(err));
+                }
+
+                const ByteSource& in = *usm->source();
+                const size_t end = std::min(track->stream.size(), first + kMaxPackets);
+                auto it = track->stream.iterator_at(first);
+                Bytes buf;
+                bool flushed = false;
+                for (size_t i = first;; i++) {
+                    if (i < end) {
+                        const auto [off, sz] = *it;
+                        ++it;
+                        buf.resize(sz);
+                        in.read_at(off, buf.data(), sz);
+                        if (keys.has_value()) {
+                            decrypt_packet(buf.data(), sz, track->chunk_type, *keys);
+                        }
+                        if (ivf) buf = strip_ivf(buf);
+                        if (av_new_packet(pkt, int(buf.size())) < 0) {
+                            throw std::runtime_error("av_new_packet failed");
+                        }
+                        std::memcpy(pkt->data, buf.data(), buf.size());
+                        if (i == first) pkt->flags |= AV_PKT_FLAG_KEY;
+                        err = avcodec_send_packet(dec, pkt);
+                        av_packet_unref(pkt);
+                        // A broken packet after the keyframe is not fatal.
+                        if (err < 0 && err != AVERROR(EAGAIN) && i == first) {
+                            throw std::runtime_error("Failed to decode keyframe: " +
+                                av_error_string(err));
+                        }
+                    }
+                    else if (!flushed) {
+                        avcodec_send_packet(dec, nullptr);
+                        flushed = true;
+                    }
+                    else {
+                        throw std::runtime_error("No frame decoded at packet " +
+                            std::to_string(first));
+                    }
+
+                    if (avcodec_receive_frame(dec, frame) >= 0) break;
+                }
+
+                image = scale_to_rgb(frame, width);
+            }
+            catch (...) {
+                av_frame_free(&frame);
+                av_packet_free(&pkt);
+                avcodec_free_context(&dec);
+                throw;
+            }
+            av_frame_free(&frame);
+            av_packet_free(&pkt);
+            avcodec_free_context(&dec);
+            return image;
+        }
+
+        static RgbImage scale_to_rgb(const AVFrame* frame, int width) {
+            RgbImage image;
+            image.width = width > 0 ? width : frame->width;
+            image.height = std::max(1, int(std::llround(
+                double(frame->height) * image.width / std::max(frame->width, 1))));
+            image.pixels.resize(size_t(image.width) * size_t(image.height) * 3);
+
+            SwsContext* sws = sws_getContext(frame->width, frame->height,
+                AVPixelFormat(frame->format), image.width, image.height, AV_PIX_FMT_RGB24,
+                SWS_AREA, nullptr, nullptr, nullptr);
+            if (sws == nullptr) throw std::runtime_error("Failed to create scaler");
+            uint8_t* dst[4] = { image.pixels.data(), nullptr, nullptr, nullptr };
+            int dst_stride[4] = { image.width * 3, 0, 0, 0 };
+            sws_scale(sws, frame->data, frame->linesize, 0, frame->height, dst, dst_stride);
+            sws_freeContext(sws);
+            return image;
+        }
+    };
+
+    // Encodes an RGB24 image as PNG, or as JPEG through a YUVJ420P copy.
+    static Bytes encode_image(const RgbImage& image, ImageFormat format) {
+        const bool png = format == ImageFormat::PNG;
+        const AVCodec* codec = avcodec_find_encoder(png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+        if (codec == nullptr) throw std::runtime_error("No image encoder available");
+
+        AVCodecContext* enc = avcodec_alloc_context3(codec);
+        AVFrame* frame = av_frame_alloc();
+        AVPacket* pkt = av_packet_alloc();
+        SwsContext* sws = nullptr;
+        Bytes out;
+        try {
+            if (enc == nullptr || frame == nullptr || pkt == nullptr) {
+                throw std::runtime_error("Failed to allocate encoder");
+            }
+            const AVPixelFormat fmt = png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+            enc->width = image.width;
+            enc->height = image.height;
+            enc->pix_fmt = fmt;
+            enc->time_base = AVRational{ 1, 25 };
+            if (!png) {
+                enc->qmin = 2;
+                enc->qmax = 4;
+            }
+            int err = avcodec_open2(enc, codec, nullptr);
+            if (err < 0) {
+                throw std::runtime_error("Failed to open encoder: " + av_error_string(err));
+            }
+
+            frame->format = fmt;
+            frame->width = image.width;
+            frame->height = image.height;
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                throw std::runtime_error("av_frame_get_buffer failed");
+            }
+
+            const uint8_t* src[4] = { image.pixels.data(), nullptr, nullptr, nullptr };
+            const int src_stride[4] = { image.width * 3, 0, 0, 0 };
+            sws = sws_getContext(image.width, image.height, AV_PIX_FMT_RGB24,
+                image.width, image.height, fmt, SWS_BILINEAR, nullptr, nullptr, nullptr);
+            if (sws == nullptr) throw std::runtime_error("Failed to create scaler");
+            sws_scale(sws, src, src_stride, 0, image.height, frame->data, frame->linesize);
+
+            err = avcodec_send_frame(enc, frame);
+            if (err >= 0) err = avcodec_send_frame(enc, nullptr);
+            if (err < 0) {
+                throw std::runtime_error("Failed to encode image: " + av_error_string(err));
+            }
+            while (avcodec_receive_packet(enc, pkt) >= 0) {
+                out.insert(out.end(), pkt->data, pkt->data + pkt->size);
+                av_packet_unref(pkt);
+            }
+            if (out.empty()) throw std::runtime_error("Image encoder produced no data");
+        }
+        catch (...) {
+            sws_freeContext(sws);
+            av_packet_free(&pkt);
+            av_frame_free(&frame);
+            avcodec_free_context(&enc);
+            throw;
+        }
+        sws_freeContext(sws);
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+        avcodec_free_context(&enc);
+        return out;
+    }
+
+    Bytes poster_frame(const Usm& usm, const Track& track, double position,
+        const ThumbnailOptions& options) {
+        ThumbnailSource src(usm, track, options.key_override);
+        const std::vector<size_t> keyframes = track_keyframes(track);
+
+        const double target = std::clamp(position, 0.0, 1.0) * double(track.stream.size());
+        size_t best = keyframes[0];
+        for (size_t k : keyframes) {
+            if (std::abs(double(k) - target) < std::abs(double(best) - target)) best = k;
+        }
+        return encode_image(src.decode_keyframe(best, options.width), options.format);
+    }
+
+    Bytes contact_sheet(const Usm& usm, const Track& track, const ThumbnailOptions& options) {
+        ThumbnailSource src(usm, track, options.key_override);
+        const std::vector<size_t> keyframes = track_keyframes(track);
+
+        // The middle keyframe of each of `count` equal runs.
+        const size_t count = std::min(size_t(std::max(options.count, 1)), keyframes.size());
+        std::vector<size_t> picks(count);
+        for (size_t j = 0; j < count; j++) {
+            picks[j] = keyframes[(2 * j + 1) * keyframes.size() / (2 * count)];
+        }
+
+        std::vector<RgbImage> thumbs(count);
+        unsigned jobs = options.jobs;
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        jobs = unsigned(std::min<size_t>(jobs, count));
+
+        std::atomic<size_t> next{ 0 };
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    thumbs[i] = src.decode_keyframe(picks[i], options.width);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) error = std::current_exception();
+                }
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+        if (error) std::rethrow_exception(error);
+
+        // Cells take the first thumbnail's size; the background is black.
+        const int columns = int(std::min<size_t>(size_t(std::max(options.columns, 1)), count));
+        const int rows = int((count + size_t(columns) - 1) / size_t(columns));
+        const int cell_w = thumbs[0].width;
+        const int cell_h = thumbs[0].height;
+        RgbImage sheet;
+        sheet.width = cell_w * columns;
+        sheet.height = cell_h * rows;
+        sheet.pixels.assign(size_t(sheet.width) * size_t(sheet.height) * 3, 0);
+        for (size_t i = 0; i < count; i++) {
+            const RgbImage& t = thumbs[i];
+            const int x0 = int(i % size_t(columns)) * cell_w;
+            const int y0 = int(i / size_t(columns)) * cell_h;
+            const int w = std::min(t.width, cell_w);
+            for (int y = 0; y < std::min(t.height, cell_h); y++) {
+                const size_t row = size_t(y0 + y) * size_t(sheet.width) + size_t(x0);
+                std::memcpy(&sheet.pixels[row * 3], &t.pixels[size_t(y) * size_t(t.width) * 3],
+                    size_t(w) * 3);
+            }
+        }
+        return encode_image(sheet, options.format);
+    }
+
+}  // namespace usm
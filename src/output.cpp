@@ -0,0 +1,403 @@
+#include "usm/output.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace usm {
+
+    static std::runtime_error errno_error(const std::string& what) {
+        return std::runtime_error(what + ": " + std::strerror(errno));
+    }
+
+    FileHandle::~FileHandle() {
+        if (fd_ >= 0) {
+#ifdef _WIN32
+            _close(fd_);
+#else
+            ::close(fd_);
+#endif
+        }
+    }
+
+    FileHandle::FileHandle(FileHandle&& other) noexcept
+        : fd_(std::exchange(other.fd_, -1)) {
+    }
+
+    FileHandle& FileHandle::operator=(FileHandle&& other) noexcept {
+        if (this != &other) {
+            FileHandle tmp(std::move(*this));
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    FileHandle FileHandle::open_read(const std::filesystem::path& path) {
+#ifdef _WIN32
+        int fd = _wopen(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        if (fd < 0) throw errno_error("Failed to open " + path.string());
+        return FileHandle(fd);
+    }
+
+    FileHandle FileHandle::open_write(const std::filesystem::path& path) {
+#ifdef _WIN32
+        int fd = _wopen(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+            _S_IREAD | _S_IWRITE);
+#else
+        int flags = O_WRONLY | O_CLOEXEC;
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || S_ISREG(st.st_mode)) {
+            flags |= O_CREAT | O_TRUNC;
+        }
+        int fd = ::open(path.c_str(), flags, 0644);
+#endif
+        if (fd < 0) throw errno_error("Failed to open output " + path.string());
+        return FileHandle(fd);
+    }
+
+    FileHandle FileHandle::open_update(const std::filesystem::path& path) {
+#ifdef _WIN32
+        int fd = _wopen(path.c_str(), _O_WRONLY | _O_BINARY);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+#endif
+        if (fd < 0) throw errno_error("Failed to open for writing " + path.string());
+        return FileHandle(fd);
+    }
+
+    void write_all(int fd, const void* data, size_t n) {
+        const auto* p = static_cast<const uint8_t*>(data);
+        while (n > 0) {
+#ifdef _WIN32
+            int w = _write(fd, p, unsigned(std::min<size_t>(n, 0x40000000)));
+#else
+            ssize_t w = ::write(fd, p, n);
+#endif
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw errno_error("Write failed");
+            }
+            p += w;
+            n -= size_t(w);
+        }
+    }
+
+    void write_gather(int fd, const std::vector<std::pair<const uint8_t*, size_t>>& parts) {
+#ifdef _WIN32
+        for (const auto& [data, n] : parts) write_all(fd, data, n);
+#else
+        std::vector<iovec> iov;
+        iov.reserve(std::min<size_t>(parts.size(), IOV_MAX));
+        size_t next = 0;
+        while (next < parts.size() || !iov.empty()) {
+            while (next < parts.size() && iov.size() < IOV_MAX) {
+                if (parts[next].second > 0) {
+                    iov.push_back({ const_cast<uint8_t*>(parts[next].first), parts[next].second });
+                }
+                next++;
+            }
+            if (iov.empty()) break;
+
+            ssize_t w = ::writev(fd, iov.data(), int(iov.size()));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw errno_error("Write failed");
+            }
+            // Drop what was written; a partial part is trimmed in place.
+            size_t done = size_t(w);
+            size_t k = 0;
+            while (k < iov.size() && done >= iov[k].iov_len) done -= iov[k++].iov_len;
+            if (k < iov.size()) {
+                iov[k].iov_base = static_cast<uint8_t*>(iov[k].iov_base) + done;
+                iov[k].iov_len -= done;
+            }
+            iov.erase(iov.begin(), iov.begin() + ptrdiff_t(k));
+        }
+#endif
+    }
+
+    void pread_all(int fd, uint64_t offset, void* dst, size_t n) {
+        auto* p = static_cast<uint8_t*>(dst);
+#ifdef _WIN32
+        if (_lseeki64(fd, int64_t(offset), SEEK_SET) < 0) throw errno_error("Seek failed");
+#endif
+        while (n > 0) {
+#ifdef _WIN32
+            int r = _read(fd, p, unsigned(std::min<size_t>(n, 0x40000000)));
+#else
+            ssize_t r = ::pread(fd, p, n, off_t(offset));
+#endif
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw errno_error("Read failed");
+            }
+            if (r == 0) throw std::runtime_error("Unexpected end of file");
+            p += r;
+            n -= size_t(r);
+            offset += uint64_t(r);
+        }
+    }
+
+    void pwrite_all(int fd, uint64_t offset, const void* data, size_t n) {
+        const auto* p = static_cast<const uint8_t*>(data);
+#ifdef _WIN32
+        if (_lseeki64(fd, int64_t(offset), SEEK_SET) < 0) throw errno_error("Seek failed");
+        write_all(fd, p, n);
+#else
+        while (n > 0) {
+            ssize_t w = ::pwrite(fd, p, n, off_t(offset));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw errno_error("Write failed");
+            }
+            p += w;
+            n -= size_t(w);
+            offset += uint64_t(w);
+        }
+#endif
+    }
+
+    void sync_data(int fd) {
+#if defined(_WIN32)
+        if (_commit(fd) != 0) throw errno_error("Sync failed");
+#elif defined(__linux__)
+        if (::fdatasync(fd) != 0) throw errno_error("Sync failed");
+#else
+        if (::fsync(fd) != 0) throw errno_error("Sync failed");
+#endif
+    }
+
+    bool is_pipe(int fd) {
+#ifdef _WIN32
+        struct _stat64 st;
+        return _fstat64(fd, &st) == 0 && (st.st_mode & _S_IFIFO) != 0;
+#else
+        struct stat st;
+        return ::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+    }
+
+#ifdef __linux__
+    // copy_file_range into the current position of `out_fd`. Returns false,
+    // having copied nothing, when the pair is not supported (different file
+    // systems on older kernels, special files, O_APPEND outputs...).
+    static bool copy_range(int in_fd, uint64_t offset, size_t n, int out_fd) {
+        size_t done = 0;
+        while (done < n) {
+            loff_t off = loff_t(offset + done);
+            ssize_t r = ::copy_file_range(in_fd, &off, out_fd, nullptr, n - done, 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EBADF)) {
+                    return false;
+                }
+                throw errno_error("copy_file_range failed");
+            }
+            if (r == 0) throw std::runtime_error("Unexpected end of file");
+            done += size_t(r);
+        }
+        return true;
+    }
+#endif
+
+    bool kernel_copy(int in_fd, uint64_t offset, size_t n, int out_fd, bool out_is_pipe) {
+#ifdef __linux__
+        if (!out_is_pipe && copy_range(in_fd, offset, n, out_fd)) return true;
+
+        size_t done = 0;
+        while (done < n) {
+            ssize_t r;
+            if (out_is_pipe) {
+                loff_t off = loff_t(offset + done);
+                r = ::splice(in_fd, &off, out_fd, nullptr, n - done,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            }
+            else {
+                off_t off = off_t(offset + done);
+                r = ::sendfile(out_fd, in_fd, &off, n - done);
+            }
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (done == 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                    errno == ESPIPE || errno == EOPNOTSUPP)) {
+                    return false;
+                }
+                throw errno_error(out_is_pipe ? "splice failed" : "sendfile failed");
+            }
+            if (r == 0) throw std::runtime_error("Unexpected end of file");
+            done += size_t(r);
+        }
+        return true;
+#else
+        (void)in_fd;
+        (void)offset;
+        (void)n;
+        (void)out_fd;
+        (void)out_is_pipe;
+        return false;
+#endif
+    }
+
+    // Block size for O_DIRECT alignment; also a good write granularity
+    // without it.
+    static constexpr size_t kBlock = 4096;
+
+    static size_t round_up_block(size_t n) { return (n + kBlock - 1) & ~(kBlock - 1); }
+
+    static uint8_t* alloc_block_buffer(size_t n) {
+        return static_cast<uint8_t*>(::operator new(n, std::align_val_t(kBlock)));
+    }
+
+    static void free_block_buffer(uint8_t* p) {
+        ::operator delete(p, std::align_val_t(kBlock));
+    }
+
+    FileWriter::FileWriter(const std::filesystem::path& path, uint64_t final_size,
+        WriterOptions options, uint64_t keep) {
+#ifdef _WIN32
+        int fd = _wopen(path.c_str(),
+            _O_WRONLY | _O_CREAT | (keep > 0 ? 0 : _O_TRUNC) | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (keep > 0 ? 0 : O_TRUNC);
+        int fd = -1;
+#ifdef O_DIRECT
+        if (options.direct) {
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            // tmpfs and some network file systems refuse O_DIRECT.
+            if (fd >= 0) direct_ = true;
+        }
+#endif
+        if (fd < 0) fd = ::open(path.c_str(), flags, 0644);
+#endif
+        if (fd < 0) throw errno_error("Failed to open output " + path.string());
+        file_ = FileHandle(fd);
+
+#ifdef __linux__
+        // Best effort: not every file system supports it, and the writes
+        // below work either way.
+        if (final_size > 0) (void)::fallocate(fd, 0, 0, off_t(final_size));
+#else
+        (void)final_size;
+#endif
+
+        capacity_ = round_up_block(std::max<size_t>(options.buffer_size, kBlock));
+        buf_ = alloc_block_buffer(capacity_);
+
+        if (keep > 0) {
+            // Start at the block holding `keep`, with its kept head staged in
+            // the buffer, so writes stay block-aligned for O_DIRECT.
+            const size_t tail = size_t(keep % kBlock);
+            written_ = keep - tail;
+            if (tail > 0) {
+                FileHandle in = FileHandle::open_read(path);
+                pread_all(in.fd(), written_, buf_, tail);
+                used_ = tail;
+            }
+#ifdef _WIN32
+            if (_lseeki64(fd, int64_t(written_), SEEK_SET) < 0) throw errno_error("Seek failed");
+#else
+            if (::lseek(fd, off_t(written_), SEEK_SET) < 0) throw errno_error("Seek failed");
+#endif
+        }
+    }
+
+    FileWriter::~FileWriter() {
+        try {
+            finish();
+        }
+        catch (...) {
+        }
+        free_block_buffer(buf_);
+    }
+
+    void FileWriter::flush_blocks() {
+        const size_t whole = used_ & ~(kBlock - 1);
+        if (whole == 0) return;
+        write_all(file_.fd(), buf_, whole);
+        written_ += whole;
+        used_ -= whole;
+        std::memmove(buf_, buf_ + whole, used_);
+    }
+
+    uint8_t* FileWriter::prepare(size_t n) {
+        if (used_ + n > capacity_) flush_blocks();
+        if (used_ + n > capacity_) {
+            // A packet larger than the buffer: grow rather than split it.
+            const size_t capacity = round_up_block(used_ + n);
+            uint8_t* buf = alloc_block_buffer(capacity);
+            std::memcpy(buf, buf_, used_);
+            free_block_buffer(buf_);
+            buf_ = buf;
+            capacity_ = capacity;
+        }
+        return buf_ + used_;
+    }
+
+    void FileWriter::commit(size_t n) { used_ += n; }
+
+    void FileWriter::write(const void* data, size_t n) {
+        const auto* p = static_cast<const uint8_t*>(data);
+        while (n > 0) {
+            if (used_ == capacity_) flush_blocks();
+            const size_t take = std::min(n, capacity_ - used_);
+            std::memcpy(buf_ + used_, p, take);
+            used_ += take;
+            p += take;
+            n -= take;
+        }
+    }
+
+    uint64_t FileWriter::sync() {
+        sync_data(file_.fd());
+        return written_;
+    }
+
+    void FileWriter::finish() {
+        if (finished_) return;
+        finished_ = true;
+        flush_blocks();
+        if (used_ > 0) {
+#if defined(O_DIRECT) && !defined(_WIN32)
+            // The tail is not a whole block, which O_DIRECT cannot write.
+            if (direct_) {
+                int fl = ::fcntl(file_.fd(), F_GETFL);
+                if (fl >= 0) ::fcntl(file_.fd(), F_SETFL, fl & ~O_DIRECT);
+            }
+#endif
+            write_all(file_.fd(), buf_, used_);
+            written_ += used_;
+            used_ = 0;
+        }
+        // Drop any preallocated space past the end.
+#ifdef _WIN32
+        if (_chsize_s(file_.fd(), int64_t(written_)) != 0) throw errno_error("Truncate failed");
+#else
+        if (::ftruncate(file_.fd(), off_t(written_)) != 0) throw errno_error("Truncate failed");
+#endif
+    }
+
+}  // namespace usm
@@ -2,61 +2,237 @@
 #include "usm/page.hpp"
 
 #include "usm/bytes.hpp"
+#include "usm/schema.hpp"
 #include "usm/tools.hpp"
 #include "usm/types.hpp"
 
+#include <atomic>
 #include <cstring>
 #include <stdexcept>
 
 namespace usm {
 
-    UsmPage::UsmPage(std::string name) : name_(std::move(name)) {}
+    // Rebuilds string/bytes values in `mr` (a move when it already owns them).
+    static ElementValue rebind_value(ElementValue v, std::pmr::memory_resource* mr) {
+        if (auto* s = std::get_if<std::pmr::string>(&v)) {
+            return ElementValue(std::in_place_type<std::pmr::string>, std::move(*s), mr);
+        }
+        if (auto* b = std::get_if<PmrBytes>(&v)) {
+            return ElementValue(std::in_place_type<PmrBytes>, std::move(*b), mr);
+        }
+        return v;
+    }
+
+    // Match Python behavior: filename backslashes -> slashes.
+    static void normalize_filename(ElementValue& value) {
+        if (auto p = std::get_if<std::pmr::string>(&value)) {
+            for (auto& ch : *p) {
+                if (ch == '\\') ch = '/';
+            }
+        }
+    }
 
-    const std::string& UsmPage::name() const { return name_; }
+    static uint64_t next_schema_id() {
+        static std::atomic<uint64_t> next{ 1 };
+        return next++;
+    }
 
-    const std::vector<std::string>& UsmPage::key_order() const { return order_; }
+    PageSchema::PageSchema(allocator_type alloc)
+        : id_(next_schema_id()), names_(alloc), types_(alloc), slots_(alloc) {
+    }
 
-    const std::unordered_map<std::string, Element>& UsmPage::dict() const {
-        return dict_;
+    PageSchema::PageSchema(const PageSchema& other, allocator_type alloc)
+        : id_(next_schema_id()), names_(other.names_, alloc), types_(other.types_, alloc),
+        slots_(other.slots_, alloc) {
     }
 
-    void UsmPage::update(const std::string& key, ElementType type,
-        ElementValue value) {
-        // Match Python behavior: filename backslashes -> slashes.
-        if (key == "filename") {
-            if (auto p = std::get_if<std::string>(&value)) {
-                std::string s = *p;
-                for (auto& ch : s) {
-                    if (ch == '\\') ch = '/';
-                }
-                value = s;
+    std::optional<size_t> PageSchema::slot(std::string_view name) const {
+        auto it = slots_.find(name);
+        if (it == slots_.end()) return std::nullopt;
+        return it->second;
+    }
+
+    size_t PageSchema::add(std::string_view name, ElementType type) {
+        const size_t slot = names_.size();
+        names_.emplace_back(name);
+        types_.push_back(type);
+        slots_.emplace(name, slot);
+        id_ = next_schema_id();
+        return slot;
+    }
+
+    void PageSchema::set_type(size_t slot, ElementType type) {
+        if (types_[slot] == type) return;
+        types_[slot] = type;
+        id_ = next_schema_id();
+    }
+
+    static std::pmr::vector<Element> copy_values(const std::pmr::vector<Element>& src,
+        std::pmr::memory_resource* mr) {
+        std::pmr::vector<Element> out(mr);
+        out.reserve(src.size());
+        for (const auto& e : src) out.push_back(Element{ e.type, rebind_value(e.val, mr) });
+        return out;
+    }
+
+    // Shares `schema` when it already lives in `mr`, otherwise copies it there.
+    static std::shared_ptr<PageSchema> schema_in(const std::shared_ptr<PageSchema>& schema,
+        std::pmr::memory_resource* mr) {
+        if (schema == nullptr) return nullptr;
+        if (schema->names().get_allocator().resource()->is_equal(*mr)) return schema;
+        // polymorphic_allocator passes itself on to the schema's containers.
+        return std::allocate_shared<PageSchema>(UsmPage::allocator_type(mr), *schema);
+    }
+
+    UsmPage::UsmPage(std::string_view name, allocator_type alloc)
+        : name_(name, alloc), values_(alloc) {
+    }
+
+    UsmPage::UsmPage(std::string_view name, std::shared_ptr<PageSchema> schema,
+        allocator_type alloc)
+        : name_(name, alloc), schema_(std::move(schema)), values_(alloc) {
+        if (schema_ != nullptr) {
+            values_.reserve(schema_->size());
+            for (size_t i = 0; i < schema_->size(); i++) {
+                values_.push_back(Element{ schema_->type(i), ElementValue() });
+            }
+        }
+    }
+
+    UsmPage::UsmPage(const UsmPage& other, allocator_type alloc)
+        : name_(other.name_, alloc), schema_(schema_in(other.schema_, alloc.resource())),
+        values_(copy_values(other.values_, alloc.resource())) {
+    }
+
+    UsmPage::UsmPage(UsmPage&& other, allocator_type alloc)
+        : name_(std::move(other.name_), alloc),
+        schema_(schema_in(other.schema_, alloc.resource())), values_(alloc) {
+        if (other.values_.get_allocator() == values_.get_allocator()) {
+            values_ = std::move(other.values_);
+        }
+        else {
+            values_.reserve(other.values_.size());
+            for (auto& e : other.values_) {
+                values_.push_back(Element{ e.type, rebind_value(std::move(e.val), alloc.resource()) });
             }
         }
+        // Leave `other` empty rather than with a schema but no values.
+        other.schema_.reset();
+        other.values_.clear();
+    }
 
-        if (dict_.find(key) == dict_.end()) {
-            order_.push_back(key);
+    UsmPage& UsmPage::operator=(const UsmPage& other) {
+        if (this != &other) {
+            UsmPage tmp(other, get_allocator());
+            name_ = std::move(tmp.name_);
+            schema_ = std::move(tmp.schema_);
+            values_ = std::move(tmp.values_);
         }
-        dict_[key] = Element{ type, std::move(value) };
+        return *this;
     }
 
-    std::optional<Element> UsmPage::get(const std::string& key) const {
-        auto it = dict_.find(key);
-        if (it == dict_.end()) return std::nullopt;
-        return it->second;
+    UsmPage& UsmPage::operator=(UsmPage&& other) {
+        if (this != &other) {
+            UsmPage tmp(std::move(other), get_allocator());
+            name_ = std::move(tmp.name_);
+            schema_ = std::move(tmp.schema_);
+            values_ = std::move(tmp.values_);
+        }
+        return *this;
     }
 
-    const Element& UsmPage::at(const std::string& key) const {
-        auto it = dict_.find(key);
-        if (it == dict_.end()) throw std::runtime_error("Missing key: " + key);
-        return it->second;
+    UsmPage::allocator_type UsmPage::get_allocator() const {
+        return allocator_type(name_.get_allocator().resource());
     }
 
-    static std::string read_cstring(const Bytes& b, size_t off) {
-        if (off >= b.size()) throw std::runtime_error("Bad string offset");
-        size_t end = off;
-        while (end < b.size() && b[end] != 0x00) end++;
-        if (end >= b.size()) throw std::runtime_error("Unterminated string");
-        return std::string(reinterpret_cast<const char*>(b.data() + off), end - off);
+    const std::pmr::string& UsmPage::name() const { return name_; }
+
+    const std::pmr::vector<std::pmr::string>& UsmPage::key_order() const {
+        static const std::pmr::vector<std::pmr::string> empty;
+        return schema_ == nullptr ? empty : schema_->names();
+    }
+
+    const PageSchema* UsmPage::schema() const { return schema_.get(); }
+
+    size_t UsmPage::size() const { return values_.size(); }
+
+    // The schema this page may modify: a private copy once it is shared.
+    PageSchema& UsmPage::own_schema() {
+        if (schema_ == nullptr) {
+            schema_ = std::allocate_shared<PageSchema>(get_allocator());
+        }
+        else if (schema_.use_count() > 1) {
+            schema_ = std::allocate_shared<PageSchema>(get_allocator(), *schema_);
+        }
+        return *schema_;
+    }
+
+    void UsmPage::update(std::string_view key, ElementType type, ElementValue value) {
+        if (key == "filename") normalize_filename(value);
+
+        Element el{ type, rebind_value(std::move(value), get_allocator().resource()) };
+        std::optional<size_t> slot =
+            schema_ == nullptr ? std::nullopt : schema_->slot(key);
+        if (!slot.has_value()) {
+            own_schema().add(key, type);
+            values_.push_back(std::move(el));
+            return;
+        }
+        if (schema_->type(*slot) != type) own_schema().set_type(*slot, type);
+        values_[*slot] = std::move(el);
+    }
+
+    void UsmPage::set(size_t slot, ElementValue value) {
+        values_.at(slot) = Element{ schema_->type(slot),
+            rebind_value(std::move(value), get_allocator().resource()) };
+    }
+
+    std::optional<uint64_t> element_u64(const Element& e) {
+        return std::visit([](const auto& v) -> std::optional<uint64_t> {
+            using T = std::decay_t<decltype(v)>;
+            if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool>) {
+                return zero_extend(v);
+            }
+            else {
+                return std::nullopt;
+            }
+            }, e.val);
+    }
+
+    std::optional<Element> UsmPage::get(std::string_view key) const {
+        const Element* e = find(key);
+        if (e == nullptr) return std::nullopt;
+        return *e;
+    }
+
+    const Element* UsmPage::find(std::string_view key) const {
+        if (schema_ == nullptr) return nullptr;
+        std::optional<size_t> slot = schema_->slot(key);
+        return slot.has_value() ? &values_[*slot] : nullptr;
+    }
+
+    const Element& UsmPage::at(std::string_view key) const {
+        const Element* e = find(key);
+        if (e == nullptr) {
+            throw std::runtime_error("Missing key: " + std::string(key));
+        }
+        return *e;
+    }
+
+    // Reads a NUL-terminated string at `off` within the region [begin, end).
+    static std::string_view read_cstring(const Bytes& b, size_t begin, size_t end,
+        size_t off) {
+        if (off >= end - begin) throw std::runtime_error("Bad string offset");
+        const uint8_t* p = b.data() + begin + off;
+        const void* z = std::memchr(p, 0, end - begin - off);
+        if (z == nullptr) throw std::runtime_error("Unterminated string");
+        return std::string_view(reinterpret_cast<const char*>(p),
+            size_t(static_cast<const uint8_t*>(z) - p));
+    }
+
+    static void check_region(const Bytes& b, size_t begin, size_t end) {
+        if (end < begin) throw std::runtime_error("Invalid slice");
+        require_size(b, begin, end - begin);
     }
 
     static float read_le_f32(const uint8_t* p) {
@@ -68,6 +244,25 @@ namespace usm {
         return f;
     }
 
+    // Value of a column stored with ElementOccurrence::ZERO.
+    static ElementValue zero_value(ElementType et) {
+        switch (et) {
+        case ElementType::I8: return int8_t(0);
+        case ElementType::U8: return uint8_t(0);
+        case ElementType::I16: return int16_t(0);
+        case ElementType::U16: return uint16_t(0);
+        case ElementType::I32: return int32_t(0);
+        case ElementType::U32: return uint32_t(0);
+        case ElementType::I64: return int64_t(0);
+        case ElementType::U64: return uint64_t(0);
+        case ElementType::F32: return 0.0f;
+        case ElementType::F64: return 0.0;
+        case ElementType::STRING: return std::pmr::string();
+        case ElementType::BYTES: return PmrBytes();
+        }
+        throw std::runtime_error("Unsupported element type");
+    }
+
     static void write_le_f32(Bytes& out, float f) {
         uint32_t u;
         static_assert(sizeof(float) == 4);
@@ -78,7 +273,8 @@ namespace usm {
         out.push_back(uint8_t((u >> 24) & 0xFF));
     }
 
-    std::vector<UsmPage> get_pages(const Bytes& info, const std::string&) {
+    std::vector<UsmPage> get_pages(const Bytes& info, const std::string&,
+        std::pmr::memory_resource* mr) {
         if (info.size() < 8) throw std::runtime_error("Invalid @UTF payload");
 
         if (!(info[0] == '@' && info[1] == 'U' && info[2] == 'T' && info[3] == 'F')) {
@@ -87,7 +283,8 @@ namespace usm {
 
         const uint32_t payload_size = read_be_u32(info, 4);
 
-        const uint32_t unique_array_offset = read_be_u32(info, 8);
+        // Bytes 8-9 hold a table version in CPK tables; USM writes zero there.
+        const uint16_t unique_array_offset = read_be_u16(info, 10);
         const uint32_t strings_offset = read_be_u32(info, 12);
         const uint32_t byte_array_offset = read_be_u32(info, 16);
         const uint32_t page_name_offset = read_be_u32(info, 20);
@@ -96,174 +293,154 @@ namespace usm {
         const uint16_t unique_array_size_per_page = read_be_u16(info, 26);
         const uint32_t num_pages = read_be_u32(info, 28);
 
-        // Offsets are after the 8-byte header.
-        Bytes string_array =
-            slice(info, 8 + strings_offset, 8 + byte_array_offset);
-        Bytes byte_array = slice(info, 8 + byte_array_offset, 8 + payload_size);
+        // Regions are addressed in place; offsets are after the 8-byte header.
+        const size_t strings_begin = 8 + size_t(strings_offset);
+        const size_t strings_end = 8 + size_t(byte_array_offset);
+        const size_t bytes_begin = strings_end;
+        const size_t bytes_end = 8 + size_t(payload_size);
+        const size_t unique_begin = 8 + size_t(unique_array_offset);
+        const size_t unique_end =
+            unique_begin + size_t(unique_array_size_per_page) * num_pages;
+        // shared_array = info[0x20 : 8 + unique_array_offset]
+        const size_t shared_begin = 0x20;
+        const size_t shared_end = unique_begin;
+
+        check_region(info, strings_begin, strings_end);
+        check_region(info, bytes_begin, bytes_end);
+        check_region(info, unique_begin, unique_end);
+        check_region(info, shared_begin, shared_end);
+
+        const std::string_view page_name =
+            read_cstring(info, strings_begin, strings_end, page_name_offset);
+        // Reads one value at `pos` of the region ending at `end`.
+        auto read_value = [&](ElementType et, size_t& pos, size_t end) -> ElementValue {
+            auto need = [&](size_t n) {
+                if (pos + n > end) throw std::runtime_error("Buffer underrun");
+                };
+            switch (et) {
+            case ElementType::I8:
+                need(1);
+                return int8_t(info[pos++]);
+            case ElementType::U8:
+                need(1);
+                return uint8_t(info[pos++]);
+            case ElementType::I16:
+                need(2);
+                pos += 2;
+                return read_be_i16(info, pos - 2);
+            case ElementType::U16:
+                need(2);
+                pos += 2;
+                return read_be_u16(info, pos - 2);
+            case ElementType::I32:
+                need(4);
+                pos += 4;
+                return read_be_i32(info, pos - 4);
+            case ElementType::U32:
+                need(4);
+                pos += 4;
+                return read_be_u32(info, pos - 4);
+            case ElementType::I64:
+                need(8);
+                pos += 8;
+                return read_be_i64(info, pos - 8);
+            case ElementType::U64:
+                need(8);
+                pos += 8;
+                return read_be_u64(info, pos - 8);
+            case ElementType::F32:
+                need(4);
+                pos += 4;
+                return read_le_f32(info.data() + pos - 4);
+            case ElementType::STRING: {
+                need(4);
+                uint32_t str_off = read_be_u32(info, pos);
+                pos += 4;
+                return ElementValue(std::in_place_type<std::pmr::string>,
+                    read_cstring(info, strings_begin, strings_end, str_off), mr);
+            }
+            case ElementType::BYTES: {
+                need(8);
+                uint32_t data_off = read_be_u32(info, pos);
+                uint32_t data_end = read_be_u32(info, pos + 4);
+                pos += 8;
+                if (data_end < data_off || data_end > bytes_end - bytes_begin) {
+                    throw std::runtime_error("Bad bytes element bounds");
+                }
+                return ElementValue(std::in_place_type<PmrBytes>,
+                    info.begin() + bytes_begin + data_off,
+                    info.begin() + bytes_begin + data_end, mr);
+            }
+            default:
+                throw std::runtime_error("Unsupported element type");
+            }
+            };
+
+        // Column descriptors are shared by all pages: parse them once into
+        // one schema, then fill each page by slot.
+        struct Column {
+            ElementType type;
+            ElementOccurrence occ;
+            size_t slot;
+            size_t value_pos;  // RECURRING value in the shared array
+        };
+        std::vector<Column> columns;
+        columns.reserve(num_elements_per_page);
+
+        const UsmPage::allocator_type alloc(mr);
+        auto schema = std::allocate_shared<PageSchema>(alloc);
+        std::optional<size_t> filename_slot;
+
+        size_t shared_pos = shared_begin;
+        for (uint16_t e = 0; e < num_elements_per_page; e++) {
+            if (shared_pos + 5 > shared_end) {
+                throw std::runtime_error("Bad shared array bounds");
+            }
 
-        std::string page_name = read_cstring(string_array, page_name_offset);
-        std::vector<UsmPage> pages;
-        pages.reserve(num_pages);
-        for (uint32_t i = 0; i < num_pages; i++) {
-            pages.emplace_back(page_name);
+            uint8_t packed = info[shared_pos];
+            ElementType et = element_type_from_u8(packed & 0x1F);
+            ElementOccurrence occ = element_occurrence_from_u8(packed >> 5);
+            uint32_t name_off = read_be_u32(info, shared_pos + 1);
+            shared_pos += 5;
+
+            std::string_view element_name =
+                read_cstring(info, strings_begin, strings_end, name_off);
+
+            // A repeated name overwrites the earlier column, as update() would.
+            std::optional<size_t> slot = schema->slot(element_name);
+            if (slot.has_value()) schema->set_type(*slot, et);
+            else slot = schema->add(element_name, et);
+            if (element_name == "filename") filename_slot = slot;
+
+            // RECURRING values follow their column in the shared array;
+            // NON_RECURRING values come from unique_array sequentially.
+            columns.push_back(Column{ et, occ, *slot, shared_pos });
+            if (occ == ElementOccurrence::RECURRING) {
+                read_value(et, shared_pos, shared_end);
+            }
         }
 
-        Bytes unique_array = slice(
-            info, 8 + unique_array_offset,
-            8 + unique_array_offset + size_t(unique_array_size_per_page) * num_pages);
-
-        // shared_array = info[0x20 : 8 + unique_array_offset]
-        Bytes shared_array_master = slice(info, 0x20, 8 + unique_array_offset);
+        std::vector<UsmPage> pages;
+        pages.reserve(num_pages);
 
-        size_t unique_pos = 0;
+        size_t unique_pos = unique_begin;
         for (uint32_t p = 0; p < num_pages; p++) {
-            size_t shared_pos = 0;
+            UsmPage& page = pages.emplace_back(page_name, schema, alloc);
 
-            for (uint16_t e = 0; e < num_elements_per_page; e++) {
-                if (shared_pos + 5 > shared_array_master.size()) {
-                    throw std::runtime_error("Bad shared array bounds");
+            for (const Column& c : columns) {
+                ElementValue v;
+                if (c.occ == ElementOccurrence::ZERO) {
+                    v = zero_value(c.type);
                 }
-
-                uint8_t packed = shared_array_master[shared_pos];
-                ElementType et = element_type_from_u8(packed & 0x1F);
-                ElementOccurrence occ = element_occurrence_from_u8(packed >> 5);
-                uint32_t name_off =
-                    read_be_u32(shared_array_master, shared_pos + 1);
-                shared_pos += 5;
-
-                std::string element_name = read_cstring(string_array, name_off);
-                auto& page = pages[p];
-
-                auto read_bytes = [&](const Bytes& src, size_t pos, size_t n) -> Bytes {
-                    if (pos + n > src.size()) throw std::runtime_error("Bad element bounds");
-                    return Bytes(src.begin() + pos, src.begin() + pos + n);
-                    };
-
-                if (occ == ElementOccurrence::RECURRING) {
-                    if (et == ElementType::I8) {
-                        page.update(element_name, et, int8_t(shared_array_master[shared_pos]));
-                        shared_pos += 1;
-                    }
-                    else if (et == ElementType::U8) {
-                        page.update(element_name, et, uint8_t(shared_array_master[shared_pos]));
-                        shared_pos += 1;
-                    }
-                    else if (et == ElementType::I16) {
-                        page.update(element_name, et,
-                            int16_t(read_be_i16(shared_array_master, shared_pos)));
-                        shared_pos += 2;
-                    }
-                    else if (et == ElementType::U16) {
-                        page.update(element_name, et,
-                            uint16_t(read_be_u16(shared_array_master, shared_pos)));
-                        shared_pos += 2;
-                    }
-                    else if (et == ElementType::I32) {
-                        page.update(element_name, et,
-                            int32_t(read_be_i32(shared_array_master, shared_pos)));
-                        shared_pos += 4;
-                    }
-                    else if (et == ElementType::U32) {
-                        page.update(element_name, et,
-                            uint32_t(read_be_u32(shared_array_master, shared_pos)));
-                        shared_pos += 4;
-                    }
-                    else if (et == ElementType::I64) {
-                        page.update(element_name, et,
-                            int64_t(read_be_i64(shared_array_master, shared_pos)));
-                        shared_pos += 8;
-                    }
-                    else if (et == ElementType::U64) {
-                        page.update(element_name, et,
-                            uint64_t(read_be_u64(shared_array_master, shared_pos)));
-                        shared_pos += 8;
-                    }
-                    else if (et == ElementType::F32) {
-                        Bytes raw = read_bytes(shared_array_master, shared_pos, 4);
-                        page.update(element_name, et, read_le_f32(raw.data()));
-                        shared_pos += 4;
-                    }
-                    else if (et == ElementType::STRING) {
-                        uint32_t str_off = read_be_u32(shared_array_master, shared_pos);
-                        page.update(element_name, et, read_cstring(string_array, str_off));
-                        shared_pos += 4;
-                    }
-                    else if (et == ElementType::BYTES) {
-                        uint32_t data_off = read_be_u32(shared_array_master, shared_pos);
-                        uint32_t data_end = read_be_u32(shared_array_master, shared_pos + 4);
-                        if (data_end < data_off || data_end > byte_array.size()) {
-                            throw std::runtime_error("Bad bytes element bounds");
-                        }
-                        page.update(element_name, et, slice(byte_array, data_off, data_end));
-                        shared_pos += 8;
-                    }
-                    else {
-                        throw std::runtime_error("Unsupported element type");
-                    }
+                else if (c.occ == ElementOccurrence::RECURRING) {
+                    size_t pos = c.value_pos;
+                    v = read_value(c.type, pos, shared_end);
                 }
                 else {
-                    // NON_RECURRING: values come from unique_array sequentially.
-                    if (et == ElementType::I8) {
-                        page.update(element_name, et, int8_t(unique_array[unique_pos]));
-                        unique_pos += 1;
-                    }
-                    else if (et == ElementType::U8) {
-                        page.update(element_name, et, uint8_t(unique_array[unique_pos]));
-                        unique_pos += 1;
-                    }
-                    else if (et == ElementType::I16) {
-                        page.update(element_name, et,
-                            int16_t(read_be_i16(unique_array, unique_pos)));
-                        unique_pos += 2;
-                    }
-                    else if (et == ElementType::U16) {
-                        page.update(element_name, et,
-                            uint16_t(read_be_u16(unique_array, unique_pos)));
-                        unique_pos += 2;
-                    }
-                    else if (et == ElementType::I32) {
-                        page.update(element_name, et,
-                            int32_t(read_be_i32(unique_array, unique_pos)));
-                        unique_pos += 4;
-                    }
-                    else if (et == ElementType::U32) {
-                        page.update(element_name, et,
-                            uint32_t(read_be_u32(unique_array, unique_pos)));
-                        unique_pos += 4;
-                    }
-                    else if (et == ElementType::I64) {
-                        page.update(element_name, et,
-                            int64_t(read_be_i64(unique_array, unique_pos)));
-                        unique_pos += 8;
-                    }
-                    else if (et == ElementType::U64) {
-                        page.update(element_name, et,
-                            uint64_t(read_be_u64(unique_array, unique_pos)));
-                        unique_pos += 8;
-                    }
-                    else if (et == ElementType::F32) {
-                        Bytes raw = read_bytes(unique_array, unique_pos, 4);
-                        page.update(element_name, et, read_le_f32(raw.data()));
-                        unique_pos += 4;
-                    }
-                    else if (et == ElementType::STRING) {
-                        uint32_t str_off = read_be_u32(unique_array, unique_pos);
-                        page.update(element_name, et, read_cstring(string_array, str_off));
-                        unique_pos += 4;
-                    }
-                    else if (et == ElementType::BYTES) {
-                        uint32_t data_off = read_be_u32(unique_array, unique_pos);
-                        uint32_t data_end = read_be_u32(unique_array, unique_pos + 4);
-                        if (data_end < data_off || data_end > byte_array.size()) {
-                            throw std::runtime_error("Bad bytes element bounds");
-                        }
-                        page.update(element_name, et, slice(byte_array, data_off, data_end));
-                        unique_pos += 8;
-                    }
-                    else {
-                        throw std::runtime_error("Unsupported element type");
-                    }
+                    v = read_value(c.type, unique_pos, unique_end);
                 }
+                if (c.slot == filename_slot) normalize_filename(v);
+                page.set(c.slot, std::move(v));
             }
         }
 
@@ -279,7 +456,7 @@ namespace usm {
         int string_padding) {
         if (pages.empty()) return Bytes();
 
-        const std::string page_name = pages[0].name();
+        const std::pmr::string& page_name = pages[0].name();
         const auto& order = pages[0].key_order();
 
         for (const auto& p : pages) {
@@ -318,11 +495,10 @@ namespace usm {
         std::vector<bool> recurring(order.size(), false);
         if (pages.size() > 1) {
             for (size_t i = 0; i < order.size(); i++) {
-                const std::string& k = order[i];
-                const Element& first = pages[0].at(k);
+                const Element& first = pages[0].element(i);
                 bool all_same = true;
                 for (size_t p = 1; p < pages.size(); p++) {
-                    if (!element_equal(first, pages[p].at(k))) {
+                    if (!element_equal(first, pages[p].element(i))) {
                         all_same = false;
                         break;
                     }
@@ -339,8 +515,8 @@ namespace usm {
             const auto& page = pages[pi];
 
             for (size_t ki = 0; ki < order.size(); ki++) {
-                const std::string& key = order[ki];
-                const Element& el = page.at(key);
+                // Key orders match (checked above), so slots do too.
+                const Element& el = page.element(ki);
 
                 uint8_t type_packed = uint8_t(el.type);
 
@@ -381,14 +557,14 @@ namespace usm {
                         write_le_f32(cur, std::get<float>(el.val));
                     }
                     else if (el.type == ElementType::STRING) {
-                        const std::string& s = std::get<std::string>(el.val);
+                        const std::pmr::string& s = std::get<std::pmr::string>(el.val);
                         uint32_t off = uint32_t(string_array.size());
                         string_array.insert(string_array.end(), s.begin(), s.end());
                         string_array.push_back(0x00);
                         write_be_u32(cur, off);
                     }
                     else if (el.type == ElementType::BYTES) {
-                        const Bytes& bb = std::get<Bytes>(el.val);
+                        const PmrBytes& bb = std::get<PmrBytes>(el.val);
                         uint32_t off = uint32_t(byte_array.size());
                         uint32_t end = off + uint32_t(bb.size());
                         write_be_u32(cur, off);
@@ -441,14 +617,14 @@ namespace usm {
                         write_le_f32(cur, std::get<float>(el.val));
                     }
                     else if (el.type == ElementType::STRING) {
-                        const std::string& s = std::get<std::string>(el.val);
+                        const std::pmr::string& s = std::get<std::pmr::string>(el.val);
                         uint32_t off = uint32_t(string_array.size());
                         string_array.insert(string_array.end(), s.begin(), s.end());
                         string_array.push_back(0x00);
                         write_be_u32(cur, off);
                     }
                     else if (el.type == ElementType::BYTES) {
-                        const Bytes& bb = std::get<Bytes>(el.val);
+                        const PmrBytes& bb = std::get<PmrBytes>(el.val);
                         uint32_t off = uint32_t(byte_array.size());
                         uint32_t end = off + uint32_t(bb.size());
                         write_be_u32(cur, off);
@@ -518,16 +694,12 @@ namespace usm {
         std::vector<int> result;
         if (!seek_pages.has_value()) return result;
 
+        SeekBinding bind;
         for (const auto& seek : *seek_pages) {
             if (seek.name() != "VIDEO_SEEKINFO") {
                 throw std::runtime_error("Page name is not 'VIDEO_SEEKINFO'");
             }
-
-            const Element& el = seek.at("ofs_frmid");
-            if (el.type != ElementType::U32) {
-                throw std::runtime_error("ofs_frmid is not U32");
-            }
-            result.push_back(int(std::get<uint32_t>(el.val)));
+            result.push_back(int(bind(seek).get<fields::seek::ofs_frmid>()));
         }
 
         return result;
@@ -0,0 +1,91 @@
+#include "usm/reader.hpp"
+
+#include "usm/source.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace usm {
+
+    TrackReader::TrackReader(const Usm& usm, const Track& track,
+        std::optional<uint64_t> key_override, size_t cache_packets)
+        : track_(&track), source_(usm.source()),
+        keys_(keys_for(key_override.has_value() ? key_override : usm.key())),
+        capacity_(std::max<size_t>(1, cache_packets)) {
+        starts_.reserve(track.stream.size() + 1);
+        uint64_t acc = 0;
+        for (const auto& [off, sz] : track.stream) {
+            starts_.push_back(acc);
+            acc += sz;
+        }
+        starts_.push_back(acc);
+    }
+
+    uint64_t TrackReader::size() const { return starts_.back(); }
+
+    size_t TrackReader::packet_count() const { return starts_.size() - 1; }
+
+    uint64_t TrackReader::packet_start(size_t index) const { return starts_.at(index); }
+
+    size_t TrackReader::packet_at(uint64_t pos) const {
+        if (pos >= size()) throw std::runtime_error("Position past end of track");
+        auto it = std::upper_bound(starts_.begin(), starts_.end(), pos);
+        return size_t(it - starts_.begin()) - 1;
+    }
+
+    std::shared_ptr<const Bytes> TrackReader::packet(size_t index) const {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = cached_.find(index);
+            if (it != cached_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->second;
+            }
+        }
+
+        // Read and decrypt outside the lock so other packets are not held up.
+        const auto& [off, sz] = track_->stream.at(index);
+        auto buf = std::make_shared<Bytes>(sz);
+        source_->read_at(off, buf->data(), sz);
+        if (keys_.has_value()) decrypt_packet(buf->data(), sz, track_->chunk_type, *keys_);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cached_.find(index);
+        if (it != cached_.end()) return it->second->second;  // lost a race
+
+        lru_.emplace_front(index, buf);
+        cached_[index] = lru_.begin();
+        if (lru_.size() > capacity_) {
+            cached_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return buf;
+    }
+
+    size_t TrackReader::read(uint64_t pos, void* dst, size_t n) const {
+        if (pos >= size()) return 0;
+        n = size_t(std::min<uint64_t>(n, size() - pos));
+
+        auto* out = static_cast<uint8_t*>(dst);
+        size_t done = 0;
+        size_t i = packet_at(pos);
+        while (done < n) {
+            const size_t in_pkt = size_t(pos + done - starts_[i]);
+            const size_t take = std::min(n - done, size_t(starts_[i + 1] - starts_[i]) - in_pkt);
+
+            if (keys_.has_value()) {
+                std::shared_ptr<const Bytes> p = packet(i);
+                std::memcpy(out + done, p->data() + in_pkt, take);
+            }
+            else {
+                // Plain packets need no staging: read the slice straight in.
+                source_->read_at(track_->stream[i].first + in_pkt, out + done, take);
+            }
+            done += take;
+            i++;
+        }
+        return done;
+    }
+
+}  // namespace usm
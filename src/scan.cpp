@@ -0,0 +1,137 @@
+#include "usm/scan.hpp"
+
+#include "usm/types.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USM_SCAN_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace usm {
+
+    static uint32_t load_be32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) |
+            uint32_t(p[3]);
+    }
+
+    bool is_chunk_signature(const uint8_t* p) {
+        switch (load_be32(p)) {
+        case uint32_t(ChunkType::INFO):
+        case uint32_t(ChunkType::VIDEO):
+        case uint32_t(ChunkType::AUDIO):
+        case uint32_t(ChunkType::ALPHA):
+        case uint32_t(ChunkType::SUBTITLE):
+        case uint32_t(ChunkType::CUE):
+        case uint32_t(ChunkType::SFSH):
+        case uint32_t(ChunkType::AHX):
+        case uint32_t(ChunkType::USR):
+        case uint32_t(ChunkType::PST):
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Every signature starts with '@', 'C' or 'S'; only those bytes are
+    // looked at closely.
+    static bool is_signature_lead(uint8_t b) { return b == '@' || b == 'C' || b == 'S'; }
+
+    size_t find_chunk_signature_scalar(const uint8_t* data, size_t n) {
+        if (n < 4) return n;
+        for (size_t i = 0; i + 4 <= n; i++) {
+            if (is_signature_lead(data[i]) && is_chunk_signature(data + i)) return i;
+        }
+        return n;
+    }
+
+    size_t find_chunk_signature(const uint8_t* data, size_t n) {
+#if defined(USM_SCAN_SSE2)
+        if (n < 4) return n;
+        const __m128i at = _mm_set1_epi8('@');
+        const __m128i c = _mm_set1_epi8('C');
+        const __m128i s = _mm_set1_epi8('S');
+
+        // Stop while a full signature still fits after every lane.
+        size_t i = 0;
+        for (; i + 16 + 3 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            const __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, at),
+                _mm_cmpeq_epi8(v, c)), _mm_cmpeq_epi8(v, s));
+            unsigned mask = unsigned(_mm_movemask_epi8(hit));
+            while (mask != 0) {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long bit;
+                _BitScanForward(&bit, mask);
+#else
+                const unsigned bit = unsigned(__builtin_ctz(mask));
+#endif
+                if (is_chunk_signature(data + i + bit)) return i + bit;
+                mask &= mask - 1;
+            }
+        }
+        const size_t rest = find_chunk_signature_scalar(data + i, n - i);
+        return i + rest;
+#else
+        return find_chunk_signature_scalar(data, n);
+#endif
+    }
+
+    size_t find_fourcc_scalar(const uint8_t* data, size_t n, uint32_t fourcc) {
+        if (n < 4) return n;
+        for (size_t i = 0; i + 4 <= n; i++) {
+            if (load_be32(data + i) == fourcc) return i;
+        }
+        return n;
+    }
+
+    size_t find_fourcc(const uint8_t* data, size_t n, uint32_t fourcc) {
+#if defined(USM_SCAN_SSE2)
+        if (n < 4) return n;
+        const __m128i b0 = _mm_set1_epi8(char(fourcc >> 24));
+        const __m128i b1 = _mm_set1_epi8(char(fourcc >> 16));
+
+        // The second load reads one byte further; a full match must still fit.
+        size_t i = 0;
+        for (; i + 16 + 3 <= n; i += 16) {
+            const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+            const __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(v0, b0), _mm_cmpeq_epi8(v1, b1));
+            unsigned mask = unsigned(_mm_movemask_epi8(hit));
+            while (mask != 0) {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long bit;
+                _BitScanForward(&bit, mask);
+#else
+                const unsigned bit = unsigned(__builtin_ctz(mask));
+#endif
+                if (load_be32(data + i + bit) == fourcc) return i + bit;
+                mask &= mask - 1;
+            }
+        }
+        return i + find_fourcc_scalar(data + i, n - i, fourcc);
+#else
+        return find_fourcc_scalar(data, n, fourcc);
+#endif
+    }
+
+    uint64_t chunk_total_size(const uint8_t* header) {
+        return 0x8 + uint64_t(load_be32(header + 0x4));
+    }
+
+    bool plausible_chunk_header(const uint8_t* header, uint64_t remaining) {
+        if (!is_chunk_signature(header)) return false;
+
+        const uint32_t chunk_size = load_be32(header + 0x4);
+        const uint32_t payload_offset = header[0x9];
+        const uint32_t padding = (uint32_t(header[0xA]) << 8) | header[0xB];
+        // Chunks are walked as 0x20-byte header + payload + padding, which
+        // only adds up with the standard payload offset.
+        if (payload_offset != 0x18) return false;
+        if (uint64_t(payload_offset) + padding > chunk_size) return false;
+        return 0x8 + uint64_t(chunk_size) <= remaining;
+    }
+
+}  // namespace usm
@@ -0,0 +1,637 @@
+#include "usm/serve.hpp"
+
+#include "usm/hash.hpp"
+#include "usm/media.hpp"
+#include "usm/output.hpp"
+#include "usm/usm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace usm {
+
+    namespace {
+
+        // A request line longer than this closes the connection.
+        constexpr size_t kMaxRequest = 1 << 20;
+
+        // One client; replies from several workers go out whole under the
+        // mutex. Writes after the client hung up are dropped.
+        struct Connection {
+            explicit Connection(int fd) : file(fd) {}
+
+            void send_line(const Json& reply) {
+#ifndef _WIN32
+                const std::string line = reply.dump() + "\n";
+#ifdef MSG_NOSIGNAL
+                constexpr int flags = MSG_NOSIGNAL;
+#else
+                constexpr int flags = 0;
+#endif
+                std::lock_guard<std::mutex> lock(write_mutex);
+                size_t done = 0;
+                while (done < line.size()) {
+                    const ssize_t n = ::send(file.fd(), line.data() + done, line.size() - done,
+                        flags);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) return;
+                    done += size_t(n);
+                }
+#else
+                (void)reply;
+#endif
+            }
+
+            FileHandle file;
+            std::mutex write_mutex;
+        };
+
+        struct Job {
+            std::shared_ptr<Connection> conn;
+            Json request;
+        };
+
+        struct CacheKey {
+            std::string path;
+            std::optional<uint64_t> key;
+            HashAlgorithm hash = HashAlgorithm::NONE;
+
+            bool operator==(const CacheKey& other) const {
+                return path == other.path && key == other.key && hash == other.hash;
+            }
+        };
+
+        struct CacheEntry {
+            CacheKey key;
+            uint64_t size = 0;
+            std::filesystem::file_time_type mtime;
+            std::shared_ptr<const Usm> usm;
+        };
+
+        const char* track_kind_name(ChunkType type) {
+            if (type == ChunkType::AUDIO) return "audio";
+            if (type == ChunkType::ALPHA) return "alpha";
+            return "video";
+        }
+
+        std::string op_of(const Json& request) {
+            const Json* op = request.find("op");
+            const std::string* s = op != nullptr ? op->as_string() : nullptr;
+            return s != nullptr ? *s : std::string();
+        }
+
+        std::string required_string(const Json& request, const char* name) {
+            const Json* v = request.find(name);
+            const std::string* s = v != nullptr ? v->as_string() : nullptr;
+            if (s == nullptr || s->empty()) {
+                throw std::runtime_error(std::string("Missing string \"") + name + "\"");
+            }
+            return *s;
+        }
+
+        std::optional<uint64_t> optional_u64(const Json& request, const char* name) {
+            const Json* v = request.find(name);
+            if (v == nullptr || v->is_null()) return std::nullopt;
+            auto u = v->as_u64();
+            if (!u.has_value()) {
+                throw std::runtime_error(std::string("\"") + name +
+                    "\" must be a non-negative integer or a decimal string");
+            }
+            return u;
+        }
+
+        bool optional_bool(const Json& request, const char* name, bool fallback) {
+            const Json* v = request.find(name);
+            if (v == nullptr || v->is_null()) return fallback;
+            auto b = v->as_bool();
+            if (!b.has_value()) {
+                throw std::runtime_error(std::string("\"") + name + "\" must be a boolean");
+            }
+            return *b;
+        }
+
+        HashAlgorithm optional_hash(const Json& request) {
+            const Json* v = request.find("hash");
+            if (v == nullptr || v->is_null()) return HashAlgorithm::NONE;
+            const std::string* s = v->as_string();
+            auto algo = s != nullptr ? hash_algorithm_from_string(*s) : std::nullopt;
+            if (!algo.has_value()) throw std::runtime_error("Unknown hash algorithm");
+            return *algo;
+        }
+
+        Json error_reply(const Json& request, const std::string& message) {
+            Json reply;
+            if (const Json* id = request.find("id")) reply["id"] = *id;
+            reply["ok"] = false;
+            reply["error"] = message;
+            return reply;
+        }
+
+        Json track_list(const Usm& usm) {
+            Json::Array tracks;
+            for (const auto* list : { &usm.videos(), &usm.audios(), &usm.alphas() }) {
+                for (const Track& t : *list) {
+                    Json track;
+                    track["type"] = track_kind_name(t.chunk_type);
+                    track["channel"] = t.channel_number;
+                    if (const Element* e = t.crid.find("filename")) {
+                        if (auto* s = std::get_if<std::pmr::string>(&e->val)) {
+                            track["filename"] = std::string(*s);
+                        }
+                    }
+                    track["packets"] = uint64_t(t.stream.size());
+                    track["bytes"] = t.stream.total_bytes();
+                    tracks.push_back(std::move(track));
+                }
+            }
+            return Json(std::move(tracks));
+        }
+
+    }  // namespace
+
+    Json ServeMetrics::to_json() const {
+        Json out;
+        out["queued"] = uint64_t(queued);
+        out["running"] = uint64_t(running);
+        out["completed"] = completed;
+        out["failed"] = failed;
+        out["rejected"] = rejected;
+        out["bytes_written"] = bytes_written;
+        out["cache_hits"] = cache_hits;
+        out["cache_misses"] = cache_misses;
+        out["uptime"] = uptime;
+        out["jobs_per_second"] = jobs_per_second;
+        out["bytes_per_second"] = bytes_per_second;
+        return out;
+    }
+
+    struct JobServer::State {
+        explicit State(ServeOptions o) : options(std::move(o)) {}
+
+        ServeOptions options;
+        const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+        // Declared before the cache: the cached Usm objects give their pages
+        // and indexes back to it when evicted.
+        std::pmr::synchronized_pool_resource pool;
+
+        std::mutex cache_mutex;
+        std::list<CacheEntry> cache;  // most recently used first
+
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::deque<Job> queue;
+        bool draining = false;  // under queue_mutex; set once run() is leaving
+
+        std::atomic<bool> stop_requested{ false };
+        FileHandle wake_read;  // readable once stop() was called
+        FileHandle wake_write;
+
+        std::atomic<size_t> running{ 0 };
+        std::atomic<uint64_t> completed{ 0 };
+        std::atomic<uint64_t> failed{ 0 };
+        std::atomic<uint64_t> rejected{ 0 };
+        std::atomic<uint64_t> bytes_written{ 0 };
+        std::atomic<uint64_t> cache_hits{ 0 };
+        std::atomic<uint64_t> cache_misses{ 0 };
+
+        std::shared_ptr<const Usm> open(const std::filesystem::path& path,
+            std::optional<uint64_t> key, HashAlgorithm hash);
+        Json run_job(const std::string& op, const Json& request);
+        Json handle(const Json& request, JobServer& server);
+        ServeMetrics metrics();
+        void submit(const std::shared_ptr<Connection>& conn, const std::string& line,
+            JobServer& server);
+        void work(JobServer& server);
+        void serve_client(int fd, JobServer& server);
+    };
+
+    // Reopening is what a new process would pay: the chunk scan, page
+    // parsing and ICU filename normalization. A changed size or mtime means
+    // the file was rewritten, so the entry is dropped.
+    std::shared_ptr<const Usm> JobServer::State::open(const std::filesystem::path& path,
+        std::optional<uint64_t> key, HashAlgorithm hash) {
+        CacheKey ck{ std::filesystem::absolute(path).lexically_normal().string(), key, hash };
+        const uint64_t size = std::filesystem::file_size(path);
+        const auto mtime = std::filesystem::last_write_time(path);
+
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            for (auto it = cache.begin(); it != cache.end(); ++it) {
+                if (!(it->key == ck)) continue;
+                if (it->size == size && it->mtime == mtime) {
+                    cache.splice(cache.begin(), cache, it);
+                    cache_hits++;
+                    return cache.front().usm;
+                }
+                cache.erase(it);
+                break;
+            }
+        }
+
+        cache_misses++;
+        OpenOptions options;
+        options.key = key;
+        options.mr = &pool;
+        options.packet_hash = hash;
+        auto usm = std::make_shared<const Usm>(Usm::open(path, options));
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if (it->key == ck) {
+                cache.erase(it);
+                break;
+            }
+        }
+        if (this->options.cache_entries > 0) {
+            cache.push_front(CacheEntry{ std::move(ck), size, mtime, usm });
+            while (cache.size() > this->options.cache_entries) cache.pop_back();
+        }
+        return usm;
+    }
+
+    Json JobServer::State::run_job(const std::string& op, const Json& request) {
+        const std::filesystem::path path = required_string(request, "path");
+        const std::optional<uint64_t> key = optional_u64(request, "key");
+
+        if (op == "info") {
+            auto usm = open(path, key, HashAlgorithm::NONE);
+            Json result;
+            if (auto version = usm->version()) result["version"] = *version;
+            result["tracks"] = track_list(*usm);
+            return result;
+        }
+
+        if (op == "index") {
+            const HashAlgorithm hash = optional_hash(request);
+            if (hash == HashAlgorithm::NONE) throw std::runtime_error("index needs \"hash\"");
+            const bool list = optional_bool(request, "packet_hashes", false);
+            auto usm = open(path, key, hash);
+
+            Json::Array tracks;
+            for (const auto* group : { &usm->videos(), &usm->audios(), &usm->alphas() }) {
+                for (const Track& t : *group) {
+                    // The digest is taken over the packet hashes as 8-byte
+                    // little-endian values, in packet order.
+                    Hasher digest(hash);
+                    Json::Array packets;
+                    for (uint64_t h : t.packet_hashes) {
+                        uint8_t le[8];
+                        for (int i = 0; i < 8; i++) le[i] = uint8_t(h >> (8 * i));
+                        digest.update(le, sizeof(le));
+                        if (list) packets.push_back(hash_hex(h, hash));
+                    }
+                    Json track;
+                    track["type"] = track_kind_name(t.chunk_type);
+                    track["channel"] = t.channel_number;
+                    track["packets"] = uint64_t(t.packet_hashes.size());
+                    track["digest"] = digest.hex();
+                    if (list) track["packet_hashes"] = Json(std::move(packets));
+                    tracks.push_back(std::move(track));
+                }
+            }
+            Json result;
+            result["hash"] = hash_algorithm_name(hash);
+            result["tracks"] = Json(std::move(tracks));
+            return result;
+        }
+
+        if (op == "demux") {
+            DemuxOptions options;
+            options.video = optional_bool(request, "video", true);
+            options.audio = optional_bool(request, "audio", true);
+            options.alpha = optional_bool(request, "alpha", true);
+            options.hca_key = optional_u64(request, "hca_key");
+            options.hash = optional_hash(request);
+            options.incremental = optional_bool(request, "incremental", false);
+            auto usm = open(path, key, HashAlgorithm::NONE);
+
+            Json::Array outputs;
+            for (const DemuxedTrack& t : usm->demux(required_string(request, "out"), options)) {
+                if (!t.skipped) bytes_written += t.size - t.resumed_at;
+                Json track;
+                track["type"] = track_kind_name(t.chunk_type);
+                track["channel"] = t.channel_number;
+                track["path"] = t.path.string();
+                track["size"] = t.size;
+                if (!t.hash.empty()) track["hash"] = t.hash;
+                if (t.skipped) track["skipped"] = true;
+                if (t.resumed_at > 0) track["resumed_at"] = t.resumed_at;
+                outputs.push_back(std::move(track));
+            }
+            Json result;
+            result["outputs"] = Json(std::move(outputs));
+            return result;
+        }
+
+        if (op == "remux") {
+            RemuxOptions options;
+            options.video = optional_bool(request, "video", true);
+            options.audio = optional_bool(request, "audio", true);
+            options.alpha = optional_bool(request, "alpha", true);
+            if (const Json* format = request.find("format")) {
+                if (const std::string* s = format->as_string()) options.format = *s;
+            }
+            auto usm = open(path, key, HashAlgorithm::NONE);
+
+            const std::filesystem::path out = required_string(request, "out");
+            remux(*usm, out, options);
+            const uint64_t size = std::filesystem::file_size(out);
+            bytes_written += size;
+            Json result;
+            result["path"] = out.string();
+            result["size"] = size;
+            return result;
+        }
+
+        throw std::runtime_error("Unknown op \"" + op + "\"");
+    }
+
+    Json JobServer::State::handle(const Json& request, JobServer& server) {
+        const std::string op = op_of(request);
+        Json reply;
+        if (const Json* id = request.find("id")) reply["id"] = *id;
+
+        if (op == "metrics") {
+            reply["ok"] = true;
+            reply["result"] = metrics().to_json();
+            return reply;
+        }
+        if (op == "shutdown") {
+            server.stop();
+            reply["ok"] = true;
+            reply["result"] = Json(Json::Object{});
+            return reply;
+        }
+
+        running++;
+        try {
+            reply["result"] = run_job(op, request);
+            reply["ok"] = true;
+            completed++;
+        }
+        catch (const std::exception& ex) {
+            reply = error_reply(request, ex.what());
+            failed++;
+        }
+        running--;
+        return reply;
+    }
+
+    ServeMetrics JobServer::State::metrics() {
+        ServeMetrics m;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            m.queued = queue.size();
+        }
+        m.running = running;
+        m.completed = completed;
+        m.failed = failed;
+        m.rejected = rejected;
+        m.bytes_written = bytes_written;
+        m.cache_hits = cache_hits;
+        m.cache_misses = cache_misses;
+        m.uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started)
+            .count();
+        if (m.uptime > 0.0) {
+            m.jobs_per_second = double(m.completed + m.failed) / m.uptime;
+            m.bytes_per_second = double(m.bytes_written) / m.uptime;
+        }
+        return m;
+    }
+
+    void JobServer::State::submit(const std::shared_ptr<Connection>& conn,
+        const std::string& line, JobServer& server) {
+        Json request;
+        try {
+            request = Json::parse(line);
+        }
+        catch (const std::exception& ex) {
+            conn->send_line(error_reply(Json(), ex.what()));
+            return;
+        }
+        if (!request.is_object()) {
+            conn->send_line(error_reply(Json(), "Request must be a JSON object"));
+            return;
+        }
+
+        const std::string op = op_of(request);
+        if (op == "metrics" || op == "shutdown") {
+            conn->send_line(handle(request, server));
+            return;
+        }
+
+        const char* refused = "Queue full";
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (draining) {
+                refused = "Server shutting down";
+            }
+            else if (queue.size() < options.max_queue) {
+                queue.push_back(Job{ conn, std::move(request) });
+                queue_cv.notify_one();
+                return;
+            }
+        }
+        rejected++;
+        conn->send_line(error_reply(request, refused));
+    }
+
+    void JobServer::State::work(JobServer& server) {
+        while (true) {
+            Job job;
+            bool cancelled = false;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [&] { return draining || !queue.empty(); });
+                if (queue.empty()) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+                cancelled = draining;
+            }
+            if (cancelled) {
+                job.conn->send_line(error_reply(job.request, "Server shutting down"));
+                continue;
+            }
+            job.conn->send_line(handle(job.request, server));
+        }
+    }
+
+#ifndef _WIN32
+    void JobServer::State::serve_client(int fd, JobServer& server) {
+        auto conn = std::make_shared<Connection>(fd);
+        std::string buffer;
+        char chunk[4096];
+        while (true) {
+            pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_read.fd(), POLLIN, 0 } };
+            if (::poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[1].revents != 0) return;
+
+            const ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            buffer.append(chunk, size_t(n));
+
+            size_t start = 0;
+            for (size_t nl; (nl = buffer.find('\n', start)) != std::string::npos;
+                start = nl + 1) {
+                std::string line = buffer.substr(start, nl - start);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (!line.empty()) submit(conn, line, server);
+            }
+            buffer.erase(0, start);
+            if (buffer.size() > kMaxRequest) {
+                conn->send_line(error_reply(Json(), "Request too long"));
+                return;
+            }
+        }
+    }
+#endif
+
+    JobServer::JobServer(ServeOptions options)
+        : state_(std::make_unique<State>(std::move(options))) {
+#ifndef _WIN32
+        int fds[2];
+        if (::pipe(fds) != 0) {
+            throw std::system_error(errno, std::generic_category(), "pipe");
+        }
+        state_->wake_read = FileHandle(fds[0]);
+        state_->wake_write = FileHandle(fds[1]);
+        ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+    }
+
+    JobServer::~JobServer() = default;
+
+    void JobServer::stop() {
+        if (state_->stop_requested.exchange(true)) return;
+#ifndef _WIN32
+        const char c = 1;
+        (void)!::write(state_->wake_write.fd(), &c, 1);
+#endif
+    }
+
+    std::string JobServer::execute(const std::string& request) {
+        Json parsed;
+        try {
+            parsed = Json::parse(request);
+        }
+        catch (const std::exception& ex) {
+            return error_reply(Json(), ex.what()).dump();
+        }
+        return state_->handle(parsed, *this).dump();
+    }
+
+    ServeMetrics JobServer::metrics() const { return state_->metrics(); }
+
+    void JobServer::run() {
+#ifdef _WIN32
+        throw std::runtime_error("usmtool serve needs Unix domain sockets");
+#else
+        State& s = *state_;
+        const std::string socket_path = s.options.socket.string();
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Bad socket path: " + socket_path);
+        }
+        socket_path.copy(addr.sun_path, socket_path.size());
+
+        FileHandle listener(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!listener) throw std::system_error(errno, std::generic_category(), "socket");
+        ::fcntl(listener.fd(), F_SETFD, FD_CLOEXEC);
+
+        // A socket left behind by a previous run is replaced; any other file
+        // at the path is not.
+        struct stat st;
+        if (::lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            ::unlink(socket_path.c_str());
+        }
+        if (::bind(listener.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+            throw std::system_error(errno, std::generic_category(), "bind " + socket_path);
+        }
+        if (::listen(listener.fd(), SOMAXCONN) != 0) {
+            const int err = errno;
+            ::unlink(socket_path.c_str());
+            throw std::system_error(err, std::generic_category(), "listen");
+        }
+
+        unsigned jobs = s.options.jobs;
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < jobs; t++) workers.emplace_back([&] { s.work(*this); });
+
+        struct Client {
+            std::thread thread;
+            std::shared_ptr<std::atomic<bool>> done;
+        };
+        std::list<Client> clients;
+
+        while (!s.stop_requested) {
+            pollfd fds[2] = { { listener.fd(), POLLIN, 0 }, { s.wake_read.fd(), POLLIN, 0 } };
+            if (::poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents != 0) break;
+            if ((fds[0].revents & POLLIN) == 0) continue;
+
+            const int fd = ::accept(listener.fd(), nullptr, nullptr);
+            if (fd < 0) continue;
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+            for (auto it = clients.begin(); it != clients.end();) {
+                if (*it->done) {
+                    it->thread.join();
+                    it = clients.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            auto done = std::make_shared<std::atomic<bool>>(false);
+            clients.push_back(Client{ std::thread([&s, this, fd, done] {
+                s.serve_client(fd, *this);
+                *done = true;
+                }), done });
+        }
+
+        ::unlink(socket_path.c_str());
+        {
+            std::lock_guard<std::mutex> lock(s.queue_mutex);
+            s.draining = true;
+        }
+        s.queue_cv.notify_all();
+        for (auto& w : workers) w.join();
+        for (auto& c : clients) c.thread.join();
+#endif
+    }
+
+}  // namespace usm
@@ -0,0 +1,174 @@
+#include "usm/source.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace usm {
+
+    static void check_range(uint64_t size, uint64_t offset, size_t n) {
+        if (offset > size || n > size - offset) {
+            throw std::runtime_error("Read past end of source");
+        }
+    }
+
+    FileSource::FileSource(const std::filesystem::path& path)
+        : path_(path), file_(FileHandle::open_read(path)),
+        size_(std::filesystem::file_size(path)) {
+    }
+
+    uint64_t FileSource::size() const { return size_; }
+
+    void FileSource::read_at(uint64_t offset, void* dst, size_t n) const {
+        check_range(size_, offset, n);
+#ifdef _WIN32
+        std::lock_guard<std::mutex> lock(mutex_);
+#endif
+        pread_all(file_.fd(), offset, dst, n);
+    }
+
+    std::optional<NativeFile> FileSource::native_file() const {
+        return NativeFile{ file_.fd(), 0 };
+    }
+
+    std::string FileSource::name() const { return path_.string(); }
+
+    MmapSource::MmapSource(const std::filesystem::path& path)
+        : path_(path), size_(std::filesystem::file_size(path)) {
+        if (size_ == 0) return;
+#ifdef _WIN32
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping_ == nullptr) throw std::runtime_error("CreateFileMapping failed");
+        data_ = static_cast<const uint8_t*>(
+            MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (data_ == nullptr) {
+            CloseHandle(mapping_);
+            throw std::runtime_error("MapViewOfFile failed");
+        }
+#else
+        FileHandle f = FileHandle::open_read(path);
+        void* p = ::mmap(nullptr, size_t(size_), PROT_READ, MAP_SHARED, f.fd(), 0);
+        if (p == MAP_FAILED) throw std::runtime_error("mmap failed: " + path.string());
+        ::madvise(p, size_t(size_), MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t*>(p);
+#endif
+    }
+
+    MmapSource::~MmapSource() {
+        if (data_ == nullptr) return;
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+#else
+        ::munmap(const_cast<uint8_t*>(data_), size_t(size_));
+#endif
+    }
+
+    uint64_t MmapSource::size() const { return size_; }
+
+    void MmapSource::read_at(uint64_t offset, void* dst, size_t n) const {
+        check_range(size_, offset, n);
+        std::memcpy(dst, data_ + offset, n);
+    }
+
+    const uint8_t* MmapSource::data() const { return data_; }
+
+    std::string MmapSource::name() const { return path_.string(); }
+
+    MemorySource::MemorySource(const uint8_t* data, size_t size, std::string name)
+        : data_(data), size_(size), name_(std::move(name)) {
+    }
+
+    MemorySource::MemorySource(Bytes data, std::string name)
+        : owned_(std::move(data)), name_(std::move(name)) {
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    uint64_t MemorySource::size() const { return size_; }
+
+    void MemorySource::read_at(uint64_t offset, void* dst, size_t n) const {
+        check_range(size_, offset, n);
+        std::memcpy(dst, data_ + offset, n);
+    }
+
+    const uint8_t* MemorySource::data() const { return data_; }
+
+    std::string MemorySource::name() const { return name_; }
+
+    SubrangeSource::SubrangeSource(std::shared_ptr<const ByteSource> parent,
+        uint64_t offset, uint64_t size, std::string name)
+        : parent_(std::move(parent)), offset_(offset), size_(size), name_(std::move(name)) {
+        if (parent_ == nullptr) throw std::runtime_error("Null parent source");
+        check_range(parent_->size(), offset_, size_t(size_));
+    }
+
+    uint64_t SubrangeSource::size() const { return size_; }
+
+    void SubrangeSource::read_at(uint64_t offset, void* dst, size_t n) const {
+        check_range(size_, offset, n);
+        parent_->read_at(offset_ + offset, dst, n);
+    }
+
+    const uint8_t* SubrangeSource::data() const {
+        const uint8_t* p = parent_->data();
+        return p == nullptr ? nullptr : p + offset_;
+    }
+
+    std::optional<NativeFile> SubrangeSource::native_file() const {
+        auto f = parent_->native_file();
+        if (f.has_value()) f->offset += offset_;
+        return f;
+    }
+
+    std::string SubrangeSource::name() const {
+        return name_.empty() ? parent_->name() : name_;
+    }
+
+    SourceReader::SourceReader(const ByteSource& source, size_t window)
+        : source_(source), direct_(source.data()) {
+        if (direct_ == nullptr) window_.resize(window);
+    }
+
+    const uint8_t* SourceReader::view(uint64_t offset, size_t n) {
+        check_range(source_.size(), offset, n);
+        if (direct_ != nullptr) return direct_ + offset;
+        if (n > window_.size()) throw std::runtime_error("View larger than reader window");
+
+        if (offset < window_offset_ || offset + n > window_offset_ + window_size_) {
+            window_offset_ = offset;
+            window_size_ = size_t(std::min<uint64_t>(window_.size(), source_.size() - offset));
+            source_.read_at(window_offset_, window_.data(), window_size_);
+        }
+        return window_.data() + (offset - window_offset_);
+    }
+
+    size_t SourceReader::max_view() const {
+        return direct_ != nullptr ? SIZE_MAX : window_.size();
+    }
+
+    const uint8_t* SourceReader::view(uint64_t offset, size_t n, Bytes& spill) {
+        if (direct_ != nullptr || n <= window_.size()) return view(offset, n);
+        spill.resize(n);
+        source_.read_at(offset, spill.data(), n);
+        return spill.data();
+    }
+
+}  // namespace usm
@@ -3,6 +3,7 @@
 #include "usm/tools.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cctype>
 #include <iomanip>
 #include <sstream>
@@ -108,14 +109,20 @@ namespace usm {
     }
 
     Bytes decrypt_video_packet(const Bytes& packet, const Bytes& video_key) {
+        Bytes data = packet;
+        decrypt_video_packet(data.data(), data.size(), video_key);
+        return data;
+    }
+
+    void decrypt_video_packet(uint8_t* data, size_t size, const Bytes& video_key) {
         if (video_key.size() < 0x40) {
             throw std::runtime_error("Video key should be 0x40 bytes");
         }
 
-        Bytes data = packet;
-        int encrypted_part_size = int(data.size()) - 0x40;
+        int encrypted_part_size = int(size) - 0x40;
         if (encrypted_part_size >= 0x200) {
-            Bytes rolling = video_key;
+            std::array<uint8_t, 0x40> rolling;
+            std::copy_n(video_key.begin(), 0x40, rolling.begin());
 
             for (int i = 0x100; i < encrypted_part_size; i++) {
                 data[0x40 + i] ^= rolling[0x20 + (i % 0x20)];
@@ -128,8 +135,6 @@ namespace usm {
                 data[0x40 + i] ^= rolling[i % 0x20];
             }
         }
-
-        return data;
     }
 
     Bytes encrypt_video_packet(const Bytes& packet, const Bytes& video_key) {
@@ -159,17 +164,21 @@ namespace usm {
     }
 
     Bytes crypt_audio_packet(const Bytes& packet, const Bytes& audio_key) {
+        Bytes data = packet;
+        crypt_audio_packet(data.data(), data.size(), audio_key);
+        return data;
+    }
+
+    void crypt_audio_packet(uint8_t* data, size_t size, const Bytes& audio_key) {
         if (audio_key.size() < 0x20) {
             throw std::runtime_error("Audio key should be 0x20 bytes");
         }
 
-        Bytes data = packet;
-        if (data.size() > 0x140) {
-            for (size_t i = 0x140; i < data.size(); i++) {
+        if (size > 0x140) {
+            for (size_t i = 0x140; i < size; i++) {
                 data[i] ^= audio_key[i % 0x20];
             }
         }
-        return data;
     }
 
     static std::string icu_to_utf8(const icu::UnicodeString& u) {
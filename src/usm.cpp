@@ -3,70 +3,78 @@
 #include "usm/usm.hpp"
 
 #include "usm/chunk.hpp"
+#include "usm/hca.hpp"
+#include "usm/json.hpp"
+#include "usm/output.hpp"
+#include "usm/scan.hpp"
+#include "usm/schema.hpp"
+#include "usm/source.hpp"
 #include "usm/tools.hpp"
 #include "usm/types.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <iterator>
 #include <stdexcept>
+#include <thread>
 
 namespace usm {
 
-    static int16_t get_i16(const UsmPage& p, const std::string& k) {
-        const Element& e = p.at(k);
-        if (e.type != ElementType::I16) {
-            throw std::runtime_error(k + " is not I16");
-        }
-        return std::get<int16_t>(e.val);
+    std::optional<Keys> keys_for(std::optional<uint64_t> key) {
+        if (!key.has_value()) return std::nullopt;
+        auto [vk, ak] = generate_keys(*key);
+        return Keys{ std::move(vk), std::move(ak) };
     }
 
-    static int32_t get_i32(const UsmPage& p, const std::string& k) {
-        const Element& e = p.at(k);
-        if (e.type != ElementType::I32) {
-            throw std::runtime_error(k + " is not I32");
-        }
-        return std::get<int32_t>(e.val);
+    Bytes decrypt_packet(const Bytes& packet, ChunkType type, const Keys& keys) {
+        Bytes data = packet;
+        decrypt_packet(data.data(), data.size(), type, keys);
+        return data;
     }
 
-    static std::string get_str(const UsmPage& p, const std::string& k) {
-        const Element& e = p.at(k);
-        if (e.type != ElementType::STRING) {
-            throw std::runtime_error(k + " is not STRING");
+    void decrypt_packet(uint8_t* data, size_t size, ChunkType type, const Keys& keys) {
+        if (type == ChunkType::VIDEO || type == ChunkType::ALPHA) {
+            decrypt_video_packet(data, size, keys.video);
+        }
+        else if (type == ChunkType::AUDIO) {
+            crypt_audio_packet(data, size, keys.audio);
         }
-        return std::get<std::string>(e.val);
     }
 
+    // Per-channel state while scanning; everything comes from the open's
+    // memory resource.
     struct ChannelAccum {
-        std::vector<std::pair<uint64_t, uint32_t>> stream;
-        UsmPage header{ "" };
+        using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+        explicit ChannelAccum(allocator_type alloc)
+            : stream(alloc), packet_hashes(alloc), header("", alloc) {
+        }
+
+        PacketIndex stream;
+        std::pmr::vector<uint64_t> packet_hashes;
+        UsmPage header;
         std::optional<std::vector<UsmPage>> metadata;
     };
 
-    static void chunk_helper(std::unordered_map<int, ChannelAccum>& dst,
-        const UsmChunk& c, uint64_t chunk_file_offset) {
+    using ChannelMap = std::pmr::unordered_map<int, ChannelAccum>;
+
+    static void chunk_helper(ChannelMap& dst, UsmChunk& c) {
         auto& ch = dst[c.channel_number];
 
-        if (c.payload_type == PayloadType::STREAM) {
-            if (!std::holds_alternative<Bytes>(c.payload)) {
-                throw std::runtime_error("STREAM payload unexpectedly pages");
-            }
-            const auto& payload = std::get<Bytes>(c.payload);
-            ch.stream.push_back(
-                { chunk_file_offset + uint64_t(c.payload_offset), uint32_t(payload.size()) });
-        }
-        else if (c.payload_type == PayloadType::HEADER) {
+        if (c.payload_type == PayloadType::HEADER) {
             if (!std::holds_alternative<std::vector<UsmPage>>(c.payload)) {
                 throw std::runtime_error("HEADER payload is not pages");
             }
-            const auto& pages = std::get<std::vector<UsmPage>>(c.payload);
+            auto& pages = std::get<std::vector<UsmPage>>(c.payload);
             if (pages.empty()) throw std::runtime_error("Empty HEADER pages");
-            ch.header = pages[0];
+            ch.header = std::move(pages[0]);
         }
         else if (c.payload_type == PayloadType::METADATA) {
             if (!std::holds_alternative<std::vector<UsmPage>>(c.payload)) {
                 throw std::runtime_error("METADATA payload is not pages");
             }
-            ch.metadata = std::get<std::vector<UsmPage>>(c.payload);
+            ch.metadata = std::move(std::get<std::vector<UsmPage>>(c.payload));
         }
         else if (c.payload_type == PayloadType::SECTION_END) {
             // ignore
@@ -76,120 +84,432 @@ namespace usm {
         }
     }
 
-    Usm Usm::open(const std::filesystem::path& path, std::optional<uint64_t> key,
-        const std::string& encoding) {
-        if (!std::filesystem::exists(path)) {
-            throw std::runtime_error("File not found");
-        }
+    // Payloads of at least this size are moved in the kernel one by one.
+    // Smaller ones are gathered instead: the 0x20-byte chunk header in front
+    // of every payload means no two are ever adjacent in the file, so a
+    // kernel copy per packet would cost one syscall per packet.
+    constexpr uint64_t kKernelCopyMin = uint64_t(256) << 10;
+    // A gathered read spans the headers and padding between payloads, but
+    // not more than this of other chunks (e.g. another track's packets).
+    constexpr uint64_t kGatherGap = 4096;
+    constexpr size_t kGatherBatch = size_t(4) << 20;
+
+    // Copies a keyless track to `out_fd`. Large payloads go through the
+    // kernel (copy_file_range, sendfile or splice; see kernel_copy). Runs of
+    // small ones are read with one pread per run of nearby chunks and
+    // written with one writev per batch. Returns false, having written
+    // nothing, when the source is not file-backed or the kernel cannot
+    // handle this pair of descriptors.
+    static bool kernel_copy_track(const ByteSource& source, const Track& t, int out_fd) {
+        const std::optional<NativeFile> in = source.native_file();
+        if (!in.has_value()) return false;
+
+        const bool pipe = is_pipe(out_fd);
+        bool kernel = true;
+        bool wrote = false;
+
+        Bytes batch;
+        batch.reserve(kGatherBatch);
+        std::vector<std::pair<size_t, size_t>> parts;  // (offset in batch, size)
+        std::vector<std::pair<const uint8_t*, size_t>> gather;
+        auto flush = [&]() {
+                gather.clear();
+                for (const auto& [at, n] : parts) gather.push_back({ batch.data() + at, n });
+                write_gather(out_fd, gather);
+                wrote = wrote || !parts.empty();
+                parts.clear();
+                batch.clear();
+            };
 
-        uint64_t filesize = std::filesystem::file_size(path);
-        if (filesize <= 0x20) throw std::runtime_error("File too small");
+        // Start and end in the file of the run being gathered into `batch`.
+        uint64_t run_start = 0;
+        uint64_t run_end = 0;
+        auto read_run = [&]() {
+                if (run_end == run_start) return;
+                const size_t at = batch.size() - size_t(run_end - run_start);
+                source.read_at(run_start, batch.data() + at, size_t(run_end - run_start));
+                run_start = run_end;
+            };
 
-        std::ifstream f(path, std::ios::binary);
-        if (!f) throw std::runtime_error("Failed to open file");
+        for (const auto& [off, sz] : t.stream) {
+            if (sz < kKernelCopyMin) {
+                if (run_end != run_start &&
+                    (off < run_end || off - run_end > kGatherGap ||
+                        batch.size() + (off - run_end) + sz > kGatherBatch)) {
+                    read_run();
+                    if (batch.size() >= kGatherBatch / 2) flush();
+                }
+                if (run_end == run_start) run_start = run_end = off;
+                batch.resize(batch.size() + size_t(off + sz - run_end));
+                parts.push_back({ batch.size() - sz, sz });
+                run_end = off + sz;
+                continue;
+            }
 
-        Bytes magic(4);
-        f.read(reinterpret_cast<char*>(magic.data()), 4);
-        if (!f) throw std::runtime_error("Failed to read magic");
-        if (!is_usm_magic(magic)) {
-            throw std::runtime_error("Invalid file signature: " + bytes_to_hex(magic));
+            read_run();
+            flush();
+            if (kernel && kernel_copy(in->fd, in->offset + off, size_t(sz), out_fd, pipe)) {
+                wrote = true;
+                continue;
+            }
+            if (!wrote) return false;
+
+            // Refused part way through: copy the rest in user space.
+            kernel = false;
+            for (uint64_t done = 0; done < sz;) {
+                const size_t n = size_t(std::min<uint64_t>(sz - done, 1 << 20));
+                batch.resize(n);
+                source.read_at(off + done, batch.data(), n);
+                write_all(out_fd, batch.data(), n);
+                done += n;
+            }
+            batch.clear();
         }
+        read_run();
+        flush();
+        return true;
+    }
 
-        std::vector<UsmPage> crids;
-        std::unordered_map<int, ChannelAccum> video_ch;
-        std::unordered_map<int, ChannelAccum> audio_ch;
-        std::unordered_map<int, ChannelAccum> alpha_ch;
+    static uint64_t chunk_end(const uint8_t* header, uint64_t offset) {
+        return offset + chunk_total_size(header);
+    }
 
-        f.seekg(0, std::ios::beg);
+    // In recovery mode a chunk is only trusted if its header is plausible
+    // and another chunk signature (or the end of the file) follows it.
+    static bool chunk_looks_valid(SourceReader& reader, uint64_t offset, uint64_t filesize) {
+        if (offset + 0x20 > filesize) return false;
+        const uint8_t* header = reader.view(offset, 0x20);
+        if (!plausible_chunk_header(header, filesize - offset)) return false;
+        const uint64_t next = chunk_end(header, offset);
+        if (next + 4 > filesize) return true;
+        return is_chunk_signature(reader.view(next, 4));
+    }
 
-        while (uint64_t(f.tellg()) < filesize) {
-            uint64_t offset = uint64_t(f.tellg());
+    // First offset at or after `from` where `valid` accepts a chunk, or
+    // `filesize` if there is none.
+    static uint64_t resync(SourceReader& reader, uint64_t from, uint64_t filesize,
+        bool (*valid)(SourceReader&, uint64_t, uint64_t) = chunk_looks_valid) {
+        uint64_t pos = from;
+        while (pos + 4 <= filesize) {
+            const size_t n = size_t(std::min<uint64_t>(reader.max_view(), filesize - pos));
+            size_t i = 0;
+            while (true) {
+                // Validating a candidate may move the reader's window.
+                const uint8_t* p = reader.view(pos, n);
+                i += find_chunk_signature(p + i, n - i);
+                if (i >= n) break;
+                if (valid(reader, pos + i, filesize)) return pos + i;
+                i++;
+            }
+            // Overlap by 3 bytes so a signature across the boundary is seen.
+            pos += n - 3;
+        }
+        return filesize;
+    }
 
-            Bytes header(0x20);
-            f.read(reinterpret_cast<char*>(header.data()), header.size());
-            if (!f) break;
+    // Chunks that must chain after a candidate segment start before a
+    // parallel scan uses it.
+    static constexpr int kBoundaryChain = 8;
+
+    // Minimum bytes per segment of a parallel scan; below this the threads
+    // cost more than they save.
+    static constexpr uint64_t kMinScanSegment = uint64_t(64) << 20;
+
+    static bool chain_looks_valid(SourceReader& reader, uint64_t offset, uint64_t filesize) {
+        for (int i = 0; i < kBoundaryChain; i++) {
+            // The scan ignores a tail too short for a header, so a chain may
+            // end there.
+            if (offset + 0x20 > filesize) return true;
+            const uint8_t* header = reader.view(offset, 0x20);
+            if (!plausible_chunk_header(header, filesize - offset)) return false;
+            offset += chunk_total_size(header);
+        }
+        return true;
+    }
 
-            auto [payload_size, padding_size] = chunk_size_and_padding(header);
+    // What a chunk scan collects: stream packets go straight into the
+    // channel indexes, chunks carrying pages are only located and parsed
+    // afterwards, in file order.
+    struct ScanResult {
+        explicit ScanResult(std::pmr::memory_resource* mr)
+            : video_ch(mr), audio_ch(mr), alpha_ch(mr) {
+        }
 
-            // seek back and read full chunk header + payload (no padding)
-            f.seekg(int64_t(-0x20), std::ios::cur);
+        ChannelMap* channels(ChunkType type) {
+            if (type == ChunkType::VIDEO) return &video_ch;
+            if (type == ChunkType::AUDIO) return &audio_ch;
+            if (type == ChunkType::ALPHA) return &alpha_ch;
+            return nullptr;
+        }
 
-            Bytes chunk_bytes(size_t(0x20 + payload_size));
-            f.read(reinterpret_cast<char*>(chunk_bytes.data()), chunk_bytes.size());
-            if (!f) throw std::runtime_error("Failed to read chunk bytes");
+        ChannelMap video_ch;
+        ChannelMap audio_ch;
+        ChannelMap alpha_ch;
+        std::vector<std::pair<uint64_t, size_t>> page_chunks;  // (offset, header + payload)
+        std::vector<SkippedRange> skipped;
+        uint64_t end = 0;  // offset the scan stopped at
+    };
 
-            // skip padding
-            f.seekg(padding_size, std::ios::cur);
+    // Walks chunks from `offset` while they start before `stop`.
+    static void scan_chunks(SourceReader& reader, uint64_t offset, uint64_t stop,
+        const OpenOptions& options, ScanResult& out) {
+        const uint64_t filesize = reader.source().size();
+        const bool hash_packets = options.packet_hash != HashAlgorithm::NONE;
+
+        // STREAM chunks only touch the fixed header and the index vectors, so
+        // the per-packet loop does not allocate.
+        Bytes spill;
+
+        while (offset < stop && offset + 0x20 <= filesize) {
+            if (options.recover && !chunk_looks_valid(reader, offset, filesize)) {
+                const uint8_t* hp = reader.view(offset, 0x20);
+                const bool plausible = plausible_chunk_header(hp, filesize - offset);
+                const bool cut = !plausible && plausible_chunk_header(hp, UINT64_MAX);
+                const uint64_t end = chunk_end(hp, offset);
+                const uint64_t next = resync(reader, offset + 1, filesize);
+                // A sane chunk that ends before the next good one is intact
+                // and the damage comes after it; keep it, and the next pass
+                // skips the damage. Otherwise its size cannot be trusted.
+                if (!plausible || end > next) {
+                    out.skipped.push_back({ offset, next - offset,
+                        cut && next == filesize ? "Truncated chunk" : "Damaged chunk header" });
+                    offset = next;
+                    continue;
+                }
+            }
 
-            UsmChunk c = UsmChunk::from_bytes(chunk_bytes, encoding);
+            const uint8_t* header = reader.view(offset, 0x20);
+            ChunkHeader h = ChunkHeader::parse(header);
+            if (h.payload_offset + h.payload_size > 0x20 + h.payload_size) {
+                throw std::runtime_error("Chunk buffer missing payload bytes");
+            }
+            if (offset + 0x20 + uint64_t(h.payload_size) > filesize) {
+                throw std::runtime_error("Failed to read chunk bytes");
+            }
 
-            if (c.chunk_type == ChunkType::INFO) {
-                if (std::holds_alternative<std::vector<UsmPage>>(c.payload)) {
-                    const auto& pages = std::get<std::vector<UsmPage>>(c.payload);
-                    crids.insert(crids.end(), pages.begin(), pages.end());
+            ChannelMap* dst = out.channels(h.chunk_type);
+            const bool wanted = h.chunk_type == ChunkType::INFO ||
+                (dst != nullptr && h.payload_type != PayloadType::SECTION_END);
+
+            if (h.payload_type == PayloadType::STREAM && dst != nullptr) {
+                auto& ch = (*dst)[h.channel_number];
+                ch.stream.push_back(offset + uint64_t(h.payload_offset),
+                    uint32_t(h.payload_size), h.frame_time, h.frame_rate);
+                if (hash_packets) {
+                    const uint64_t payload = offset + uint64_t(h.payload_offset);
+                    Hasher hasher(options.packet_hash);
+                    hasher.update(reader.view(payload, h.payload_size, spill), h.payload_size);
+                    ch.packet_hashes.push_back(hasher.digest());
                 }
-                continue;
             }
+            else if (wanted) {
+                out.page_chunks.push_back({ offset, size_t(0x20 + h.payload_size) });
+            }
+            else if (dst != nullptr) {
+                (*dst)[h.channel_number];
+            }
+            offset += 0x20 + uint64_t(h.payload_size) + h.padding;
+        }
+        out.end = offset;
+    }
 
-            if (c.chunk_type == ChunkType::VIDEO) {
-                chunk_helper(video_ch, c, offset);
+    static void merge_channels(ChannelMap& dst, ChannelMap& src) {
+        for (auto& [chno, accum] : src) {
+            auto& ch = dst[chno];
+            ch.stream.append(accum.stream);
+            ch.packet_hashes.insert(ch.packet_hashes.end(), accum.packet_hashes.begin(),
+                accum.packet_hashes.end());
+        }
+    }
+
+    // Splits the scan into `segments` indexed on separate threads. Each
+    // segment starts at the first chain of plausible chunks at or after its
+    // nominal start and scans up to the next one's. The pieces stitch only
+    // if every segment ended exactly where the next began, which proves each
+    // start is a boundary of the sequential walk; otherwise (or if a segment
+    // threw) this returns false and the caller scans sequentially.
+    static bool scan_parallel(const ByteSource& source, size_t segments,
+        const OpenOptions& options, ScanResult& out) {
+        const uint64_t filesize = source.size();
+        auto nominal = [&](size_t k) { return k == segments ? filesize : filesize / segments * k; };
+
+        // options.mr need not be thread-safe, so segments allocate from the
+        // heap and are merged into `out` afterwards.
+        std::vector<ScanResult> parts;
+        parts.reserve(segments);
+        for (size_t k = 0; k < segments; k++) parts.emplace_back(std::pmr::new_delete_resource());
+        std::vector<uint64_t> starts(segments, 0);
+        std::atomic<bool> failed{ false };
+
+        auto scan_segment = [&](size_t k) {
+            try {
+                SourceReader reader(source);
+                if (k > 0) starts[k] = resync(reader, nominal(k), filesize, chain_looks_valid);
+                scan_chunks(reader, starts[k], nominal(k + 1), options, parts[k]);
             }
-            else if (c.chunk_type == ChunkType::AUDIO) {
-                chunk_helper(audio_ch, c, offset);
+            catch (const std::exception&) {
+                failed = true;
             }
-            else if (c.chunk_type == ChunkType::ALPHA) {
-                chunk_helper(alpha_ch, c, offset);
+            };
+
+        std::vector<std::thread> threads;
+        for (size_t k = 1; k < segments; k++) threads.emplace_back(scan_segment, k);
+        scan_segment(0);
+        for (auto& t : threads) t.join();
+
+        if (failed) return false;
+        for (size_t k = 0; k + 1 < segments; k++) {
+            if (parts[k].end != starts[k + 1]) return false;
+        }
+
+        for (auto& part : parts) {
+            merge_channels(out.video_ch, part.video_ch);
+            merge_channels(out.audio_ch, part.audio_ch);
+            merge_channels(out.alpha_ch, part.alpha_ch);
+            out.page_chunks.insert(out.page_chunks.end(), part.page_chunks.begin(),
+                part.page_chunks.end());
+        }
+        out.end = parts.back().end;
+        return true;
+    }
+
+    Usm::Usm(std::pmr::memory_resource* mr) : usm_crid_("CRIUSF_DIR_STREAM", mr) {}
+
+    Usm Usm::open(const std::filesystem::path& path, std::optional<uint64_t> key,
+        const std::string& encoding, std::pmr::memory_resource* mr) {
+        return open(path, OpenOptions{ key, encoding, mr });
+    }
+
+    Usm Usm::open(std::shared_ptr<const ByteSource> source, std::optional<uint64_t> key,
+        const std::string& encoding, std::pmr::memory_resource* mr) {
+        return open(std::move(source), OpenOptions{ key, encoding, mr });
+    }
+
+    Usm Usm::open(const std::filesystem::path& path, const OpenOptions& options) {
+        if (!std::filesystem::exists(path)) {
+            throw std::runtime_error("File not found");
+        }
+        Usm out = open(std::make_shared<FileSource>(path), options);
+        out.path_ = path;
+        return out;
+    }
+
+    Usm Usm::open(std::shared_ptr<const ByteSource> source, const OpenOptions& options) {
+        if (source == nullptr) throw std::runtime_error("Null source");
+        const std::string& encoding = options.encoding;
+        std::pmr::memory_resource* mr = options.mr;
+
+        const uint64_t filesize = source->size();
+        if (filesize <= 0x20) throw std::runtime_error("File too small");
+
+        SourceReader reader(*source);
+
+        const uint8_t* head = reader.view(0, 4);
+        Bytes magic(head, head + 4);
+        if (!is_usm_magic(magic) && !options.recover) {
+            throw std::runtime_error("Invalid file signature: " + bytes_to_hex(magic));
+        }
+
+        // Recovery resyncs from wherever the damage is, so it always scans
+        // sequentially.
+        const size_t segments = options.recover ? 1 : size_t(std::min<uint64_t>(
+            std::max(1u, options.jobs), std::max<uint64_t>(1, filesize / kMinScanSegment)));
+
+        ScanResult scan(mr);
+        if (segments < 2 || !scan_parallel(*source, segments, options, scan)) {
+            scan_chunks(reader, 0, filesize, options, scan);
+        }
+        std::vector<SkippedRange> skipped = std::move(scan.skipped);
+        if (options.recover && scan.end < filesize) {
+            skipped.push_back({ scan.end, filesize - scan.end, "Truncated chunk" });
+        }
+
+        // Page chunks are few; parse them in file order through one buffer.
+        std::pmr::vector<UsmPage> crids(mr);
+        Bytes chunk_bytes;
+        for (const auto& [chunk_offset, size] : scan.page_chunks) {
+            chunk_bytes.resize(size);
+            source->read_at(chunk_offset, chunk_bytes.data(), size);
+
+            try {
+                UsmChunk c = UsmChunk::from_bytes(chunk_bytes, encoding, mr);
+
+                if (c.chunk_type == ChunkType::INFO) {
+                    if (std::holds_alternative<std::vector<UsmPage>>(c.payload)) {
+                        auto& pages = std::get<std::vector<UsmPage>>(c.payload);
+                        crids.insert(crids.end(), std::make_move_iterator(pages.begin()),
+                            std::make_move_iterator(pages.end()));
+                    }
+                }
+                else {
+                    chunk_helper(*scan.channels(c.chunk_type), c);
+                }
+            }
+            catch (const std::exception& e) {
+                if (!options.recover) throw;
+                skipped.push_back({ chunk_offset, uint64_t(size), e.what() });
             }
         }
+        std::stable_sort(skipped.begin(), skipped.end(),
+            [](const SkippedRange& a, const SkippedRange& b) { return a.offset < b.offset; });
+        ChannelMap& video_ch = scan.video_ch;
+        ChannelMap& audio_ch = scan.audio_ch;
+        ChannelMap& alpha_ch = scan.alpha_ch;
+
+        Usm out(mr);
+        out.path_ = source->name();
+        out.source_ = std::move(source);
+        out.key_ = options.key;
+        out.encoding_ = encoding;
+        out.packet_hash_ = options.packet_hash;
+        out.skipped_ = std::move(skipped);
+
+        // CRID pages come from one @UTF table, so the binding resolves the
+        // field names once for all of them.
+        CridBinding crid_fields;
 
         // Find USM CRID page (chno == -1).
-        std::optional<UsmPage> usm_crid;
-        for (const auto& p : crids) {
-            if (p.get("chno").has_value()) {
-                int16_t chno = get_i16(p, "chno");
-                if (chno == -1) {
-                    usm_crid = p;
-                    break;
-                }
+        bool found_usm_crid = false;
+        for (auto& p : crids) {
+            if (crid_fields(p).find<fields::crid::chno>() == -1) {
+                out.usm_crid_ = std::move(p);
+                found_usm_crid = true;
+                break;
             }
         }
-        if (!usm_crid.has_value()) {
+        if (!found_usm_crid) {
             throw std::runtime_error("No usm crid page found");
         }
 
-        Usm out;
-        out.path_ = path;
-        out.key_ = key;
-        out.encoding_ = encoding;
-        out.usm_crid_ = *usm_crid;
-
-        auto build_tracks = [&](const std::unordered_map<int, ChannelAccum>& m,
-            uint32_t want_stmid) -> std::vector<Track> {
+        // Pages and indexes are moved (never copied) into the tracks, so they
+        // stay in `mr`. Each CRID page matches at most one track.
+        auto build_tracks = [&](ChannelMap& m, ChunkType type) -> std::vector<Track> {
+                const uint32_t want_stmid = uint32_t(type);
                 std::vector<Track> tracks;
                 tracks.reserve(m.size());
 
-                for (const auto& [chno, accum] : m) {
+                for (auto& [chno, accum] : m) {
                     // Find matching CRIUSF_DIR_STREAM page for channel and stmid.
-                    std::optional<UsmPage> crid_match;
-                    for (const auto& p : crids) {
-                        if (!p.get("chno").has_value() || !p.get("stmid").has_value()) continue;
-                        if (get_i16(p, "chno") != int16_t(chno)) continue;
-                        if (uint32_t(get_i32(p, "stmid")) != want_stmid) continue;
-                        crid_match = p;
+                    UsmPage* crid_match = nullptr;
+                    for (auto& p : crids) {
+                        auto row = crid_fields(p);
+                        auto p_chno = row.find<fields::crid::chno>();
+                        auto p_stmid = row.find<fields::crid::stmid>();
+                        if (!p_chno.has_value() || !p_stmid.has_value()) continue;
+                        if (*p_chno != int16_t(chno)) continue;
+                        if (uint32_t(*p_stmid) != want_stmid) continue;
+                        crid_match = &p;
                         break;
                     }
-                    if (!crid_match.has_value()) {
+                    if (crid_match == nullptr) {
                         throw std::runtime_error("No crid page found for channel " +
                             std::to_string(chno));
                     }
 
-                    Track t;
-                    t.channel_number = chno;
-                    t.crid = *crid_match;
-                    t.header = accum.header;
-                    t.metadata = accum.metadata;
-                    t.stream = accum.stream;
-                    tracks.push_back(std::move(t));
+                    tracks.push_back(Track{ type, chno, std::move(*crid_match),
+                        std::move(accum.header), std::move(accum.metadata),
+                        std::move(accum.stream),
+                        std::move(accum.packet_hashes) });
                 }
 
                 std::sort(tracks.begin(), tracks.end(),
@@ -200,16 +520,15 @@ namespace usm {
                 return tracks;
             };
 
-        out.videos_ = build_tracks(video_ch, uint32_t(ChunkType::VIDEO));
-        out.audios_ = build_tracks(audio_ch, uint32_t(ChunkType::AUDIO));
-        out.alphas_ = build_tracks(alpha_ch, uint32_t(ChunkType::ALPHA));
+        out.videos_ = build_tracks(video_ch, ChunkType::VIDEO);
+        out.audios_ = build_tracks(audio_ch, ChunkType::AUDIO);
+        out.alphas_ = build_tracks(alpha_ch, ChunkType::ALPHA);
 
         // version from fmtver of video channel 0 (if present).
         for (const auto& v : out.videos_) {
             if (v.channel_number != 0) continue;
-            auto fmtver = v.crid.get("fmtver");
-            if (fmtver.has_value() && fmtver->type == ElementType::I32) {
-                out.version_ = int(std::get<int32_t>(fmtver->val));
+            if (auto fmtver = crid_fields(v.crid).find<fields::crid::fmtver>()) {
+                out.version_ = int(*fmtver);
             }
             break;
         }
@@ -218,89 +537,361 @@ namespace usm {
     }
 
     std::filesystem::path Usm::filepath() const { return path_; }
+    std::shared_ptr<const ByteSource> Usm::source() const { return source_; }
+    std::optional<uint64_t> Usm::key() const { return key_; }
+    const std::string& Usm::encoding() const { return encoding_; }
 
     const std::vector<Track>& Usm::videos() const { return videos_; }
     const std::vector<Track>& Usm::audios() const { return audios_; }
     const std::vector<Track>& Usm::alphas() const { return alphas_; }
 
+    const Track* Usm::find_track(ChunkType type, int channel_number) const {
+        const std::vector<Track>* tracks = nullptr;
+        if (type == ChunkType::VIDEO) tracks = &videos_;
+        else if (type == ChunkType::AUDIO) tracks = &audios_;
+        else if (type == ChunkType::ALPHA) tracks = &alphas_;
+        else return nullptr;
+
+        for (const auto& t : *tracks) {
+            if (t.channel_number == channel_number) return &t;
+        }
+        return nullptr;
+    }
+
     const UsmPage& Usm::usm_crid_page() const { return usm_crid_; }
 
     std::optional<int> Usm::version() const { return version_; }
 
+    HashAlgorithm Usm::packet_hash() const { return packet_hash_; }
+
+    const std::vector<SkippedRange>& Usm::skipped() const { return skipped_; }
+
+    // Incremental demux: the manifest is rewritten every kCheckpointBytes,
+    // each time after syncing the output, so it never claims bytes that are
+    // not on disk.
+    static constexpr uint64_t kCheckpointBytes = uint64_t(64) << 20;
+    static constexpr uint64_t kManifestVersion = 1;
+
+    static std::filesystem::path manifest_path(const std::filesystem::path& out_path) {
+        std::filesystem::path p = out_path;
+        p += ".manifest";
+        return p;
+    }
+
+    // Identifies what an output is made of: the packet layout and the keys
+    // that transform the packets. With the source's size and mtime this
+    // catches a rewritten source without reading it.
+    static std::string track_fingerprint(const Track& t, std::optional<uint64_t> key,
+        std::optional<uint64_t> hca_key) {
+        Hasher hasher(HashAlgorithm::XXH64);
+        auto put = [&](uint64_t v) {
+            uint8_t b[8];
+            for (int i = 0; i < 8; i++) b[i] = uint8_t(v >> (8 * i));
+            hasher.update(b, sizeof(b));
+            };
+        put(key.has_value());
+        put(key.value_or(0));
+        put(hca_key.has_value());
+        put(hca_key.value_or(0));
+        for (const auto& [off, sz] : t.stream) {
+            put(off);
+            put(sz);
+        }
+        return hasher.hex();
+    }
+
+    static std::optional<Json> read_manifest(const std::filesystem::path& out_path) {
+        std::ifstream f(manifest_path(out_path), std::ios::binary);
+        if (!f) return std::nullopt;
+        const std::string text((std::istreambuf_iterator<char>(f)),
+            std::istreambuf_iterator<char>());
+        try {
+            Json manifest = Json::parse(text);
+            if (manifest.is_object()) return manifest;
+        }
+        catch (const std::exception&) {
+            // A torn or foreign file: demux the output again.
+        }
+        return std::nullopt;
+    }
+
+    // Replaces the manifest by rename, so a reader sees the old one or the
+    // new one.
+    static void write_manifest(const std::filesystem::path& out_path, const Json& manifest) {
+        const std::filesystem::path path = manifest_path(out_path);
+        std::filesystem::path tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            f << manifest.dump() << "\n";
+            if (!f) throw std::runtime_error("Failed to write " + tmp.string());
+        }
+        std::filesystem::rename(tmp, path);
+    }
+
+    // Feeds the first `n` bytes of an existing output to `hasher`.
+    static void hash_file(const std::filesystem::path& path, uint64_t n, Hasher& hasher) {
+        FileHandle in = FileHandle::open_read(path);
+        Bytes buf;
+        for (uint64_t done = 0; done < n;) {
+            const size_t step = size_t(std::min<uint64_t>(n - done, 1 << 20));
+            buf.resize(step);
+            pread_all(in.fd(), done, buf.data(), step);
+            hasher.update(buf.data(), step);
+            done += step;
+        }
+    }
+
     void Usm::demux(const std::filesystem::path& out_dir, bool save_video,
         bool save_audio, bool save_alpha,
         std::optional<uint64_t> key_override) const {
-        std::optional<uint64_t> use_key = key_override.has_value() ? key_override : key_;
-        std::optional<Bytes> video_key;
-        std::optional<Bytes> audio_key;
+        DemuxOptions options;
+        options.video = save_video;
+        options.audio = save_audio;
+        options.alpha = save_alpha;
+        options.key_override = key_override;
+        demux(out_dir, options);
+    }
 
-        if (use_key.has_value()) {
-            auto [vk, ak] = generate_keys(*use_key);
-            video_key = std::move(vk);
-            audio_key = std::move(ak);
-        }
+    std::vector<DemuxedTrack> Usm::demux(const std::filesystem::path& out_dir,
+        const DemuxOptions& options) const {
+        const std::optional<uint64_t> effective_key =
+            options.key_override.has_value() ? options.key_override : key_;
+        std::optional<Keys> keys = keys_for(effective_key);
 
         std::string folder = path_.filename().string();
+        if (folder.empty()) folder = "usm";
         folder = slugify_utf8(folder, true);
 
         std::filesystem::path out_root = out_dir / folder;
         std::filesystem::create_directories(out_root);
 
-        auto write_track = [&](const Track& t, const std::filesystem::path& subdir,
-            bool is_video, bool is_audio) {
-                std::ifstream in(path_, std::ios::binary);
-                if (!in) throw std::runtime_error("Failed to open input in demux");
-
-                std::string name = get_str(t.crid, "filename");
+        std::vector<DemuxedTrack> results;
+        CridBinding crid_fields;
+        auto write_track = [&](const Track& t, const std::filesystem::path& subdir) {
+                std::string name(crid_fields(t.crid).get<fields::crid::filename>());
                 name = slugify_utf8(basename_utf8(name), true);
 
+                const uint64_t total = t.stream.total_bytes();
+
                 std::filesystem::path out_path = subdir / name;
-                std::ofstream out(out_path, std::ios::binary);
-                if (!out) throw std::runtime_error("Failed to open output: " +
-                    out_path.string());
-
-                for (const auto& [off, sz] : t.stream) {
-                    Bytes buf(sz);
-                    in.seekg(int64_t(off), std::ios::beg);
-                    in.read(reinterpret_cast<char*>(buf.data()), buf.size());
-                    if (!in) throw std::runtime_error("Failed to read payload at offset");
-
-                    if (use_key.has_value()) {
-                        if (is_video && video_key.has_value()) {
-                            buf = decrypt_video_packet(buf, *video_key);
+
+                std::optional<HcaDecrypter> hca;
+                if (options.hca_key.has_value() && t.chunk_type == ChunkType::AUDIO) {
+                    hca.emplace(*options.hca_key);
+                }
+
+                // The manifest a finished or interrupted run left behind
+                // says how much of the output can be kept.
+                Json source;
+                uint64_t resume_packets = 0;
+                uint64_t resume_bytes = 0;
+                if (options.incremental) {
+                    std::error_code ec;
+                    const auto mtime = std::filesystem::last_write_time(path_, ec);
+                    source["size"] = source_->size();
+                    source["mtime"] = ec ? int64_t(0) : int64_t(mtime.time_since_epoch().count());
+                    source["fingerprint"] = track_fingerprint(t, effective_key, options.hca_key);
+
+                    std::optional<Json> old = read_manifest(out_path);
+                    const uint64_t have = std::filesystem::exists(out_path, ec) ?
+                        std::filesystem::file_size(out_path, ec) : 0;
+                    auto number = [&](const char* name) {
+                        const Json* v = old->find(name);
+                        return v != nullptr ? v->as_u64().value_or(0) : 0;
+                        };
+                    const Json* old_source = old.has_value() ? old->find("source") : nullptr;
+                    if (old_source != nullptr && !ec &&
+                        number("version") == kManifestVersion &&
+                        old_source->dump() == source.dump() &&
+                        number("packets") == t.stream.size()) {
+                        const uint64_t packets = number("packets_written");
+                        const uint64_t bytes = number("bytes_written");
+                        const Json* complete = old->find("complete");
+                        if (complete != nullptr && complete->as_bool().value_or(false) &&
+                            bytes == total && have == total) {
+                            std::string digest;
+                            if (options.hash != HashAlgorithm::NONE) {
+                                const Json* algo = old->find("hash_algorithm");
+                                const Json* hex = old->find("hash");
+                                if (algo != nullptr && hex != nullptr && algo->as_string() &&
+                                    hex->as_string() &&
+                                    *algo->as_string() == hash_algorithm_name(options.hash)) {
+                                    digest = *hex->as_string();
+                                }
+                                else {
+                                    Hasher hasher(options.hash);
+                                    hash_file(out_path, total, hasher);
+                                    digest = hasher.hex();
+                                }
+                            }
+                            results.push_back({ t.chunk_type, t.channel_number, out_path, total,
+                                digest, true, total });
+                            return;
+                        }
+
+                        // Trust the claim only if it ends on a packet boundary.
+                        uint64_t sum = 0;
+                        auto it = t.stream.begin();
+                        for (uint64_t i = 0; i < packets && it != t.stream.end(); i++, ++it) {
+                            sum += (*it).second;
+                        }
+                        if (packets <= t.stream.size() && sum == bytes && bytes <= have) {
+                            resume_packets = packets;
+                            resume_bytes = bytes;
+                        }
+                    }
+                }
+
+                auto manifest = [&](uint64_t packets, uint64_t bytes, const Hasher* hasher) {
+                    Json m;
+                    m["version"] = kManifestVersion;
+                    m["source"] = source;
+                    m["packets"] = uint64_t(t.stream.size());
+                    m["packets_written"] = packets;
+                    m["bytes_written"] = bytes;
+                    m["complete"] = hasher != nullptr;
+                    if (hasher != nullptr && hasher->algorithm() != HashAlgorithm::NONE) {
+                        m["hash_algorithm"] = hash_algorithm_name(hasher->algorithm());
+                        m["hash"] = hasher->hex();
+                    }
+                    return m;
+                    };
+
+                // Nothing to decrypt or hash: copy the payloads without the
+                // per-packet loop (see kernel_copy_track).
+                if (!keys.has_value() && !hca.has_value() &&
+                    options.hash == HashAlgorithm::NONE && !options.incremental) {
+                    FileHandle file = FileHandle::open_write(out_path);
+                    if (kernel_copy_track(*source_, t, file.fd())) {
+                        results.push_back({ t.chunk_type, t.channel_number, out_path, total, {} });
+                        return;
+                    }
+                }
+
+                Hasher hasher(options.hash);
+                if (resume_packets > 0) {
+                    // The kept bytes are hashed from the output, and an HCA
+                    // decrypter is brought up to the resume point by
+                    // replaying the packets without writing them.
+                    hash_file(out_path, resume_bytes, hasher);
+                    if (hca.has_value()) {
+                        Bytes buf;
+                        auto it = t.stream.begin();
+                        for (uint64_t i = 0; i < resume_packets; i++, ++it) {
+                            const auto [off, sz] = *it;
+                            buf.resize(sz);
+                            source_->read_at(off, buf.data(), sz);
+                            if (keys.has_value()) {
+                                decrypt_packet(buf.data(), sz, t.chunk_type, *keys);
+                            }
+                            hca->process(buf.data(), sz);
                         }
-                        else if (is_audio && audio_key.has_value()) {
-                            buf = crypt_audio_packet(buf, *audio_key);
+                    }
+                }
+                else if (options.incremental) {
+                    write_manifest(out_path, manifest(0, 0, nullptr));
+                }
+
+                FileWriter out(out_path, total, options.writer, resume_bytes);
+
+                // Packets known to be on disk, advanced at each checkpoint.
+                auto checkpoint = t.stream.iterator_at(size_t(resume_packets));
+                uint64_t checkpoint_packets = resume_packets;
+                uint64_t checkpoint_bytes = resume_bytes;
+                uint64_t next_checkpoint = resume_bytes + kCheckpointBytes;
+
+                for (auto it = t.stream.iterator_at(size_t(resume_packets));
+                    it != t.stream.end(); ++it) {
+                    const auto [off, sz] = *it;
+                    // Read and decrypt straight into the output buffer.
+                    uint8_t* dst = out.prepare(sz);
+                    source_->read_at(off, dst, sz);
+
+                    if (keys.has_value()) {
+                        decrypt_packet(dst, sz, t.chunk_type, *keys);
+                    }
+                    if (hca.has_value()) hca->process(dst, sz);
+
+                    // Hash while the packet is still in cache.
+                    hasher.update(dst, sz);
+                    out.commit(sz);
+
+                    if (options.incremental && out.written() >= next_checkpoint) {
+                        const uint64_t durable = out.sync();
+                        while (checkpoint != t.stream.end() &&
+                            checkpoint_bytes + (*checkpoint).second <= durable) {
+                            checkpoint_bytes += (*checkpoint).second;
+                            checkpoint_packets++;
+                            ++checkpoint;
                         }
+                        write_manifest(out_path,
+                            manifest(checkpoint_packets, checkpoint_bytes, nullptr));
+                        next_checkpoint = out.written() + kCheckpointBytes;
                     }
+                }
+                out.finish();
 
-                    out.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+                if (options.incremental) {
+                    out.sync();
+                    write_manifest(out_path, manifest(t.stream.size(), total, &hasher));
                 }
+
+                results.push_back({ t.chunk_type, t.channel_number, out_path, total,
+                    options.hash == HashAlgorithm::NONE ? std::string() : hasher.hex(),
+                    false, resume_bytes });
             };
 
-        if (save_video && !videos_.empty()) {
-            auto sub = out_root / "videos";
-            std::filesystem::create_directories(sub);
-            for (const auto& t : videos_) {
-                write_track(t, sub, true, false);
-            }
-        }
+        auto write_group = [&](bool wanted, const std::vector<Track>& tracks,
+            const char* subdir) {
+                if (!wanted || tracks.empty()) return;
+                auto sub = out_root / subdir;
+                std::filesystem::create_directories(sub);
+                for (const auto& t : tracks) {
+                    write_track(t, sub);
+                }
+            };
 
-        if (save_audio && !audios_.empty()) {
-            auto sub = out_root / "audios";
-            std::filesystem::create_directories(sub);
-            for (const auto& t : audios_) {
-                write_track(t, sub, false, true);
+        write_group(options.video, videos_, "videos");
+        write_group(options.audio, audios_, "audios");
+        write_group(options.alpha, alphas_, "alphas");
+        return results;
+    }
+
+    void Usm::demux_track(const Track& track, int out_fd,
+        std::optional<uint64_t> key_override, std::optional<uint64_t> hca_key) const {
+        std::optional<Keys> keys =
+            keys_for(key_override.has_value() ? key_override : key_);
+        std::optional<HcaDecrypter> hca;
+        if (hca_key.has_value() && track.chunk_type == ChunkType::AUDIO) hca.emplace(*hca_key);
+
+        if (!keys.has_value() && !hca.has_value()) {
+            if (kernel_copy_track(*source_, track, out_fd)) return;
+
+            // Not file-backed, or the kernel path is unavailable for this fd
+            // pair: copy in user space.
+            const uint8_t* mem = source_->data();
+            Bytes buf;
+            for (const auto& [off, sz] : track.stream) {
+                if (mem != nullptr) {
+                    write_all(out_fd, mem + off, sz);
+                    continue;
+                }
+                buf.resize(sz);
+                source_->read_at(off, buf.data(), sz);
+                write_all(out_fd, buf.data(), sz);
             }
+            return;
         }
 
-        if (save_alpha && !alphas_.empty()) {
-            auto sub = out_root / "alphas";
-            std::filesystem::create_directories(sub);
-            for (const auto& t : alphas_) {
-                write_track(t, sub, true, false);
-            }
+        Bytes buf;
+        for (const auto& [off, sz] : track.stream) {
+            buf.resize(sz);
+            source_->read_at(off, buf.data(), sz);
+            if (keys.has_value()) decrypt_packet(buf.data(), sz, track.chunk_type, *keys);
+            if (hca.has_value()) hca->process(buf.data(), sz);
+            write_all(out_fd, buf.data(), sz);
         }
     }
 
-}  // namespace usm
\ No newline at end of file
+}  // namespace usm